@@ -28,6 +28,7 @@
   *      00h-0Fh Processors, 43170 Rev 3.06 - March 16, 2011.
   */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <fcntl.h>
@@ -40,13 +41,461 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <termios.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 
 
 int wrmsr(int cpu, off_t msr, uint64_t val);
 int rdmsr(int cpu, off_t msr, uint64_t * val);
 
-static int verbose = 0, ncpu = 0;
+/** msrOp
+ *
+ * One access of a batch run by msrBatch(). */
+struct msrOp {
+	int cpu;
+	int write;
+	off_t msr;
+	uint64_t val;
+	int err;
+};
+
+enum { BACKEND_SERIAL, BACKEND_THREADED, BACKEND_BATCHED, BACKEND_NCOUNT };
+
+static const char * backendNames[BACKEND_NCOUNT] = {"serial", "threaded", "batched"};
+
+	/** The largest simulated topology. */
+#define SIM_MAX_CPUS	1024
+
+static int msrBatch(struct msrOp * ops, int n);
+static int simInit(const char * spec);
+static void simSetup(int cpus, int packages, int smt, long latencyNs);
+static int simActive(void);
+static double simTemperature(void);
+static void simTopology(int * cpus, int * packages, int * smt, long * latencyNs);
+
+	/** --backend and --threads : how msrBatch() runs the accesses, and
+	 * the number of worker threads of the threaded backend, 0 for one per
+	 * online cpu. */
+static int msrBackend = BACKEND_SERIAL, msrThreads = 0;
+
+static int verbose = 0, quiet = 0, ncpu = 0;
+
+enum { VENDOR_UNKNOWN, VENDOR_AMD, VENDOR_INTEL };
+
+	/** The processor, as identified by cpuIdCheck() or simulated. */
+static int cpuVendor = VENDOR_UNKNOWN, cpuFamily = 0, cpuModel = 0, cpuStepping = 0;
+	/** Intel HWP is supported (hwp in the cpuinfo flags). */
+static int cpuHwp = 0;
+
+static int isFamily14h(void) {
+	return cpuVendor == VENDOR_AMD && cpuFamily == 0x14;
+}
+
+	/** AMD Family 17h (Zen) and later. */
+static int isFamily17h(void) {
+	return cpuVendor == VENDOR_AMD && cpuFamily >= 0x17;
+}
+
+/** cpuSet
+ *
+ * A set of cpus as a bitmap, iterated with forEachCpu() which jumps from
+ * one set bit to the next, so that sparse sets on large systems cost the
+ * number of words plus the number of cpus selected. */
+#define CPUSET_MAX	4096
+#define CPUSET_WORDS	(CPUSET_MAX / 64)
+
+struct cpuSet {
+	uint64_t bits[CPUSET_WORDS];
+};
+
+static inline void cpuSetAdd(struct cpuSet * s, int cpu) {
+	s->bits[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static inline int cpuSetHas(const struct cpuSet * s, int cpu) {
+	return cpu >= 0 && cpu < CPUSET_MAX && (s->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/* Return the first cpu of the set at or after cpu, or -1. */
+static inline int cpuSetNext(const struct cpuSet * s, int cpu) {
+	int w = cpu / 64;
+	uint64_t word;
+
+	if(cpu < 0 || cpu >= CPUSET_MAX)
+		return -1;
+	word = s->bits[w] & (~0ULL << (cpu % 64));
+	while(word == 0) {
+		if(++w == CPUSET_WORDS)
+			return -1;
+		word = s->bits[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+static inline int cpuSetCount(const struct cpuSet * s) {
+	int w, n = 0;
+
+	for(w = 0; w < CPUSET_WORDS; w++)
+		n += __builtin_popcountll(s->bits[w]);
+	return n;
+}
+
+#define forEachCpu(cpu, set) \
+	for((cpu) = cpuSetNext((set), 0); (cpu) >= 0; (cpu) = cpuSetNext((set), (cpu) + 1))
+
+/* Set s to cpus 0 to n - 1. */
+static void cpuSetFill(struct cpuSet * s, int n) {
+	int cpu;
+
+	memset(s, 0, sizeof(*s));
+	for(cpu = 0; cpu < n && cpu < CPUSET_MAX; cpu++)
+		cpuSetAdd(s, cpu);
+}
+
+/** cpuSetParse
+ *
+ * Parse a cpulist as in /sys/devices/system/cpu/online: comma separated
+ * cpus and ranges, e.g. 0-3,8,10-15. */
+static int cpuSetParse(struct cpuSet * s, const char * list) {
+	const char * p = list;
+	char * end;
+	long a, b;
+
+	memset(s, 0, sizeof(*s));
+	do {
+		a = strtol(p, &end, 10);
+		if(end == p || a < 0)
+			return (1);
+		b = a;
+		p = end;
+		if(*p == '-') {
+			b = strtol(++p, &end, 10);
+			if(end == p || b < a)
+				return (1);
+			p = end;
+		}
+		if(b >= CPUSET_MAX)
+			return (1);
+		for(; a <= b; a++)
+			cpuSetAdd(s, a);
+	} while(*p++ == ',');
+	return p[-1] != '\0';
+}
+
+	/** The cpus all commands apply to, --cpus or all of them. */
+static struct cpuSet targetCpus;
+
+/*****************************************************************************
+ * Register schema.
+ *
+ * Every register the program touches is declared once below, per family:
+ * its address space, address, number of consecutive instances and
+ * description, then each of its fields with low bit, width and largest
+ * valid value. The X-macros expand these into:
+ * - REG_<reg> identifiers and the regInfo[] table,
+ * - <reg>_<field>(v) and <reg>_<field>_set(v, x) inline accessors,
+ * - <reg>_<field>_LO/_WIDTH constants and REG_ENCODE() for initializers,
+ * - the regFields[] table used by regPrint() and regCheck().
+ * Supporting a new family is a matter of adding its rows.
+ */
+
+	/** Family 14h registers [1]. */
+#define MSR_PSTATE_LIMIT	0xC0010061
+#define MSR_PSTATE_CTL		0xC0010062
+#define MSR_PSTATE_STATUS	0xC0010063
+#define MSR_PSTATE_DEF		0xC0010064
+#define MSR_COFVID_STATUS	0xC0010071
+	/** Actual and maximum performance frequency clock counters. */
+#define MSR_MPERF		0xE7
+#define MSR_APERF		0xE8
+	/** Northbridge registers in PCI function D18F3. */
+#define NB_PCI_CONFIG		"/sys/bus/pci/devices/0000:00:18.3/config"
+#define NB_REPORTED_TEMP	0xA4
+#define NB_CLOCK_POWER_CTL	0xD4
+
+	/** Intel architectural registers. */
+#define MSR_PLATFORM_INFO	0xCE
+#define MSR_OC_MAILBOX		0x150
+#define MSR_PERF_STATUS		0x198
+#define MSR_PERF_CTL		0x199
+#define MSR_UNCORE_RATIO_LIMIT	0x620
+#define MSR_UNCORE_PERF_STATUS	0x621
+#define MSR_PM_ENABLE		0x770
+#define MSR_HWP_CAPABILITIES	0x771
+#define MSR_HWP_REQUEST_PKG	0x772
+#define MSR_HWP_REQUEST		0x774
+	/** RAPL energy counters of AMD Family 17h and later and of Intel. */
+#define MSR_AMD_RAPL_PWR_UNIT	0xC0010299
+#define MSR_AMD_CORE_ENERGY	0xC001029A
+#define MSR_AMD_PKG_ENERGY	0xC001029B
+#define MSR_RAPL_POWER_UNIT	0x606
+#define MSR_PKG_POWER_LIMIT	0x610
+#define MSR_PKG_ENERGY_STATUS	0x611
+#define MSR_PP0_ENERGY_STATUS	0x639
+	/** AMD Family 17h and later collaborative processor performance
+	 * control. */
+#define MSR_CPPC_CAP1		0xC00102B0
+#define MSR_CPPC_ENABLE		0xC00102B1
+#define MSR_CPPC_CAP2		0xC00102B2
+#define MSR_CPPC_REQ		0xC00102B3
+	/** Overclocking mailbox command reading a voltage offset, and polls of
+	 * its BUSY bit, 10 us apart. */
+#define OC_CMD_READ_OFFSET	0x10
+#define OC_RETRIES		1000
+
+	/** SPACE_MSR_F17H holds the MSRs whose layout differs on AMD Family 17h
+	 * and later, where regFind() looks them up first. */
+enum { SPACE_MSR, SPACE_NB, SPACE_MSR_F17H };
+
+#define F14H_REGISTERS(X) \
+	X(PSTATE_LIMIT,		SPACE_MSR, MSR_PSTATE_LIMIT,	1, "P-state current limit") \
+	X(PSTATE_CTL,		SPACE_MSR, MSR_PSTATE_CTL,	1, "P-state control") \
+	X(PSTATE_STATUS,	SPACE_MSR, MSR_PSTATE_STATUS,	1, "P-state status") \
+	X(PSTATE_DEF,		SPACE_MSR, MSR_PSTATE_DEF,	8, "P-state definition") \
+	X(COFVID_STATUS,	SPACE_MSR, MSR_COFVID_STATUS,	1, "COFVID status") \
+	X(MPERF,		SPACE_MSR, MSR_MPERF,		1, "max performance frequency clock count") \
+	X(APERF,		SPACE_MSR, MSR_APERF,		1, "actual performance frequency clock count") \
+	X(REPORTED_TEMP,		SPACE_NB,  NB_REPORTED_TEMP,	1, "reported temperature control") \
+	X(CLOCK_POWER_CTL,	SPACE_NB,  NB_CLOCK_POWER_CTL,	1, "clock power/timing control 2")
+
+#define F14H_FIELDS(X) \
+	X(PSTATE_LIMIT,		MAX_VAL,	4,  3, 7) \
+	X(PSTATE_LIMIT,		CUR_LIMIT,	0,  3, 7) \
+	X(PSTATE_CTL,		CMD,		0,  3, 7) \
+	X(PSTATE_STATUS,	CUR_PSTATE,	0,  3, 7) \
+	X(PSTATE_DEF,		EN,		63, 1, 1) \
+	X(PSTATE_DEF,		IDD_DIV,	40, 2, 2) \
+	X(PSTATE_DEF,		IDD_VALUE,	32, 8, 0xFF) \
+	X(PSTATE_DEF,		VID,		9,  7, 0x7F) \
+	X(PSTATE_DEF,		DID_MSD,	4,  5, 0x19) \
+	X(PSTATE_DEF,		DID_LSD,	0,  4, 3) \
+	X(COFVID_STATUS,	MIN_VID,	42, 7, 0x7F) \
+	X(COFVID_STATUS,	MAX_VID,	35, 7, 0x7F) \
+	X(COFVID_STATUS,	CUR_PSTATE,	16, 3, 7) \
+	X(COFVID_STATUS,	CUR_VID,	9,  7, 0x7F) \
+	X(COFVID_STATUS,	CUR_DID_MSD,	4,  5, 0x19) \
+	X(COFVID_STATUS,	CUR_DID_LSD,	0,  4, 3) \
+	X(REPORTED_TEMP,		CUR_TMP,	21, 11, 0x7FF) \
+	X(CLOCK_POWER_CTL,	MAIN_PLL_OP_FREQ_ID, 0, 6, 0x3F)
+
+#define INTEL_REGISTERS(X) \
+	X(PLATFORM_INFO,	SPACE_MSR, MSR_PLATFORM_INFO,	1, "MSR_PLATFORM_INFO") \
+	X(OC_MAILBOX,		SPACE_MSR, MSR_OC_MAILBOX,	1, "overclocking mailbox") \
+	X(PERF_STATUS,		SPACE_MSR, MSR_PERF_STATUS,	1, "IA32_PERF_STATUS") \
+	X(PERF_CTL,		SPACE_MSR, MSR_PERF_CTL,	1, "IA32_PERF_CTL") \
+	X(UNCORE_RATIO_LIMIT,	SPACE_MSR, MSR_UNCORE_RATIO_LIMIT, 1, "MSR_UNCORE_RATIO_LIMIT") \
+	X(UNCORE_PERF_STATUS,	SPACE_MSR, MSR_UNCORE_PERF_STATUS, 1, "MSR_UNCORE_PERF_STATUS") \
+	X(PM_ENABLE,		SPACE_MSR, MSR_PM_ENABLE,	1, "IA32_PM_ENABLE") \
+	X(HWP_CAPABILITIES,	SPACE_MSR, MSR_HWP_CAPABILITIES, 1, "IA32_HWP_CAPABILITIES") \
+	X(HWP_REQUEST_PKG,	SPACE_MSR, MSR_HWP_REQUEST_PKG, 1, "IA32_HWP_REQUEST_PKG") \
+	X(HWP_REQUEST,		SPACE_MSR, MSR_HWP_REQUEST,	1, "IA32_HWP_REQUEST")
+
+#define HWP_REQUEST_FIELDS(X, reg) \
+	X(reg,			MIN,		0,  8, 0xFF) \
+	X(reg,			MAX,		8,  8, 0xFF) \
+	X(reg,			DESIRED,	16, 8, 0xFF) \
+	X(reg,			EPP,		24, 8, 0xFF) \
+	X(reg,			ACTIVITY_WINDOW, 32, 10, 0x3FF)
+
+#define INTEL_FIELDS(X) \
+	X(PLATFORM_INFO,	MAX_NON_TURBO_RATIO, 8, 8, 0xFF) \
+	X(PLATFORM_INFO,	MAX_EFFICIENCY_RATIO, 40, 8, 0xFF) \
+	X(OC_MAILBOX,		BUSY,		63, 1, 1) \
+	X(OC_MAILBOX,		PLANE,		40, 3, 4) \
+	X(OC_MAILBOX,		CMD,		32, 8, 0xFF) \
+	X(OC_MAILBOX,		OFFSET,		21, 11, 0x7FF) \
+	X(PERF_STATUS,		RATIO,		8,  8, 0xFF) \
+	X(PERF_STATUS,		VOLTAGE,	32, 16, 0xFFFF) \
+	X(PERF_CTL,		RATIO,		8,  8, 0xFF) \
+	X(PERF_CTL,		IDA_DISENGAGE,	32, 1, 1) \
+	X(UNCORE_RATIO_LIMIT,	MAX_RATIO,	0,  7, 0x7F) \
+	X(UNCORE_RATIO_LIMIT,	MIN_RATIO,	8,  7, 0x7F) \
+	X(UNCORE_PERF_STATUS,	CURRENT_RATIO,	0,  7, 0x7F) \
+	X(PM_ENABLE,		HWP_ENABLE,	0,  1, 1) \
+	X(HWP_CAPABILITIES,	HIGHEST,	0,  8, 0xFF) \
+	X(HWP_CAPABILITIES,	GUARANTEED,	8,  8, 0xFF) \
+	X(HWP_CAPABILITIES,	EFFICIENT,	16, 8, 0xFF) \
+	X(HWP_CAPABILITIES,	LOWEST,		24, 8, 0xFF) \
+	HWP_REQUEST_FIELDS(X, HWP_REQUEST_PKG) \
+	HWP_REQUEST_FIELDS(X, HWP_REQUEST) \
+	X(HWP_REQUEST,		PKG_CONTROL,	42, 1, 1)
+
+#define F17H_REGISTERS(X) \
+	X(F17H_PSTATE_DEF,	SPACE_MSR_F17H, MSR_PSTATE_DEF,	8, "P-state definition") \
+	X(CPPC_CAP1,		SPACE_MSR, MSR_CPPC_CAP1,	1, "CPPC capability 1") \
+	X(CPPC_ENABLE,		SPACE_MSR, MSR_CPPC_ENABLE,	1, "CPPC enable") \
+	X(CPPC_CAP2,		SPACE_MSR, MSR_CPPC_CAP2,	1, "CPPC capability 2") \
+	X(CPPC_REQ,		SPACE_MSR, MSR_CPPC_REQ,	1, "CPPC request")
+
+#define F17H_FIELDS(X) \
+	X(F17H_PSTATE_DEF,	EN,		63, 1, 1) \
+	X(F17H_PSTATE_DEF,	IDD_DIV,	30, 2, 2) \
+	X(F17H_PSTATE_DEF,	IDD_VALUE,	22, 8, 0xFF) \
+	X(F17H_PSTATE_DEF,	VID,		14, 8, 0xFF) \
+	X(F17H_PSTATE_DEF,	DFS_ID,		8,  6, 0x3F) \
+	X(F17H_PSTATE_DEF,	FID,		0,  8, 0xFF) \
+	X(CPPC_CAP1,		LOWEST,		0,  8, 0xFF) \
+	X(CPPC_CAP1,		LOWEST_NONLINEAR, 8, 8, 0xFF) \
+	X(CPPC_CAP1,		NOMINAL,	16, 8, 0xFF) \
+	X(CPPC_CAP1,		HIGHEST,	24, 8, 0xFF) \
+	X(CPPC_ENABLE,		EN,		0,  1, 1) \
+	X(CPPC_CAP2,		CONSTRAINED,	0,  8, 0xFF) \
+	X(CPPC_REQ,		MAX,		0,  8, 0xFF) \
+	X(CPPC_REQ,		MIN,		8,  8, 0xFF) \
+	X(CPPC_REQ,		DESIRED,	16, 8, 0xFF) \
+	X(CPPC_REQ,		EPP,		24, 8, 0xFF)
+
+#define RAPL_UNIT_FIELDS(X, reg) \
+	X(reg,			POWER,		0,  4, 0xF) \
+	X(reg,			ENERGY,		8,  5, 0x1F) \
+	X(reg,			TIME,		16, 4, 0xF)
+
+#define RAPL_REGISTERS(X) \
+	X(AMD_RAPL_PWR_UNIT,	SPACE_MSR, MSR_AMD_RAPL_PWR_UNIT, 1, "RAPL power unit") \
+	X(AMD_CORE_ENERGY,	SPACE_MSR, MSR_AMD_CORE_ENERGY,	1, "core energy status") \
+	X(AMD_PKG_ENERGY,	SPACE_MSR, MSR_AMD_PKG_ENERGY,	1, "package energy status") \
+	X(RAPL_POWER_UNIT,	SPACE_MSR, MSR_RAPL_POWER_UNIT,	1, "MSR_RAPL_POWER_UNIT") \
+	X(PKG_POWER_LIMIT,	SPACE_MSR, MSR_PKG_POWER_LIMIT,	1, "MSR_PKG_POWER_LIMIT") \
+	X(PKG_ENERGY_STATUS,	SPACE_MSR, MSR_PKG_ENERGY_STATUS, 1, "MSR_PKG_ENERGY_STATUS") \
+	X(PP0_ENERGY_STATUS,	SPACE_MSR, MSR_PP0_ENERGY_STATUS, 1, "MSR_PP0_ENERGY_STATUS")
+
+#define RAPL_FIELDS(X) \
+	RAPL_UNIT_FIELDS(X, AMD_RAPL_PWR_UNIT) \
+	RAPL_UNIT_FIELDS(X, RAPL_POWER_UNIT) \
+	X(PKG_POWER_LIMIT,	PL1,		0,  15, 0x7FFF) \
+	X(PKG_POWER_LIMIT,	PL1_EN,		15, 1, 1) \
+	X(PKG_POWER_LIMIT,	PL1_CLAMP,	16, 1, 1) \
+	X(PKG_POWER_LIMIT,	PL1_TIME_Y,	17, 5, 0x1F) \
+	X(PKG_POWER_LIMIT,	PL1_TIME_Z,	22, 2, 3) \
+	X(PKG_POWER_LIMIT,	PL2,		32, 15, 0x7FFF) \
+	X(PKG_POWER_LIMIT,	PL2_EN,		47, 1, 1) \
+	X(PKG_POWER_LIMIT,	PL2_CLAMP,	48, 1, 1) \
+	X(PKG_POWER_LIMIT,	PL2_TIME_Y,	49, 5, 0x1F) \
+	X(PKG_POWER_LIMIT,	PL2_TIME_Z,	54, 2, 3) \
+	X(PKG_POWER_LIMIT,	LOCK,		63, 1, 1) \
+	X(AMD_CORE_ENERGY,	TOTAL,		0, 32, 0xFFFFFFFF) \
+	X(AMD_PKG_ENERGY,	TOTAL,		0, 32, 0xFFFFFFFF) \
+	X(PKG_ENERGY_STATUS,	TOTAL,		0, 32, 0xFFFFFFFF) \
+	X(PP0_ENERGY_STATUS,	TOTAL,		0, 32, 0xFFFFFFFF)
+
+#define ALL_REGISTERS(X)	F14H_REGISTERS(X) INTEL_REGISTERS(X) F17H_REGISTERS(X) RAPL_REGISTERS(X)
+#define ALL_FIELDS(X)		F14H_FIELDS(X) INTEL_FIELDS(X) F17H_FIELDS(X) RAPL_FIELDS(X)
+
+#define REG_ID(reg, space, addr, count, desc)	REG_##reg,
+enum { ALL_REGISTERS(REG_ID) REG_COUNT };
+
+#define REG_POS(reg, field, lo, width, max) \
+	reg##_##field##_LO = (lo), reg##_##field##_WIDTH = (width),
+enum { ALL_FIELDS(REG_POS) };
+
+	/** Field value x shifted in place, usable in constant initializers. */
+#define REG_ENCODE(reg, field, x) \
+	(((uint64_t)(x) & ((1ULL << reg##_##field##_WIDTH) - 1)) << reg##_##field##_LO)
+
+#define REG_ACCESSORS(reg, field, lo, width, max) \
+static inline uint64_t reg##_##field(uint64_t v) { \
+	return (v >> (lo)) & ((1ULL << (width)) - 1); \
+} \
+static inline uint64_t reg##_##field##_set(uint64_t v, uint64_t x) { \
+	return (v & ~(((1ULL << (width)) - 1) << (lo))) | REG_ENCODE(reg, field, x); \
+}
+ALL_FIELDS(REG_ACCESSORS)
+
+static const struct regInfo {
+	const char * name, * desc;
+	int space;
+	uint64_t addr;
+	int count;
+} regInfo[REG_COUNT] = {
+#define REG_INFO(reg, space, addr, count, desc)	{#reg, desc, space, addr, count},
+	ALL_REGISTERS(REG_INFO)
+};
+
+static const struct regField {
+	int reg;
+	const char * name;
+	unsigned lo, width;
+	uint64_t max;
+} regFields[] = {
+#define REG_FIELD(reg, field, lo, width, max)	{REG_##reg, #field, lo, width, max},
+	ALL_FIELDS(REG_FIELD)
+};
+
+#define REG_NFIELDS	(int)(sizeof(regFields) / sizeof(regFields[0]))
+
+static inline uint64_t regFieldGet(int f, uint64_t val) {
+	return (val >> regFields[f].lo) & (((uint64_t)1 << regFields[f].width) - 1);
+}
+
+/** regFind
+ *
+ * Return the schema entry of a register by address space and address, or
+ * -1 if it is not described. */
+static int regFind(int space, uint64_t addr) {
+	int r;
+
+	if(space == SPACE_MSR && isFamily17h() && (r = regFind(SPACE_MSR_F17H, addr)) >= 0)
+		return r;
+	for(r = 0; r < REG_COUNT; r++)
+		if(regInfo[r].space == space && addr >= regInfo[r].addr
+				&& addr < regInfo[r].addr + regInfo[r].count)
+			return r;
+	return -1;
+}
+
+/** regPrint
+ *
+ * Print the fields of a register value, e.g. for verbose output. */
+static void regPrint(FILE * stream, int reg, uint64_t val) {
+	int f;
+
+	fprintf(stream, "  %s:", regInfo[reg].name);
+	for(f = 0; f < REG_NFIELDS; f++)
+		if(regFields[f].reg == reg)
+			fprintf(stream, " %s=0x%" PRIX64, regFields[f].name, regFieldGet(f, val));
+	fprintf(stream, "\n");
+}
+
+/** regCheck
+ *
+ * Complain about fields of a register value above their largest valid
+ * value. Returns the number of such fields. */
+static int regCheck(int reg, uint64_t val) {
+	uint64_t x;
+	int f, bad = 0;
+
+	for(f = 0; f < REG_NFIELDS; f++) {
+		if(regFields[f].reg != reg)
+			continue;
+		x = regFieldGet(f, val);
+		if(x > regFields[f].max) {
+			printf("Strange %s %" PRIx64 " > 0x%" PRIx64 "?\n", regFields[f].name, x, regFields[f].max);
+			bad++;
+		}
+	}
+	return bad;
+}
 
 /** voltage
  * 
@@ -66,14 +515,152 @@ static double voltage(long SviVid) {
  * Display a text describing all options to the program and exit.
  */
 static void usage(const char * progName) {
-	fprintf(stderr, "Usage: %s [-c] [-r] [-v] [-p <P-state no>:<Vid>]\n"
-	"\t-c\tDisplay information on the current P-state for all cpu cores.\n"
+	fprintf(stderr, "Usage: %s [-c] [-r] [-v] [-p <P-state no>:<Vid>] [-g <policy>]\n"
+	"\t-c\tDisplay information on the current P-state for all cpu cores,\n"
+	"\t\tfrom IA32_PERF_STATUS on Intel.\n"
 	"\t-h\tDisplay this information.\n"
 	"\t-r\tRead information from all valid P-states.\n"
 	"\t-v\tVerbose. Display information on all reads and writes to\n"
 	"\t\tregisters.\n"
 	"\t-p <P-state no>:<Vid>[,<div>]\n"
-	"\t\tSet Vid (and if supplied, div) for the P-state no for all cores.\n", progName);
+	"\t\tSet Vid (and if supplied, div) for the P-state no for all cores.\n"
+	"\t--offset <mV>\n"
+	"\t\tShift the Vid of all enabled P-states by a signed offset, e.g.\n"
+	"\t\t-50, in steps of 12.5 mV within the fused limits.\n"
+	"\t--what-if <residency>\n"
+	"\t\tEstimate the energy the -p or --offset values would save over\n"
+	"\t\ta recorded P-state residency instead of setting them: lines of\n"
+	"\t\tP<n> <seconds>, or a copy of cpufreq's stats/time_in_state.\n"
+	"\t\tRepeat for the residency of several hosts. A first line\n"
+	"\t\ttable <file> [<P0 MHz>] gives the host's P-state table, saved\n"
+	"\t\tfrom -r, if it is not this one.\n"
+	"\t--compare <profile>,<profile>[,...]\n"
+	"\t\tCompare the -p or --offset options of profiles of --profiles,\n"
+	"\t\tnamed, over interleaved trials in a random order, and report\n"
+	"\t\tthe throughput and energy per unit of work differences.\n"
+	"\t--compare-trials <n>,<ms>\n"
+	"\t\tTrials of each profile and their length (default 10,1000).\n"
+	"\t--workload <command>\n"
+	"\t\tShell command the compared profiles run over and over, instead\n"
+	"\t\tof spinning on all target cpus.\n"
+	"\t--hwp\tDisplay voltage offsets and Intel HWP capabilities and requests.\n"
+	"\t--hwp-set min=<perf>,max=<perf>,desired=<perf>,epp=<value>\n"
+	"\t\tSet any of the HWP request fields on Intel processors. epp is\n"
+	"\t\t0-255 or performance, balance_performance, balance_power, power.\n"
+	"\t--force-pstate <P-state no>\n"
+	"\t\tMove all cores to a P-state, on Intel one of the bus ratios\n"
+	"\t\tlisted by -r. Set the cpufreq governor to userspace first.\n"
+	"\t--force-ratio <ratio>\n"
+	"\t\tSet any bus ratio (x 100 MHz) in IA32_PERF_CTL on Intel. HWP\n"
+	"\t\tmust be off, else the request is ignored.\n"
+	"\t--smu\tDisplay the PPT, TDC and EDC limits of AMD Family 17h and\n"
+	"\t\tlater, where the SMU or the ryzen_smu driver reports them.\n"
+	"\t--smu-set ppt=<W>,tdc=<A>,edc=<A>\n"
+	"\t\tSet package power and current limits through the SMU mailbox.\n"
+	"\t--smu-file <path>\n"
+	"\t\tUse a file with an emulated SMU instead of the hardware.\n"
+	"\t--power-limit\n"
+	"\t\tDisplay the package power limits PL1 and PL2 on Intel.\n"
+	"\t--power-limit-set pl1=<W>,time1=<s>,pl2=<W>,time2=<s>\n"
+	"\t\tSet, enable and clamp the package power limits.\n"
+	"\t--power-limit-verify\n"
+	"\t\tLoad the target cpus for the PL1 time window and check the\n"
+	"\t\taverage package power against PL1, and the highest power over\n"
+	"\t\t--interval against PL2.\n"
+	"\t--uncore\n"
+	"\t\tDisplay the uncore ratio limits and current ratio of each\n"
+	"\t\tpackage on Intel.\n"
+	"\t--uncore-set min=<ratio>,max=<ratio>\n"
+	"\t\tSet the uncore ratio limits (x 100 MHz) of the packages.\n"
+	"\t--bench-uncore <ratio list>\n"
+	"\t\tMeasure memory copy throughput and package power with the\n"
+	"\t\tuncore pinned to each ratio in turn, e.g. 12,16,20,24.\n"
+	"\t--cppc\tDisplay AMD CPPC capabilities and requests (Family 17h and\n"
+	"\t\tlater, also shown by -r there).\n"
+	"\t--cppc-set min=<perf>,max=<perf>,desired=<perf>,epp=<value>\n"
+	"\t\tSet any of the CPPC request fields, as --hwp-set.\n"
+	"\t--power\tMeasure package and core power over --interval, with the\n"
+	"\t\tRAPL energy counters on AMD Family 17h and later and Intel, or\n"
+	"\t\testimated from the current P-states on Family 14h.\n"
+	"\t--cpus <cpu list>\n"
+	"\t\tRestrict all commands to a subset of the cores, e.g. 0-3,8,10-15.\n"
+	"\t--acpi\tDisplay the P-states declared in the ACPI _PSS packages of each\n"
+	"\t\tprocessor with their power, next to the power estimated for the\n"
+	"\t\tcurrent Vids.\n"
+	"\t--acpi-tables <dir>\n"
+	"\t\tRead the ACPI tables from a directory other than\n"
+	"\t\t/sys/firmware/acpi/tables.\n"
+	"\t--profiles <file>\n"
+	"\t\tAdd the options of the first profile of the file matching the\n"
+	"\t\tcpu family, model, stepping and DMI board identifiers.\n"
+	"\t--dmi <dir>\n"
+	"\t\tRead the DMI identifiers from a directory other than\n"
+	"\t\t/sys/class/dmi/id.\n"
+	"\t--sim cpus=<n>,packages=<n>,smt=<n>,latency=<us>,vendor=<amd|intel>,family=<n>\n"
+	"\t\tUse a simulated msr backend instead of the hardware.\n"
+	"\t--backend <serial|threaded|batched>\n"
+	"\t\tHow accesses to many cpus are run: one after the other, spread\n"
+	"\t\tover --threads threads, or grouped per cpu from that cpu.\n"
+	"\t--bench-scale\n"
+	"\t\tMeasure -r, -c, -p and sampling throughput of all backends on\n"
+	"\t\tsimulated topologies from 1 cpu up to the --sim one.\n"
+	"\t-t, --top\n"
+	"\t\tLive dashboard of P-state, Vid, div, frequency and temperature\n"
+	"\t\tfor all cores, refreshed every --interval (at least 100 ms).\n"
+	"\t-d, --daemon\n"
+	"\t\tStay resident and apply the -p settings again on SIGHUP and\n"
+	"\t\twhen a cpu comes online.\n"
+	"\t--socket <path>\n"
+	"\t\tAccept apply, status and stop commands on a unix socket.\n"
+	"\t-g, --governor <reactive|predictive|capped|irq|slo>\n"
+	"\t\tSelect P-states with the given policy until interrupted. capped\n"
+	"\t\treacts as reactive but keeps each core within 60%% of the power\n"
+	"\t\tof the fastest P-state, irq as reactive but holds the cpus\n"
+	"\t\thandling over 1000 device interrupts/s in the fastest P-state,\n"
+	"\t\tslo follows a latency target, see --slo-target.\n"
+	"\t\tSet the cpufreq governor to userspace first.\n"
+	"\t--slo-target <us>\n"
+	"\t\tp99 latency the slo policy keeps the cpus just fast enough for,\n"
+	"\t\tread from --slo-metric, where the application writes it in us.\n"
+	"\t\tWhile the file is missing or not updated for 3 intervals, the\n"
+	"\t\tcpus are governed as by reactive.\n"
+	"\t--slo-metric <path>\n"
+	"\t\tLatency file of the slo policy (default /dev/shm/undervolt-p99).\n"
+	"\t--slo-load <requests/s>,<us>\n"
+	"\t\tWith -g slo, also serve synthetic requests of the given work at\n"
+	"\t\tthe fastest P-state on the first cpu and publish their p99.\n"
+	"\t--thermal-limit <C>\n"
+	"\t\tWith -g, fit an RC thermal model to the temperature and the\n"
+	"\t\testimated power, and slow the fastest P-state allowed down\n"
+	"\t\tbefore the temperature predicted --thermal-horizon seconds\n"
+	"\t\tahead (default 180) passes the limit.\n"
+	"\t--thermal-horizon <s>\n"
+	"\t\tHow far ahead the temperature is predicted.\n"
+	"\t--fan <hwmon dir>[:<pwm no>]\n"
+	"\t\tWith --thermal-limit, also drive this PWM fan (default pwm1),\n"
+	"\t\tpicking the P-state and the duty with the least CPU plus fan\n"
+	"\t\tpower under the limit. The firmware gets it back on exit.\n"
+	"\t--apu <drm device dir>\n"
+	"\t\tWith -g, share the power budget with the radeon GPU of this\n"
+	"\t\tdevice (e.g. /sys/class/drm/card0/device): cap the cores and set\n"
+	"\t\tthe GPU DPM state to performance while only the GPU is busy, and\n"
+	"\t\tthe reverse while only the cores are. Its settings are restored\n"
+	"\t\ton exit.\n"
+	"\t--rt-floor <P-state no>\n"
+	"\t\tWith -g, keep the cpus running SCHED_FIFO or SCHED_RR threads\n"
+	"\t\tin this P-state or a faster one.\n"
+	"\t--interval <ms>\n"
+	"\t\tSampling interval of the governor, the dashboard and --power\n"
+	"\t\t(default 100 ms).\n"
+	"\t--governor-eval <trace>\n"
+	"\t\tReplay a recorded utilization trace through all policies and\n"
+	"\t\treport prediction error, overload, backlog, energy, transitions\n"
+	"\t\tand policy overhead. A sample may be <utilization>@<P-state>.\n"
+	"\t--transition-latency <us>\n"
+	"\t\tP-state transition latency of the replay (default 100 us).\n"
+	"\t--pstate-table <file>\n"
+	"\t\tReplay on the P-state table saved from -r with the trace instead\n"
+	"\t\tof this machine's, without accessing the processor.\n", progName);
 	exit(1);
 }
 
@@ -82,15 +669,17 @@ static void usage(const char * progName) {
  * This function ensures we are on the right type of CPU. Uses /proc/cpuinfo
  * to retrieve the information about cpus without using the cpuid instruction.
  * Could check if the CPU has hwpstate in the power management line.
+ * P-state commands need an AMD Family 14h processor; on AMD Family 17h and
+ * later and on Intel processors only the architectural registers (HWP,
+ * RAPL, ...) are used, so any model goes.
  */
 static int cpuIdCheck() {
 	FILE * stream;
 	char * line = NULL;
 	size_t len = 0;
 	ssize_t read;
-	char * vendor_id = "AuthenticAMD";
 	char * s;
-	int vendorChecked = 0, familyChecked = 0;
+	int vendorChecked = 0, familyChecked = 0, modelChecked = 0, steppingChecked = 0, flagsChecked = 0;
 
 		/* open /dev/cpuinfo */
 	s = malloc(512);
@@ -103,21 +692,23 @@ static int cpuIdCheck() {
 		/* match first part of line with target and update data */
 		/* check data */
 		if (strncmp(line, "vendor_id", strlen("vendor_id")) == 0) {
-			sscanf(line, "vendor_id : %s", s);
-			if(strncmp(s, vendor_id, strlen(vendor_id)) != 0) {
+			sscanf(line, "vendor_id : %511s", s);
+			if(strcmp(s, "AuthenticAMD") == 0)
+				cpuVendor = VENDOR_AMD;
+			else if(strcmp(s, "GenuineIntel") == 0)
+				cpuVendor = VENDOR_INTEL;
+			else {
 				fprintf(stderr, "vendor_id %s is not supported\n", s);
 				return(1);
 			}
-			else {
-				if(verbose) printf("vendor_id checked\n");
-				vendorChecked = 1;
-			}
+			if(verbose) printf("vendor_id checked\n");
+			vendorChecked = 1;
 		}
 		if (strncmp(line, "cpu family", strlen("cpu family")) == 0) {
-			int f, r;
-			r = sscanf(line, "cpu family : %d", &f);
-			if((r != 1) || (f != 0x14)) {
-				fprintf(stderr, "cpu family %xd is not supported\n", f);
+			int r;
+			r = sscanf(line, "cpu family : %d", &cpuFamily);
+			if((r != 1) || (cpuVendor == VENDOR_AMD && cpuFamily != 0x14 && cpuFamily < 0x17)) {
+				fprintf(stderr, "cpu family %xh is not supported\n", cpuFamily);
 				return(1);
 			}
 			else {
@@ -128,16 +719,25 @@ static int cpuIdCheck() {
 			/* Model check: 1 is B0 stepping (C-30, C-50, E-350), 2 is
 			 * C0 stepping (C-60, E-450). */
 		if(strncmp(line, "model\t\t:", strlen("model\t\t:")) == 0) {
-			int m, r;
-			r = sscanf(line, "model : %d", &m);
-			if((r != 1) || ((m != 1) && (m != 2))) {
-				fprintf(stderr, "cpu model %xd is not supported\n", m);
+			int r;
+			r = sscanf(line, "model : %d", &cpuModel);
+			if((r != 1) || (isFamily14h() && (cpuModel != 1) && (cpuModel != 2))) {
+				fprintf(stderr, "cpu model %xh is not supported\n", cpuModel);
 				return(1);
 			}
 			else {
 				if(verbose) printf("cpu model checked\n");
+				modelChecked = 1;
 			}
 		}
+		if(strncmp(line, "stepping\t:", strlen("stepping\t:")) == 0) {
+			if(sscanf(line, "stepping : %d", &cpuStepping) == 1)
+				steppingChecked = 1;
+		}
+		if(strncmp(line, "flags\t\t:", strlen("flags\t\t:")) == 0) {
+			cpuHwp = strstr(line, " hwp ") != NULL || strstr(line, " hwp\n") != NULL;
+			flagsChecked = 1;
+		}
 		if(strncmp(line, "cpu cores\t:", strlen("cpu cores\t:")) == 0) {
 			int r;
 			r = sscanf(line, "cpu cores : %d", &ncpu);
@@ -153,37 +753,35 @@ static int cpuIdCheck() {
 			 * a problem to do the whole cpuinfo for two cores, but once you
 			 * end up on a 48 cores system, scanning the whole /proc/cpuinfo
 			 * is not very efficient :wink: */
-		if(vendorChecked && familyChecked && ncpu)
+		if(vendorChecked && familyChecked && modelChecked && steppingChecked && flagsChecked && ncpu)
 			break;
 	}
 	free(s);
 	free(line);
 	fclose(stream);
+		/* Intel and AMD Family 17h registers are per logical processor,
+		 * which "cpu cores" does not count, and there may be several
+		 * packages. */
+	if(vendorChecked && !isFamily14h())
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	if(!vendorChecked || ncpu <= 0) {
+		fprintf(stderr, "Error identifying the processor\n");
+		return(1);
+	}
 	return 0;
 }
 
-/* Check DidMSD + DidLSD and complain if necessary. */
-void checkdid(unsigned msd, unsigned lsd)
-{
-
-    if(verbose) printf("msd %u, lsd %u\n", msd, lsd);
-
-    if(msd > 0x19)
-        printf("Strange DidMSD %x > 0x19?\n", msd);
-
-    if(lsd > 3)
-        printf("Strange DidLSD %x > 3?\n", lsd);
-}
-
-/* Compute div from MSR values (DidMSD + DidLSD). */
+/* Compute div from MSR values (DidMSD + DidLSD). The P-state definition
+ * and COFVID status registers share the same layout there. */
 float msrtodiv(uint64_t val)
 {
     unsigned didmsd, didlsd;
 
     // DID is in two parts.
-    didmsd = (val >> 4) & 0x1f;
-    didlsd = val & 0xf;
-    checkdid(didmsd, didlsd);
+    didmsd = PSTATE_DEF_DID_MSD(val);
+    didlsd = PSTATE_DEF_DID_LSD(val);
+    if(verbose) printf("msd %u, lsd %u\n", didmsd, didlsd);
+    regCheck(REG_PSTATE_DEF, val & (REG_ENCODE(PSTATE_DEF, DID_MSD, ~0) | REG_ENCODE(PSTATE_DEF, DID_LSD, ~0)));
 
     // Divisor.
     return (float)didmsd + ((float)didlsd * 0.25) + 1;
@@ -198,208 +796,6504 @@ void divtomsr(float div, uint64_t *msr)
     didmsd = div - 1;
     div -= (int)div;
     didlsd = div * 4;
-    checkdid(didmsd, didlsd);
+    if(verbose) printf("msd %u, lsd %u\n", didmsd, didlsd);
 
-    *msr = (*msr & ~(uint64_t)0x1ff) | (didmsd << 4) | didlsd;
+    *msr = PSTATE_DEF_DID_LSD_set(PSTATE_DEF_DID_MSD_set(*msr, didmsd), didlsd);
+    regCheck(REG_PSTATE_DEF, *msr & (REG_ENCODE(PSTATE_DEF, DID_MSD, ~0) | REG_ENCODE(PSTATE_DEF, DID_LSD, ~0)));
 }
 
-/** main
+/** pstateTable
  *
- * setup, scan command line options, check the validity of the command
- * line options, and apply the commands. */
-int main (int argc, char **argv)
-{
-	int i, j, o, pstateId, vid, n = 0, maxPstate, minPstate, read = 0, current = 0;
-	uint64_t val,
-			/** There is a max of 8 P-states in Family 14h. */
-		vidToSet[8] = {0, 0, 0, 0, 0, 0, 0, 0},
-			/** A placeholder to hold the MSR values read. */
-		oMSR[8];
-			/** The MSR register addresses. */
-	off_t aMSR[8] = {0xC0010064, 0xC0010065, 0xC0010066, 0xC0010067, 0xC0010068, 0xC0010069, 0xC001006A, 0xC001006B};
-    float div,
-		divToSet[8] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
-	
-	while((o = getopt(argc, argv, "hcvrp:")) != -1){
- 		switch(o){
- 		case 'h':
- 			usage(argv[0]);
- 			exit(0);
- 		case 'v':
- 			verbose = 1;
- 			break;
- 		case 'r':
- 			read = 1;
- 			break;
- 		case 'c':
- 			current = 1;
- 			break;
- 		case 'p':
- 			div = 0.0;
-			n = sscanf(optarg, "%1d:%i,%f", &pstateId, &vid, &div);
-			if(n != 2 && n != 3) {
-				fprintf(stderr, "Error parsing '%s', it should be coreid:vid[,div]\n", optarg);
-				exit(1);
-			}
- 			if(pstateId < 0 || pstateId >= 8) {
- 				fprintf(stderr, "P-state %d is out of bounds\n", pstateId);
- 				exit(1);
- 			}
- 			if(vidToSet[pstateId] != 0) {
- 				fprintf(stderr, "Duplicate -p %d: option\n", pstateId);
- 				exit(1);
- 			}
- 			vidToSet[pstateId] = vid;
- 			divToSet[pstateId] = div;
- 			if(verbose) printf("vid 0x%x/%d / %.4fV, div %.02f to set for pstate %d\n", vid, vid, voltage(vid), div, pstateId);
- 			break;
- 		default:
- 			if(optind != (argc -1)){
- 				fprintf(stderr, "Invalid argument %s\n", argv[optind]);
- 				usage(argv[0]);
- 				exit(EXIT_FAILURE);
- 			}
- 			else {
-	 			usage(argv[0]);
-	 			exit(0);
- 			}
- 		}
-    }
-	cpuIdCheck();
-		/** Get maxPstate and minPstate. */
-	if(rdmsr(0, 0xC0010061, &val)) {
-		fprintf(stderr, "Failed reading msr register. Is the msr module loaded?\n");
-		exit(1);
-	}
-	maxPstate = (val & 0x70)>> 4;
-	minPstate = val & 0x07;
-	if(minPstate != 0) {
-		if(verbose) printf("Beware! Highest performance P-states are desactivated.\n");
-	}
-		/* Now check to see if the input is correct. */
-	for(i = 0; i < 8; i++) {
-		if(vidToSet[i] != 0 && (i > maxPstate || i < minPstate)) {
-			fprintf(stderr, "Error: P-state %d is not valid\n", i);
+ * The enabled P-states of a core as read from the P-state definition
+ * registers. cap is the capacity of a P-state relative to the fastest
+ * enabled one (the inverse of the divisor ratio), power its relative
+ * dynamic power V^2*f, also normalized on the fastest P-state. idd is the
+ * maximum current (IddValue / 10^IddDiv) in A, 0 if not fused. On Intel
+ * the table is made of up to 8 bus ratios from the maximum non-turbo one
+ * down to the most efficient one, ratio[], with div the ratio of the
+ * fastest over each. */
+struct pstateTable {
+	int min, max;
+	int ratio[8];
+	long vid[8];
+	float div[8];
+	double cap[8];
+	double power[8];
+	double idd[8];
+};
+
+/** pstateDerive
+ *
+ * Fill the capacity and relative power of each P-state of a table from its
+ * bus ratios (Intel, the voltage roughly following the frequency) or its
+ * Vids and divisors. */
+static void pstateDerive(struct pstateTable * t) {
+	double v0 = voltage(t->vid[t->min]), v;
+	int i;
+
+	for(i = t->min; i <= t->max; i++) {
+		if(t->ratio[t->min] != 0) {
+			t->div[i] = (float)t->ratio[t->min] / t->ratio[i];
+			t->cap[i] = 1 / t->div[i];
+			t->power[i] = t->cap[i] * t->cap[i] * t->cap[i];
+			continue;
 		}
+		v = voltage(t->vid[i]);
+		t->cap[i] = t->div[t->min] / t->div[i];
+		t->power[i] = (v0 > 0) ? t->cap[i] * (v * v) / (v0 * v0) : t->cap[i];
 	}
-		/* read command : read the MSR registers and display all */
-	if(read) {
-		printf("P-state\t\tVid\t\tVoltage\t\tdiv\n");
-		for(i = minPstate; i <= maxPstate; i++) {
-			if(rdmsr(0, aMSR[i], &(oMSR[i]))) {
-				fprintf(stderr, "Error reading msr registers\n");
-				exit(1);
-			}
-			printf("  %d\t\t0x%" PRIX64 "\t\t%.4fV\t\t%.02f\n", i, (oMSR[i] >> 9) & 0x7F, voltage((oMSR[i] >> 9) & 0x7F), msrtodiv(oMSR[i]));
-		}
+}
+
+/** loadPstateTable
+ *
+ * Read the P-state limits and all enabled P-state definitions of a cpu, so
+ * that the governor works on the undervolted table actually in use. */
+static int loadPstateTable(int cpu, struct pstateTable * t) {
+	struct msrOp ops[8];
+	uint64_t val;
+	int i, hi, lo;
+
+	memset(t, 0, sizeof(*t));
+	if(cpuVendor == VENDOR_INTEL) {
+		if(rdmsr(cpu, MSR_PLATFORM_INFO, &val))
+			return (1);
+		hi = PLATFORM_INFO_MAX_NON_TURBO_RATIO(val);
+		lo = PLATFORM_INFO_MAX_EFFICIENCY_RATIO(val);
+		if(hi == 0)
+			return (1);
+		if(lo == 0 || lo > hi)
+			lo = hi;
+		t->max = hi - lo < 7 ? hi - lo : 7;
+		for(i = 0; i <= t->max; i++)
+			t->ratio[i] = t->max ? hi - (hi - lo) * i / t->max : hi;
+		pstateDerive(t);
+		return (0);
 	}
-		/* write new Vid values in MSR registers, if any has been set. */
-	for(i = minPstate; i <= maxPstate; i++) {
-		long vid;
-		if(vidToSet[i] != 0) {
-				/* Interesting : writing to a single cpu MSR register change the
-				 * other, so the loop for all cpus should not be necessary ? */
-			for(j = 0; j < ncpu; j++) {
-				if(rdmsr(j, aMSR[i], &(oMSR[i]))) {
-					fprintf(stderr, "Error reading MSR register\n");
-					exit(1);
-				}
-				vid = (oMSR[i] >> 9) & 0x7F;
-				val = (oMSR[i] & (~(0x7F << 9))) | (vidToSet[i] << 9);
-				printf("P-state: %d, cpu: %d, changing vid: 0x%lX/%.4fV", i, j, vid, voltage(vid));
-				if(divToSet[i] != 0.0)
-					printf(", div: %.02f\n", msrtodiv(oMSR[i]));
-				printf(" to 0x%" PRIX64 "/%.4fV", vidToSet[i], voltage(vidToSet[i]));
-                if(divToSet[i] != 0.0){
-				   printf(", div: %.02f\n", div);
-                    divtomsr(divToSet[i], &val);
-                }
-                else
-                	printf("\n");
-				if(wrmsr(j, aMSR[i], val)) {
-					fprintf(stderr, "Error writing MSR register\n");
-					exit(1);
-				}
-			}
-		}
+	if(rdmsr(cpu, MSR_PSTATE_LIMIT, &val))
+		return (1);
+	t->max = PSTATE_LIMIT_MAX_VAL(val);
+	t->min = PSTATE_LIMIT_CUR_LIMIT(val);
+	memset(ops, 0, sizeof(ops));
+	for(i = t->min; i <= t->max; i++) {
+		ops[i].cpu = cpu;
+		ops[i].msr = MSR_PSTATE_DEF + i;
 	}
-		/* Command -c : read the current state of the cpu cores. */
-	if(current) {
-		for(i = 0; i < ncpu; i++) {
-			if(rdmsr(i, 0xC0010071, &val)) {
-				fprintf(stderr, "Error reading MSR register 0x%X\n", 0xC0010071);
-				exit(1);
-			}
-			printf("CPU %d: current P-state: %" PRIu64 ", current Vid: 0x%" PRIX64 "/%.4fV, current div: %.02f\n", i, (val >> 16) & 0x03, (val >> 9) & 0x7F, voltage((val >> 9) & 0x7F), msrtodiv(val));
-		}
+	if(msrBatch(&ops[t->min], t->max - t->min + 1))
+		return (1);
+	for(i = t->min; i <= t->max; i++) {
+		t->vid[i] = PSTATE_DEF_VID(ops[i].val);
+		t->div[i] = msrtodiv(ops[i].val);
+		t->idd[i] = PSTATE_DEF_IDD_VALUE(ops[i].val) / pow(10, PSTATE_DEF_IDD_DIV(ops[i].val));
 	}
-	exit(0);
+	pstateDerive(t);
+	return (0);
 }
 
-/** wrmsr
+/** loadPstateFile
  *
- * This function writes an msr register according to its parameters. Uses
- * /dev/cpu/cpu_no/msr. Requires root privileges. */
-int wrmsr(int cpu, off_t msr, uint64_t val) {
-	int fd;
-	ssize_t error;
-	char path[512];
+ * Read a P-state table saved from the output of -r, on this machine or
+ * another: lines of <P-state> <Vid> <voltage>V <div> after the Vid header,
+ * optionally followed by the IddValue in A, or of <P-state> <ratio> <MHz>
+ * after the Ratio header of Intel processors. */
+static int loadPstateFile(const char * path, struct pstateTable * t) {
+	FILE * stream;
+	char line[256];
+	double volts, idd;
+	unsigned long vid;
+	float div;
+	int i, ratio, fields, intel = -1, n = 0, lineNo = 0;
 
-	snprintf(path, 512, "/dev/cpu/%d/msr", cpu);
-	if(verbose)
-		printf("cpu %d msr %" PRIX64 " value %" PRIX64 " path %s\n", cpu, msr, val, path);
-	if ((fd = open(path, O_RDWR)) < 0) {
-		perror("Accessing msr device");
+	memset(t, 0, sizeof(*t));
+	if((stream = fopen(path, "r")) == NULL) {
+		perror(path);
 		return (1);
 	}
-	if (lseek(fd, msr, SEEK_SET) < 0) {
-		perror("Seek in msr");
-		return (1);
+	while(fgets(line, sizeof(line), stream) != NULL) {
+		lineNo++;
+		if(strstr(line, "P-state") != NULL) {
+			intel = strstr(line, "Ratio") != NULL;
+			continue;
+		}
+		if(intel < 0 || sscanf(line, "%d", &i) != 1)
+			continue;
+		if(intel) {
+			fields = sscanf(line, "%d %d", &i, &ratio);
+			fields = (fields == 2 && ratio > 0);
+		}
+		else {
+			fields = sscanf(line, "%d %li %lfV %f %lf", &i, &vid, &volts, &div, &idd);
+			fields = (fields >= 4 && div > 0) ? fields : 0;
+		}
+			/* The rows of -r are consecutive P-states. */
+		if(!fields || i < 0 || i >= 8 || (n > 0 && i != t->max + 1)) {
+			fprintf(stderr, "%s:%d: expected the P-state table of -r\n", path, lineNo);
+			fclose(stream);
+			return (1);
+		}
+		if(n++ == 0)
+			t->min = i;
+		t->max = i;
+		if(intel)
+			t->ratio[i] = ratio;
+		else {
+			t->vid[i] = vid;
+			t->div[i] = div;
+			t->idd[i] = (fields == 5) ? idd : 0;
+		}
 	}
-	error = write(fd, &val, sizeof(val));
-	if (error < (ssize_t)sizeof(val)) {
-		perror("Write msr register");
+	fclose(stream);
+	if(n == 0) {
+		fprintf(stderr, "%s: no P-state table, it should be the output of -r\n", path);
 		return (1);
 	}
-	if(verbose)
-		printf("msr %" PRIX64 " = %" PRIX64 "\n", msr, val);
-	if(close(fd)) {
-		perror("Closing msr device");
-		return(1);
-	}
+	pstateDerive(t);
 	return (0);
 }
 
-/** rdmsr
+/** pstateOfRatio
  *
- * This function reads an msr register according to its parameters. Uses
- * /dev/cpu/cpu_no/msr. Requires root privileges. */
-int rdmsr(int cpu, off_t msr, uint64_t * pVal) {
-	int fd;
-	ssize_t error;
-	char path[512];
+ * Return the P-state of the table running at a bus ratio, the fastest one
+ * for turbo ratios. */
+static int pstateOfRatio(const struct pstateTable * t, int ratio) {
+	int i;
 
-	snprintf(path, 512, "/dev/cpu/%d/msr", cpu);
-	if(verbose)
-		printf("cpu %d msr %" PRIX64 " path %s\n", cpu, msr, path);
-	if ((fd = open(path, O_RDWR)) < 0) {
-		perror("Open msr device");
-		return (1);
+	for(i = t->min; i < t->max; i++)
+		if(ratio >= t->ratio[i])
+			break;
+	return i;
+}
+
+/** pstateSelect
+ *
+ * Fill op with the write moving a cpu to a P-state of the table: PstateCmd
+ * on AMD, the ratio in IA32_PERF_CTL on Intel. */
+static void pstateSelect(const struct pstateTable * t, int pstate, struct msrOp * op) {
+	op->write = 1;
+	if(cpuVendor == VENDOR_INTEL) {
+		op->msr = MSR_PERF_CTL;
+		op->val = REG_ENCODE(PERF_CTL, RATIO, t->ratio[pstate]);
 	}
-	if (lseek(fd, msr, SEEK_SET) < 0) {
-		perror("Seek to msr register");
-		return (1);
+	else {
+		op->msr = MSR_PSTATE_CTL;
+		op->val = REG_ENCODE(PSTATE_CTL, CMD, pstate);
 	}
-	error = read(fd, pVal, sizeof(* pVal));
-	if (error < (ssize_t)sizeof(* pVal)) {
-		perror("Read msr register");
-		return (1);
+}
+
+	/** Register holding the current operating point: COFVID status on
+	 * AMD, IA32_PERF_STATUS on Intel. */
+#define MSR_CURRENT_STATUS	(cpuVendor == VENDOR_INTEL ? MSR_PERF_STATUS : MSR_COFVID_STATUS)
+
+/** statusDecode
+ *
+ * Return the P-state, voltage and divisor of a current status value. */
+static int statusDecode(const struct pstateTable * t, uint64_t val, double * volts, float * div) {
+	int ratio;
+
+	if(cpuVendor == VENDOR_INTEL) {
+		ratio = PERF_STATUS_RATIO(val);
+		*volts = PERF_STATUS_VOLTAGE(val) / 8192.0;
+		*div = ratio ? (float)t->ratio[t->min] / ratio : 0;
+		return pstateOfRatio(t, ratio);
 	}
-	if(verbose)
-		printf("msr %" PRIX64 " = %" PRIX64 "\n", msr, *pVal);
-	if(close(fd)) {
-		perror("Closing msr device");
+	*volts = voltage(COFVID_STATUS_CUR_VID(val));
+	*div = msrtodiv(val);
+	return COFVID_STATUS_CUR_PSTATE(val);
+}
+
+	/** Utilization of the selected P-state above which the governor steps
+	 * up, as the ondemand governor does. */
+#define GOV_UP_THRESHOLD	0.80
+	/** Smoothing factors of the level and trend of the predictive model. */
+#define GOV_HOLT_ALPHA		0.5
+#define GOV_HOLT_BETA		0.3
+	/** Power of a core allowed by the power-capped policy, relative to the
+	 * fastest P-state at full load. */
+#define GOV_POWER_CAP		0.60
+	/** Default P-state transition latency of the replay, in us. */
+#define GOV_TRANSITION_US	100
+	/** Device interrupts per second above which the irq policy holds a
+	 * cpu in the fastest P-state. */
+#define GOV_IRQ_RATE		1000
+	/** Processes whose threads are checked for real-time ones at each tick
+	 * of a governor with a --rt-floor. */
+#define GOV_RT_SCAN_PIDS	64
+
+	/** The slo policy steps slower once the p99 latency stays under this
+	 * fraction of the target for GOV_SLO_CALM intervals. */
+#define GOV_SLO_MARGIN		0.80
+#define GOV_SLO_CALM		3
+	/** A p99 latency not updated for this many intervals is stale: the
+	 * slo policy then runs as reactive until the application writes again. */
+#define GOV_SLO_STALE		3
+#define SLO_METRIC		"/dev/shm/undervolt-p99"
+#define SLO_MAX_REQUESTS	65536
+
+	/** --rt-floor : slowest P-state of the cpus running real-time threads,
+	 * -1 when off. */
+static int rtFloor = -1;
+	/** --slo-target and --slo-metric : p99 latency target of the slo
+	 * policy in us, and the file the application publishes it in. */
+static double sloTargetUs = 0;
+static const char * sloMetric = SLO_METRIC;
+
+	/** The thermal model is sampled every GOV_THERMAL_DT_MS, forgets old
+	 * samples by GOV_THERMAL_FORGET per sample and is trusted after
+	 * GOV_THERMAL_MIN_SAMPLES. A P-state is given back once predicted
+	 * GOV_THERMAL_HYST degrees under the limit. */
+#define GOV_THERMAL_DT_MS		1000
+#define GOV_THERMAL_FORGET		0.995
+#define GOV_THERMAL_MIN_SAMPLES	10
+#define GOV_THERMAL_HYST		3.0
+#define GOV_THERMAL_HORIZON		180
+
+	/** --thermal-limit and --thermal-horizon : temperature not to exceed
+	 * in degrees Celsius, 0 when off, and how far ahead it is predicted in
+	 * seconds. */
+static double thermalLimit = 0, thermalHorizon = GOV_THERMAL_HORIZON;
+	/** --apu : drm device directory of the GPU to balance the power budget
+	 * with, NULL when off. */
+static const char * apuDir = NULL;
+
+/** pickPstate
+ *
+ * Select the slowest P-state able to serve demand (expressed as a fraction
+ * of the capacity of the fastest P-state) below the up threshold. */
+static int pickPstate(const struct pstateTable * t, double demand) {
+	int i;
+
+	for(i = t->max; i > t->min; i--)
+		if(t->cap[i] * GOV_UP_THRESHOLD >= demand)
+			return i;
+	return t->min;
+}
+
+/** pickCapped
+ *
+ * As pickPstate, then step down to the first P-state whose full load power
+ * fits the cap, so that no core ever draws more than GOV_POWER_CAP. */
+static int pickCapped(const struct pstateTable * t, double demand) {
+	int i;
+
+	for(i = pickPstate(t, demand); i < t->max; i++)
+		if(t->power[i] <= GOV_POWER_CAP * t->power[t->min])
+			break;
+	return i;
+}
+
+/** forecast
+ *
+ * Per-cpu state of a load model. */
+struct forecast {
+	double level, trend;
+	int primed;
+};
+
+/** governor
+ *
+ * A governor policy is a load model: given the demand observed over the
+ * last interval, it returns the demand expected over the next one, and a
+ * rule picking the P-state serving that demand. flags name the inputs a
+ * policy uses beyond the utilization: GOV_IRQ holds the cpus handling many
+ * device interrupts in the fastest P-state whatever their load, GOV_SLO
+ * replaces the load model by the latency published by the application. */
+struct governor {
+	const char * name;
+	double (*predict)(struct forecast * f, double demand);
+	int (*pick)(const struct pstateTable * t, double demand);
+	int flags;
+};
+
+#define GOV_IRQ		1
+#define GOV_SLO		2
+
+/* The reactive policy assumes the next interval looks like the last one. */
+static double reactivePredict(struct forecast * f, double demand) {
+	f->level = demand;
+	return demand;
+}
+
+/* The predictive policy uses an EWMA with trend (Holt's linear method), so
+ * that a rising load raises the P-state one interval ahead. */
+static double holtPredict(struct forecast * f, double demand) {
+	double last = f->level, p;
+
+	if(!f->primed) {
+		f->level = demand;
+		f->trend = 0;
+		f->primed = 1;
+	}
+	else {
+		f->level = GOV_HOLT_ALPHA * demand + (1 - GOV_HOLT_ALPHA) * (f->level + f->trend);
+		f->trend = GOV_HOLT_BETA * (f->level - last) + (1 - GOV_HOLT_BETA) * f->trend;
+	}
+	p = f->level + f->trend;
+		/* Only anticipate rises: dropping below the last observed demand
+		 * on a falling trend costs more in latency than it saves. */
+	if(p < demand)
+		p = demand;
+	return p > 1 ? 1 : p;
+}
+
+static const struct governor governors[] = {
+	{"reactive", reactivePredict, pickPstate, 0},
+	{"predictive", holtPredict, pickPstate, 0},
+	{"capped", reactivePredict, pickCapped, 0},
+	{"irq", reactivePredict, pickPstate, GOV_IRQ},
+	{"slo", reactivePredict, pickPstate, GOV_SLO},
+	{NULL, NULL, NULL, 0}
+};
+
+static const struct governor * findGovernor(const char * name) {
+	const struct governor * g;
+
+	for(g = governors; g->name != NULL; g++)
+		if(strcmp(g->name, name) == 0)
+			return g;
+	return NULL;
+}
+
+/** readCpuTimes
+ *
+ * Read busy and total jiffies of the first n cpus from /proc/stat. */
+static int readCpuTimes(int n, unsigned long long * busy, unsigned long long * total) {
+	FILE * stream;
+	char line[512];
+	unsigned long long v[8];
+	int cpu, k;
+
+	if((stream = fopen("/proc/stat", "r")) == NULL) {
+		perror("Opening /proc/stat");
 		return (1);
 	}
+	while(fgets(line, sizeof(line), stream) != NULL) {
+		if(strncmp(line, "cpu", 3) != 0 || line[3] < '0' || line[3] > '9')
+			continue;
+		memset(v, 0, sizeof(v));
+		if(sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu,
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 5)
+			continue;
+		if(cpu < 0 || cpu >= n)
+			continue;
+		total[cpu] = 0;
+		for(k = 0; k < 8; k++)
+			total[cpu] += v[k];
+			/* idle and iowait are the only non busy times. */
+		busy[cpu] = total[cpu] - v[3] - v[4];
+	}
+	fclose(stream);
 	return (0);
 }
+
+/** readInterrupts
+ *
+ * Add up the device interrupts, the numbered lines of /proc/interrupts,
+ * handled by each of the first n cpus. The timer, IPIs and the other
+ * per-cpu interrupts come to every cpu and are left out. */
+static int readInterrupts(int n, unsigned long long * irqs) {
+	FILE * stream;
+	char * line = NULL, * p, * end;
+	size_t len = 0;
+	int * cols = NULL, ncols = 0, k;
+	unsigned long long v;
+
+	if((stream = fopen("/proc/interrupts", "r")) == NULL) {
+		perror("Opening /proc/interrupts");
+		return (1);
+	}
+	memset(irqs, 0, n * sizeof(*irqs));
+		/* The header names the cpu of each column, only online ones. */
+	if(getline(&line, &len, stream) != -1)
+		for(p = line; (p = strstr(p, "CPU")) != NULL; p += 3) {
+			if((cols = realloc(cols, (ncols + 1) * sizeof(*cols))) == NULL) {
+				perror("Reading interrupts");
+				exit(1);
+			}
+			cols[ncols++] = atoi(p + 3);
+		}
+	while(getline(&line, &len, stream) != -1) {
+		p = line + strspn(line, " ");
+		if(*p < '0' || *p > '9' || (p = strchr(p, ':')) == NULL)
+			continue;
+		for(k = 0, p++; k < ncols; k++, p = end) {
+			v = strtoull(p, &end, 10);
+			if(end == p)
+				break;
+			if(cols[k] >= 0 && cols[k] < n)
+				irqs[cols[k]] += v;
+		}
+	}
+	free(cols);
+	free(line);
+	fclose(stream);
+	return (0);
+}
+
+/** rtTask
+ *
+ * A real-time thread found by the scan, the cpus it may run on and its run
+ * time when last seen. */
+struct rtTask {
+	int pid, tid;
+	unsigned long long runNs;
+	struct cpuSet allowed;
+};
+
+/** readProcFile
+ *
+ * Read a small /proc file into buf as a string. */
+static int readProcFile(const char * path, char * buf, size_t size) {
+	ssize_t n;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return (1);
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if(n <= 0)
+		return (1);
+	buf[n] = '\0';
+	return (0);
+}
+
+/** taskStat
+ *
+ * Read the state, the cpu it last ran on, the scheduling policy and the run
+ * time of a thread, from its stat and schedstat files. */
+static int taskStat(int pid, int tid, char * state, int * cpu, int * policy, unsigned long long * runNs) {
+	char path[64], buf[1024], * p;
+	int k;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+	if(readProcFile(path, buf, sizeof(buf)))
+		return (1);
+		/* The command name may hold anything up to the last ')'. */
+	if((p = strrchr(buf, ')')) == NULL || p[1] == '\0')
+		return (1);
+	p += 2;
+	*state = *p;
+		/* processor and policy are fields 39 and 41, the state field 3. */
+	for(k = 3; k < 39 && p != NULL; k++)
+		if((p = strchr(p, ' ')) != NULL)
+			p++;
+	if(p == NULL || sscanf(p, "%d %*u %d", cpu, policy) != 2)
+		return (1);
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", pid, tid);
+	if(readProcFile(path, buf, sizeof(buf)) || sscanf(buf, "%llu", runNs) != 1)
+		return (1);
+	return (0);
+}
+
+/** taskAffinity
+ *
+ * Read the cpus a thread may run on. */
+static int taskAffinity(int pid, int tid, struct cpuSet * allowed) {
+	char path[64], buf[4096], * p;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/status", pid, tid);
+	if(readProcFile(path, buf, sizeof(buf)) || (p = strstr(buf, "Cpus_allowed_list:")) == NULL)
+		return (1);
+	p += strlen("Cpus_allowed_list:");
+	p += strspn(p, " \t");
+	p[strcspn(p, "\n")] = '\0';
+	return cpuSetParse(allowed, p);
+}
+
+static double nowNs(void);
+
+/** govState
+ *
+ * Running state of a governor over all cores. */
+struct govState {
+	const struct governor * gov;
+	struct pstateTable t;
+	struct forecast * f;
+	int * cur;
+	double * pred, err, lastNs;
+	unsigned long long * busy, * total, * lastBusy, * lastTotal, * irqs, * lastIrqs;
+	struct msrOp * ops;
+	long samples, transitions, irqHeld, rtHeld, sloTicks, sloMisses, sloStale, thermalHeld, apuHeld;
+	int sloLevel, sloCalm, thermalCap, apuCap;
+	struct thermalModel * thermal;
+	DIR * proc;
+	struct rtTask * rt;
+	int nrt;
+};
+
+/** rtTrack
+ *
+ * Add a real-time thread to those checked at each tick, or refresh its
+ * affinity when it is already there. */
+static void rtTrack(struct govState * g, int pid, int tid, unsigned long long runNs) {
+	int i;
+
+	for(i = 0; i < g->nrt; i++)
+		if(g->rt[i].tid == tid)
+			break;
+	if(i == g->nrt) {
+		if((g->rt = realloc(g->rt, (g->nrt + 1) * sizeof(*g->rt))) == NULL) {
+			perror("Tracking real-time tasks");
+			exit(1);
+		}
+		g->rt[i].pid = pid;
+		g->rt[i].tid = tid;
+		g->rt[i].runNs = runNs;
+		g->nrt++;
+		if(verbose)
+			printf("real-time thread %d of process %d\n", tid, pid);
+	}
+	if(taskAffinity(pid, tid, &g->rt[i].allowed))
+		cpuSetFill(&g->rt[i].allowed, ncpu);
+}
+
+/** rtScan
+ *
+ * Find the cpus that need the real-time floor. Walking all of /proc at each
+ * tick would cost more than the governor itself, so each tick scans the
+ * threads of the next GOV_RT_SCAN_PIDS processes only, and then checks the
+ * real-time threads already found. A thread that ran since the last tick
+ * or is runnable raises the cpus it is pinned to, or only the cpu it last
+ * ran on when it may run on all target cpus. */
+static void rtScan(struct govState * g, struct cpuSet * floors) {
+	char path[64], state;
+	struct dirent * ent, * task;
+	unsigned long long runNs;
+	int i, k, pid, tid, cpu, policy, active, pinned;
+	DIR * dir;
+
+	memset(floors, 0, sizeof(*floors));
+	if(g->proc == NULL && (g->proc = opendir("/proc")) == NULL)
+		return;
+	for(k = 0; k < GOV_RT_SCAN_PIDS; k++) {
+		if((ent = readdir(g->proc)) == NULL) {
+			rewinddir(g->proc);
+			break;
+		}
+		if((pid = atoi(ent->d_name)) <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task", pid);
+		if((dir = opendir(path)) == NULL)
+			continue;
+		while((task = readdir(dir)) != NULL)
+			if((tid = atoi(task->d_name)) > 0 && taskStat(pid, tid, &state, &cpu, &policy, &runNs) == 0
+					&& (policy == SCHED_FIFO || policy == SCHED_RR))
+				rtTrack(g, pid, tid, runNs);
+		closedir(dir);
+	}
+	for(i = 0; i < g->nrt; ) {
+		if(taskStat(g->rt[i].pid, g->rt[i].tid, &state, &cpu, &policy, &runNs)
+				|| (policy != SCHED_FIFO && policy != SCHED_RR)) {
+			g->rt[i] = g->rt[--g->nrt];
+			continue;
+		}
+		active = state == 'R' || runNs != g->rt[i].runNs;
+		g->rt[i].runNs = runNs;
+		if(active) {
+			pinned = 0;
+			forEachCpu(k, &targetCpus)
+				if(!cpuSetHas(&g->rt[i].allowed, k)) {
+					pinned = 1;
+					break;
+				}
+			if(pinned)
+				forEachCpu(k, &g->rt[i].allowed)
+					cpuSetAdd(floors, k);
+			else
+				cpuSetAdd(floors, cpu);
+		}
+		i++;
+	}
+}
+
+/** govInit
+ *
+ * Allocate the per-core state of a governor, read the P-state table and
+ * the current P-state of each core and take the first utilization sample. */
+static int govInit(struct govState * g, const struct governor * gov) {
+	int j, k, n;
+
+	memset(g, 0, sizeof(*g));
+	g->gov = gov;
+	if(loadPstateTable(cpuSetNext(&targetCpus, 0), &g->t)) {
+		fprintf(stderr, "Error reading P-state table\n");
+		return (1);
+	}
+	g->f = calloc(ncpu, sizeof(*g->f));
+	g->cur = calloc(ncpu, sizeof(*g->cur));
+	g->pred = calloc(ncpu, sizeof(*g->pred));
+	g->busy = calloc(4 * ncpu, sizeof(*g->busy));
+	if(g->f == NULL || g->cur == NULL || g->pred == NULL || g->busy == NULL) {
+		perror("Allocating governor state");
+		exit(1);
+	}
+	g->total = g->busy + ncpu;
+	g->lastBusy = g->total + ncpu;
+	g->lastTotal = g->lastBusy + ncpu;
+	if((g->ops = calloc(ncpu, sizeof(*g->ops))) == NULL) {
+		perror("Allocating governor state");
+		exit(1);
+	}
+	n = 0;
+	forEachCpu(j, &targetCpus) {
+		g->ops[n].cpu = j;
+		g->ops[n++].msr = cpuVendor == VENDOR_INTEL ? MSR_PERF_STATUS : MSR_PSTATE_STATUS;
+	}
+	if(msrBatch(g->ops, n)) {
+		fprintf(stderr, "Error reading MSR register 0x%" PRIX64 "\n", (uint64_t)g->ops[0].msr);
+		return (1);
+	}
+	for(k = 0; k < n; k++) {
+		g->cur[g->ops[k].cpu] = cpuVendor == VENDOR_INTEL ? pstateOfRatio(&g->t, PERF_STATUS_RATIO(g->ops[k].val))
+			: (int)PSTATE_STATUS_CUR_PSTATE(g->ops[k].val);
+		g->pred[g->ops[k].cpu] = -1;
+	}
+	if(gov->flags & GOV_IRQ) {
+		if((g->irqs = calloc(2 * ncpu, sizeof(*g->irqs))) == NULL) {
+			perror("Allocating governor state");
+			exit(1);
+		}
+		g->lastIrqs = g->irqs + ncpu;
+		if(readInterrupts(ncpu, g->lastIrqs))
+			return (1);
+	}
+	g->sloLevel = g->thermalCap = g->apuCap = g->t.min;
+	if(rtFloor > g->t.max)
+		rtFloor = g->t.max;
+	if(rtFloor >= 0 && rtFloor < g->t.min)
+		rtFloor = g->t.min;
+	g->lastNs = nowNs();
+	return readCpuTimes(ncpu, g->lastBusy, g->lastTotal);
+}
+
+static void thermalTick(struct govState * g);
+static void thermalFinish(struct govState * g);
+static int apuTick(struct govState * g);
+static void apuFinish(struct govState * g);
+
+/** sloSlower
+ *
+ * Return the next slower P-state that spends less energy per unit of work
+ * (power over capacity) than a P-state, or the P-state itself: a slower one
+ * at the same voltage only adds latency. */
+static int sloSlower(const struct pstateTable * t, int pstate) {
+	int i;
+
+	for(i = pstate + 1; i <= t->max; i++)
+		if(t->power[i] / t->cap[i] < t->power[pstate] / t->cap[pstate])
+			return i;
+	return pstate;
+}
+
+/** sloRead
+ *
+ * Read the p99 latency the application publishes, if the file was written
+ * within the last maxAge seconds. */
+static int sloRead(double maxAge, double * p99) {
+	struct timespec now;
+	struct stat st;
+	char buf[64];
+
+	if(stat(sloMetric, &st) || clock_gettime(CLOCK_REALTIME, &now))
+		return (1);
+	if(now.tv_sec - st.st_mtim.tv_sec + (now.tv_nsec - st.st_mtim.tv_nsec) / 1e9 > maxAge)
+		return (1);
+	if(readProcFile(sloMetric, buf, sizeof(buf)) || sscanf(buf, "%lf", p99) != 1)
+		return (1);
+	return (0);
+}
+
+/** sloTick
+ *
+ * The slo policy: move all cores one P-state faster as soon as the p99
+ * latency is above the target, or to the next slower P-state saving energy
+ * once it has stayed under GOV_SLO_MARGIN of the target for GOV_SLO_CALM
+ * intervals. The cpus running real-time threads keep the --rt-floor. */
+static int sloTick(struct govState * g, double p99) {
+	struct cpuSet floors;
+	int j, next = g->sloLevel, level, n = 0;
+
+	g->sloTicks++;
+	if(p99 > sloTargetUs) {
+		g->sloMisses++;
+		g->sloCalm = 0;
+		if(next > g->t.min)
+			next--;
+	}
+	else if(p99 < GOV_SLO_MARGIN * sloTargetUs && ++g->sloCalm >= GOV_SLO_CALM) {
+		g->sloCalm = 0;
+		next = sloSlower(&g->t, next);
+	}
+	if(verbose)
+		printf("p99 %.1f us, target %.1f us, P-state %d -> %d\n", p99, sloTargetUs, g->sloLevel, next);
+	g->sloLevel = next;
+	if(rtFloor >= 0)
+		rtScan(g, &floors);
+	forEachCpu(j, &targetCpus) {
+		level = next;
+		if(rtFloor >= 0 && level > rtFloor && cpuSetHas(&floors, j)) {
+			level = rtFloor;
+			g->rtHeld++;
+		}
+		if(thermalLimit > 0 && level < g->thermalCap) {
+			level = g->thermalCap;
+			g->thermalHeld++;
+		}
+		if(apuDir != NULL && level < g->apuCap) {
+			level = g->apuCap;
+			g->apuHeld++;
+		}
+		if(g->cur[j] != level) {
+			g->ops[n].cpu = j;
+			pstateSelect(&g->t, level, &g->ops[n]);
+			n++;
+			g->cur[j] = level;
+			g->transitions++;
+		}
+	}
+	if(n > 0 && msrBatch(g->ops, n)) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/** govTick
+ *
+ * Measure the utilization of every core since the last tick, feed it to
+ * the policy's load model and select a P-state through the P-state control
+ * register (IA32_PERF_CTL on Intel). The cpufreq governor should be
+ * disabled (userspace) while a governor runs, else both fight over the
+ * register, and on Intel HWP must be off, else IA32_PERF_CTL is ignored. */
+static int govTick(struct govState * g) {
+	double demand, now = nowNs(), seconds = (now - g->lastNs) / 1e9, rate = 0;
+	struct cpuSet floors;
+	double p99;
+	int j, next, n = 0;
+
+	g->lastNs = now;
+	if(thermalLimit > 0)
+		thermalTick(g);
+	if(apuDir != NULL && apuTick(g))
+		return (1);
+	/* Without a fresh latency the slo policy falls back to the load. */
+	if(g->gov->flags & GOV_SLO) {
+		if(sloRead(GOV_SLO_STALE * seconds, &p99) == 0)
+			return sloTick(g, p99);
+		if(verbose)
+			printf("no fresh latency in %s, governing as reactive\n", sloMetric);
+		g->sloStale++;
+	}
+	if(readCpuTimes(ncpu, g->busy, g->total))
+		return (1);
+	if((g->gov->flags & GOV_IRQ) && readInterrupts(ncpu, g->irqs))
+		return (1);
+	if(rtFloor >= 0)
+		rtScan(g, &floors);
+	forEachCpu(j, &targetCpus) {
+		if(g->total[j] == g->lastTotal[j])
+			continue;
+			/* Utilization at the current P-state, scaled to the capacity
+			 * of the fastest one. */
+		demand = (double)(g->busy[j] - g->lastBusy[j]) / (g->total[j] - g->lastTotal[j]) * g->t.cap[g->cur[j]];
+		g->lastBusy[j] = g->busy[j];
+		g->lastTotal[j] = g->total[j];
+		if(g->pred[j] >= 0) {
+			g->err += fabs(g->pred[j] - demand);
+			g->samples++;
+		}
+		g->pred[j] = g->gov->predict(&g->f[j], demand);
+		next = g->gov->pick(&g->t, g->pred[j]);
+		if((g->gov->flags & GOV_IRQ)) {
+			rate = seconds > 0 ? (g->irqs[j] - g->lastIrqs[j]) / seconds : 0;
+			g->lastIrqs[j] = g->irqs[j];
+			if(rate > GOV_IRQ_RATE && next != g->t.min) {
+				next = g->t.min;
+				g->irqHeld++;
+			}
+		}
+		if(rtFloor >= 0 && next > rtFloor && cpuSetHas(&floors, j)) {
+			next = rtFloor;
+			g->rtHeld++;
+		}
+			/* The thermal limit and the GPU budget win over any floor. */
+		if(thermalLimit > 0 && next < g->thermalCap) {
+			next = g->thermalCap;
+			g->thermalHeld++;
+		}
+		if(apuDir != NULL && next < g->apuCap) {
+			next = g->apuCap;
+			g->apuHeld++;
+		}
+		if(verbose)
+			printf("cpu %d: demand %.3f, predicted %.3f, %.0f irq/s, P-state %d -> %d\n", j, demand, g->pred[j], rate,
+				g->cur[j], next);
+		if(next != g->cur[j]) {
+			g->ops[n].cpu = j;
+			pstateSelect(&g->t, next, &g->ops[n]);
+			n++;
+			g->cur[j] = next;
+			g->transitions++;
+		}
+	}
+	if(n > 0 && msrBatch(g->ops, n)) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/** govFinish
+ *
+ * Leave the cores in the fastest P-state for whoever takes over, report
+ * and free the governor state. */
+static void govFinish(struct govState * g) {
+	struct msrOp op;
+	int j;
+
+	forEachCpu(j, &targetCpus) {
+		pstateSelect(&g->t, g->t.min, &op);
+		wrmsr(j, op.msr, op.val);
+	}
+	if(g->samples)
+		printf("%s governor: mean absolute prediction error %.4f over %ld samples, %ld transitions\n",
+			g->gov->name, g->err / g->samples, g->samples, g->transitions);
+	if((g->gov->flags & GOV_IRQ))
+		printf("%s governor: %ld P-state choices raised for interrupt heavy cpus\n", g->gov->name, g->irqHeld);
+	if(rtFloor >= 0)
+		printf("%s governor: %ld P-state choices raised for real-time threads\n", g->gov->name, g->rtHeld);
+	if(g->sloTicks)
+		printf("%s governor: p99 above %.1f us in %ld of %ld intervals, %ld transitions\n", g->gov->name, sloTargetUs,
+			g->sloMisses, g->sloTicks, g->transitions);
+	if(g->sloStale)
+		printf("%s governor: no fresh p99 in %ld intervals, governed as reactive\n", g->gov->name, g->sloStale);
+	thermalFinish(g);
+	apuFinish(g);
+	if(g->proc != NULL)
+		closedir(g->proc);
+	free(g->rt);
+	free(g->f);
+	free(g->irqs);
+	free(g->cur);
+	free(g->pred);
+	free(g->busy);
+	free(g->ops);
+}
+
+/** sloLoad
+ *
+ * A synthetic request server to try the slo policy locally: requests
+ * arrive as a Poisson process, each one spins for workUs at the speed of
+ * the fastest P-state, longer in slower ones, and the p99 latency of each
+ * interval is published in the metric file. */
+struct sloLoad {
+	double rate, workUs;
+	int cpu, intervalMs, stop;
+	struct pstateTable t;
+	pthread_t thread;
+};
+
+static int latencyCompare(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** sloPublish
+ *
+ * Replace the metric file with a p99 latency, through a rename so that the
+ * reader never sees a partial value. */
+static void sloPublish(double p99Us) {
+	char tmp[PATH_MAX];
+	FILE * stream;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", sloMetric);
+	if((stream = fopen(tmp, "w")) == NULL) {
+		perror(tmp);
+		return;
+	}
+	fprintf(stream, "%.1f\n", p99Us);
+	fclose(stream);
+	if(rename(tmp, sloMetric))
+		perror(sloMetric);
+}
+
+static void * sloLoadRun(void * arg) {
+	struct sloLoad * l = arg;
+	unsigned short seed[3] = {0x330E, 0xABCD, 0x1234};
+	double * lat, arrival, start, done, reportNs, volts;
+	struct timespec ts;
+	cpu_set_t mask;
+	uint64_t val;
+	float div;
+	int n = 0;
+
+	CPU_ZERO(&mask);
+	CPU_SET(l->cpu, &mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	if((lat = malloc(SLO_MAX_REQUESTS * sizeof(*lat))) == NULL) {
+		perror("Allocating load generator");
+		return NULL;
+	}
+	arrival = nowNs();
+	reportNs = arrival + l->intervalMs * 1e6;
+	while(!__atomic_load_n(&l->stop, __ATOMIC_RELAXED)) {
+		arrival += -log(1 - erand48(seed)) / l->rate * 1e9;
+		if((start = nowNs()) < arrival) {
+			ts.tv_sec = (time_t)((arrival - start) / 1e9);
+			ts.tv_nsec = (long)(arrival - start - ts.tv_sec * 1e9);
+			nanosleep(&ts, NULL);
+			start = nowNs();
+		}
+			/* The work takes longer as the divisor grows. */
+		div = l->t.div[l->t.min];
+		if(rdmsr(l->cpu, MSR_CURRENT_STATUS, &val) == 0)
+			statusDecode(&l->t, val, &volts, &div);
+		done = start + l->workUs * 1000 * (div > 0 ? div / l->t.div[l->t.min] : 1);
+		while(nowNs() < done)
+			;
+		if(n < SLO_MAX_REQUESTS)
+			lat[n++] = (done - arrival) / 1000;
+		if(done >= reportNs) {
+			if(n > 0) {
+				qsort(lat, n, sizeof(*lat), latencyCompare);
+				sloPublish(lat[(int)(0.99 * (n - 1))]);
+			}
+			n = 0;
+			reportNs += l->intervalMs * 1e6;
+		}
+	}
+	free(lat);
+	return NULL;
+}
+
+/** sloLoadStart
+ *
+ * Start the load generator on the first target cpu. The governor has read
+ * all target cpus already, so that the thread only uses msr descriptors
+ * cached before it starts. */
+static int sloLoadStart(struct sloLoad * l, const struct pstateTable * t, int intervalMs) {
+	l->t = *t;
+	l->cpu = cpuSetNext(&targetCpus, 0);
+	l->intervalMs = intervalMs;
+	l->stop = 0;
+	if(pthread_create(&l->thread, NULL, sloLoadRun, l)) {
+		fprintf(stderr, "Error starting the load generator\n");
+		return (1);
+	}
+	printf("Serving %.0f requests/s of %.0f us on cpu %d, p99 in %s\n", l->rate, l->workUs, l->cpu, sloMetric);
+	return (0);
+}
+
+static void sloLoadStop(struct sloLoad * l) {
+	__atomic_store_n(&l->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(l->thread, NULL);
+}
+
+/** applyPstates
+ *
+ * Write the Vid (and div, if not 0) requested for each P-state between
+ * minPstate and maxPstate to all cores. A Vid of 0 leaves the P-state
+ * untouched. All definitions are read in one batch, then written in one. */
+static int applyPstates(const uint64_t * vidToSet, const float * divToSet, int minPstate, int maxPstate) {
+	struct msrOp * ops;
+	int i, j, k, n = 0;
+	long vid;
+	uint64_t val, oMSR;
+
+	for(i = minPstate; i <= maxPstate; i++)
+		if(vidToSet[i] != 0)
+			n += cpuSetCount(&targetCpus);
+	if(n == 0)
+		return (0);
+	if((ops = calloc(n, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	for(i = minPstate, k = 0; i <= maxPstate; i++) {
+		if(vidToSet[i] != 0) {
+				/* Interesting : writing to a single cpu MSR register change the
+				 * other, so the loop for all cpus should not be necessary ? */
+			forEachCpu(j, &targetCpus) {
+				ops[k].cpu = j;
+				ops[k++].msr = MSR_PSTATE_DEF + i;
+			}
+		}
+	}
+	if(msrBatch(ops, n)) {
+		fprintf(stderr, "Error reading MSR register\n");
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k++) {
+		i = ops[k].msr - MSR_PSTATE_DEF;
+		oMSR = ops[k].val;
+		vid = PSTATE_DEF_VID(oMSR);
+		val = PSTATE_DEF_VID_set(oMSR, vidToSet[i]);
+		if(!quiet) {
+			printf("P-state: %d, cpu: %d, changing vid: 0x%lX/%.4fV", i, ops[k].cpu, vid, voltage(vid));
+			if(divToSet[i] != 0.0)
+				printf(", div: %.02f", msrtodiv(oMSR));
+			printf(" to 0x%" PRIX64 "/%.4fV", vidToSet[i], voltage(vidToSet[i]));
+			if(divToSet[i] != 0.0)
+				printf(", div: %.02f\n", divToSet[i]);
+			else
+				printf("\n");
+		}
+		if(divToSet[i] != 0.0)
+			divtomsr(divToSet[i], &val);
+		ops[k].write = 1;
+		ops[k].val = val;
+	}
+	if(msrBatch(ops, n)) {
+		fprintf(stderr, "Error writing MSR register\n");
+		free(ops);
+		return (1);
+	}
+	free(ops);
+	return (0);
+}
+
+	/** Voltage step of a Family 14h Vid, in mV, and the largest Vid that
+	 * does not turn the core off. */
+#define VID_STEP_MV	12.5
+#define VID_LAST	0x7B
+
+/** offsetVids
+ *
+ * Fill vidToSet with the Vids of all enabled P-states shifted by a signed
+ * offset in mV, rounded to whole Vid steps and clamped to the MaxVid and
+ * MinVid fused in the COFVID status, so that applyPstates() writes them
+ * all in one batch. */
+static int offsetVids(const struct pstateTable * t, double mV, uint64_t * vidToSet) {
+	uint64_t val;
+	long vid, hi, lo, step;
+	int i;
+
+	if(rdmsr(cpuSetNext(&targetCpus, 0), MSR_COFVID_STATUS, &val))
+		return (1);
+		/* Vids go down as the voltage goes up. */
+	hi = COFVID_STATUS_MAX_VID(val);
+	lo = COFVID_STATUS_MIN_VID(val) ? (long)COFVID_STATUS_MIN_VID(val) : VID_LAST;
+	if(hi < 1)
+		hi = 1;
+	step = -lround(mV / VID_STEP_MV);
+	for(i = t->min; i <= t->max; i++) {
+		vid = t->vid[i] + step;
+		if(vid < hi || vid > lo) {
+			vid = vid < hi ? hi : lo;
+			fprintf(stderr, "Warning: P-state %d Vid clamped to the fused limit 0x%lX/%.4fV\n", i, vid, voltage(vid));
+		}
+		vidToSet[i] = vid;
+	}
+	return (0);
+}
+
+/** forcePstates
+ *
+ * Move all target cpus to a P-state of the table, or on Intel to any bus
+ * ratio when ratio is not 0, in one batch. */
+static int forcePstates(const struct pstateTable * t, int pstate, int ratio) {
+	struct msrOp * ops;
+	int j, n = 0;
+
+	if((ops = calloc(ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	forEachCpu(j, &targetCpus) {
+		ops[n].cpu = j;
+		pstateSelect(t, pstate >= 0 ? pstate : t->min, &ops[n]);
+		if(ratio > 0)
+			ops[n].val = REG_ENCODE(PERF_CTL, RATIO, ratio);
+		n++;
+	}
+	j = msrBatch(ops, n);
+	free(ops);
+	if(j) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/** sampleCpus
+ *
+ * Read the current status (COFVID status, or IA32_PERF_STATUS on Intel)
+ * and the APERF and MPERF counters of the target cores in one batch, into
+ * arrays indexed by cpu. ops must hold 3 * ncpu accesses and is reused
+ * across calls. */
+static int sampleCpus(struct msrOp * ops, uint64_t * status, uint64_t * aperf, uint64_t * mperf) {
+	int j, k = 0;
+
+	memset(ops, 0, 3 * ncpu * sizeof(*ops));
+	forEachCpu(j, &targetCpus) {
+		ops[k].cpu = ops[k + 1].cpu = ops[k + 2].cpu = j;
+		ops[k].msr = MSR_CURRENT_STATUS;
+		ops[k + 1].msr = MSR_APERF;
+		ops[k + 2].msr = MSR_MPERF;
+		k += 3;
+	}
+	if(msrBatch(ops, k))
+		return (1);
+	for(k -= 3; k >= 0; k -= 3) {
+		j = ops[k].cpu;
+		status[j] = ops[k].val;
+		aperf[j] = ops[k + 1].val;
+		mperf[j] = ops[k + 2].val;
+	}
+	return (0);
+}
+
+/** readCurrent
+ *
+ * Read the current P-state, Vid and div (COFVID status), or ratio and
+ * voltage (IA32_PERF_STATUS) on Intel, of the target cores into status,
+ * indexed by cpu. */
+static int readCurrent(uint64_t * status) {
+	struct msrOp * ops;
+	int j, k, n = 0, ret;
+
+	if((ops = calloc(ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	forEachCpu(j, &targetCpus) {
+		ops[n].cpu = j;
+		ops[n++].msr = MSR_CURRENT_STATUS;
+	}
+	ret = msrBatch(ops, n) != 0;
+	for(k = 0; k < n; k++)
+		status[ops[k].cpu] = ops[k].val;
+	free(ops);
+	return (ret);
+}
+
+/** loadTrace
+ *
+ * Read a recorded utilization trace: one line per sampling interval, one
+ * whitespace separated column per cpu, '#' starting a comment. Values are
+ * fractions of the fastest P-state capacity, or percents if any is above 1.
+ * A value may be followed by @<P-state> when it is the utilization recorded
+ * at that P-state, which is then scaled by the capacity of the P-state. */
+static double * loadTrace(const char * path, const struct pstateTable * t, int * nSamples, int * nCols) {
+	FILE * stream;
+	char * line = NULL, * p, * end;
+	size_t len = 0, cap = 0, used = 0;
+	double * v = NULL, x, maxv = 0;
+	signed char * at = NULL;
+	long pstate;
+	int cols, rows = 0;
+
+	if((stream = fopen(path, "r")) == NULL) {
+		perror("Opening trace");
+		return NULL;
+	}
+	*nCols = 0;
+	while(getline(&line, &len, stream) != -1) {
+		if((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for(cols = 0, p = line; ; cols++, p = end) {
+			x = strtod(p, &end);
+			if(end == p)
+				break;
+			pstate = -1;
+			if(*end == '@') {
+				pstate = strtol(end + 1, &p, 10);
+				if(p == end + 1 || pstate < t->min || pstate > t->max) {
+					fprintf(stderr, "%s: line %d: P-state out of %d-%d\n", path, rows + 1, t->min, t->max);
+					free(line);
+					free(v);
+					free(at);
+					fclose(stream);
+					return NULL;
+				}
+				end = p;
+			}
+			if(used == cap) {
+				cap = cap ? 2 * cap : 1024;
+				if((v = realloc(v, cap * sizeof(*v))) == NULL || (at = realloc(at, cap)) == NULL) {
+					perror("Loading trace");
+					exit(1);
+				}
+			}
+			at[used] = pstate;
+			v[used++] = x;
+			if(x > maxv)
+				maxv = x;
+		}
+		if(cols == 0)
+			continue;
+		if(*nCols == 0)
+			*nCols = cols;
+		if(cols != *nCols) {
+			fprintf(stderr, "%s: line with %d columns, expected %d\n", path, cols, *nCols);
+			free(line);
+			free(v);
+			free(at);
+			fclose(stream);
+			return NULL;
+		}
+		rows++;
+	}
+	free(line);
+	fclose(stream);
+	if(rows < 2) {
+		fprintf(stderr, "%s: trace needs at least two samples\n", path);
+		free(v);
+		free(at);
+		return NULL;
+	}
+	for(used = 0; used < (size_t)rows * *nCols; used++) {
+		if(maxv > 1)
+			v[used] /= 100;
+		if(at[used] >= 0)
+			v[used] *= t->cap[(int)at[used]];
+	}
+	free(at);
+	*nSamples = rows;
+	return v;
+}
+
+/** govStats
+ *
+ * Outcome of replaying a trace through a policy. backlog is the work left
+ * unserved at the end of an interval, in intervals of the fastest P-state,
+ * energy is relative to always running the fastest P-state, overhead the
+ * time the policy takes per decision. */
+struct govStats {
+	double mae, rmse, overload, backlog, energy, overheadNs;
+	long transitions;
+};
+
+/** replayTrace
+ *
+ * Run a policy over a trace. A core changing P-state serves nothing for
+ * the transition latency, given as a fraction lost of the interval. */
+static void replayTrace(const struct governor * gov, const struct pstateTable * t,
+		const double * trace, int rows, int cols, double lost, struct govStats * s) {
+	struct forecast f;
+	double d, work, served, backlog, pred, err, avail, start, e = 0, e0 = 0, sae = 0, sse = 0, sbl = 0, ns = 0;
+	long over = 0, n = 0, moves = 0;
+	int c, k, cur, next, moved;
+
+	for(c = 0; c < cols; c++) {
+		memset(&f, 0, sizeof(f));
+		cur = t->min;
+		moved = 0;
+		backlog = 0;
+		pred = -1;
+		for(k = 0; k < rows; k++) {
+			d = trace[k * cols + c];
+			if(pred >= 0) {
+				err = pred - d;
+				sae += fabs(err);
+				sse += err * err;
+				n++;
+			}
+			work = d + backlog;
+			avail = moved ? t->cap[cur] * (1 - lost) : t->cap[cur];
+			served = work < avail ? work : avail;
+			backlog = work - served;
+			if(backlog > 1e-9)
+				over++;
+			sbl += backlog;
+			e += t->power[cur] * served / t->cap[cur];
+			e0 += served;
+				/* The policy only observes what has been served. */
+			start = nowNs();
+			pred = gov->predict(&f, served);
+			next = gov->pick(t, pred);
+			ns += nowNs() - start;
+			moved = next != cur;
+			moves += moved;
+			cur = next;
+		}
+	}
+	s->mae = n ? sae / n : 0;
+	s->rmse = n ? sqrt(sse / n) : 0;
+	s->overload = 100.0 * over / ((long)rows * cols);
+	s->backlog = sbl / ((long)rows * cols);
+	s->energy = e0 > 0 ? 100.0 * e / e0 : 100;
+	s->transitions = moves;
+	s->overheadNs = ns / ((long)rows * cols);
+}
+
+/** evalGovernors
+ *
+ * Replay a recorded utilization trace through every policy on the current
+ * P-state table, or the one saved from -r in tablePath, and report
+ * prediction error, time spent overloaded, mean backlog (a proxy for added
+ * latency), estimated energy, transitions and the cost of each decision.
+ * The trace is sampled every intervalMs. */
+static int evalGovernors(const char * path, const char * tablePath, int intervalMs, double latencyUs) {
+	struct pstateTable t;
+	struct govStats s, ref;
+	const struct governor * g;
+	double * trace, lost;
+	int rows, cols;
+
+	if(tablePath != NULL) {
+		if(loadPstateFile(tablePath, &t))
+			return (1);
+	}
+	else if(loadPstateTable(cpuSetNext(&targetCpus, 0), &t)) {
+		fprintf(stderr, "Error reading P-state table\n");
+		return (1);
+	}
+	if((trace = loadTrace(path, &t, &rows, &cols)) == NULL)
+		return (1);
+	lost = latencyUs / (intervalMs * 1000.0);
+	if(lost > 1)
+		lost = 1;
+	printf("%d samples, %d cpus, P-states %d-%d, %.0f us transition latency, %d ms intervals\n", rows, cols,
+		t.min, t.max, latencyUs, intervalMs);
+	printf("policy\t\tMAE\tRMSE\toverload\tbacklog\tenergy\t\ttransitions\tns/decision\n");
+	replayTrace(&governors[0], &t, trace, rows, cols, lost, &ref);
+	for(g = governors; g->name != NULL; g++) {
+			/* Traces hold no interrupt counts nor latencies. */
+		if(g->flags & (GOV_IRQ | GOV_SLO))
+			continue;
+		replayTrace(g, &t, trace, rows, cols, lost, &s);
+		printf("%-12s\t%.4f\t%.4f\t%6.2f%%\t\t%.4f\t%6.2f%%\t\t%ld\t\t%.1f\n", g->name, s.mae, s.rmse, s.overload,
+			s.backlog, s.energy, s.transitions, s.overheadNs);
+		if(g != governors)
+			printf("  vs %s: energy %+.2f%%, overload %+.2f points, backlog %+.4f\n", governors[0].name,
+				ref.energy > 0 ? 100.0 * (s.energy - ref.energy) / ref.energy : 0,
+				s.overload - ref.overload, s.backlog - ref.backlog);
+	}
+	free(trace);
+	return (0);
+}
+
+/** evHandler
+ *
+ * A file descriptor watched by the event loop and the function called
+ * when it becomes readable. */
+struct evHandler {
+	int fd;
+	int (*fn)(struct evHandler * h);
+	void * ctx;
+};
+
+static int epollFd = -1, stopRequested = 0;
+
+static int evAdd(struct evHandler * h) {
+	struct epoll_event e;
+
+	memset(&e, 0, sizeof(e));
+	e.events = EPOLLIN;
+	e.data.ptr = h;
+	if(epoll_ctl(epollFd, EPOLL_CTL_ADD, h->fd, &e)) {
+		perror("Adding event source");
+		return (1);
+	}
+	return (0);
+}
+
+static void evDel(struct evHandler * h) {
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, h->fd, NULL);
+}
+
+/** evRun
+ *
+ * Dispatch events until a handler fails or a stop is requested. This is the
+ * only place the daemon sleeps. */
+static int evRun(void) {
+	struct epoll_event evs[16];
+	struct evHandler * h;
+	int i, n;
+
+	while(!stopRequested) {
+		n = epoll_wait(epollFd, evs, 16, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("Waiting for events");
+			return (1);
+		}
+		for(i = 0; i < n && !stopRequested; i++) {
+			h = evs[i].data.ptr;
+			if(h->fn(h))
+				return (1);
+		}
+	}
+	return (0);
+}
+
+/** daemonCtx
+ *
+ * Everything the daemon handlers act upon: the P-state settings to keep
+ * applied, the optional governor and the eventfd used to request an apply
+ * pass, so that bursts of requests collapse into a single one. */
+struct daemonCtx {
+	const uint64_t * vidToSet;
+	const float * divToSet;
+	int minPstate, maxPstate, intervalMs;
+	const struct governor * gov;
+	struct govState gs;
+	struct sloLoad * load;
+	struct evHandler timer, signals, apply, uevent, control;
+	long applies;
+};
+
+static void requestApply(struct daemonCtx * d) {
+	uint64_t one = 1;
+
+	if(write(d->apply.fd, &one, sizeof(one)) != sizeof(one))
+		perror("Requesting apply");
+}
+
+/* timerfd: one sampling interval has elapsed. */
+static int onTimer(struct evHandler * h) {
+	struct daemonCtx * d = h->ctx;
+	uint64_t expirations;
+
+	if(read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return (0);
+	return govTick(&d->gs);
+}
+
+/* signalfd: SIGINT and SIGTERM stop, SIGHUP re-applies the settings. */
+static int onSignal(struct evHandler * h) {
+	struct daemonCtx * d = h->ctx;
+	struct signalfd_siginfo si;
+
+	if(read(h->fd, &si, sizeof(si)) != sizeof(si))
+		return (0);
+	if(si.ssi_signo == SIGHUP)
+		requestApply(d);
+	else
+		stopRequested = 1;
+	return (0);
+}
+
+/* eventfd: apply the P-state settings again and let the governor pick up
+ * the new table. */
+static int onApply(struct evHandler * h) {
+	struct daemonCtx * d = h->ctx;
+	uint64_t count;
+	struct pstateTable t;
+
+	if(read(h->fd, &count, sizeof(count)) != sizeof(count))
+		return (0);
+	if(verbose)
+		printf("applying P-state settings (%" PRIu64 " requests)\n", count);
+	if(applyPstates(d->vidToSet, d->divToSet, d->minPstate, d->maxPstate))
+		return (1);
+	d->applies++;
+	if(d->gov != NULL && loadPstateTable(cpuSetNext(&targetCpus, 0), &t) == 0)
+		d->gs.t = t;
+	return (0);
+}
+
+/* netlink uevent: a cpu coming (back) online, e.g. on resume, may have had
+ * its P-state definitions reset by firmware. */
+static int onUevent(struct evHandler * h) {
+	struct daemonCtx * d = h->ctx;
+	char buf[4096];
+	ssize_t n;
+
+	while((n = recv(h->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[n] = '\0';
+		if((strncmp(buf, "online@", 7) == 0 || strncmp(buf, "add@", 4) == 0)
+				&& strstr(buf, "/devices/system/cpu/cpu") != NULL) {
+			if(verbose)
+				printf("uevent %s\n", buf);
+			requestApply(d);
+		}
+	}
+	return (0);
+}
+
+/* Control socket client: one command line, one reply, then close. */
+static int onControlClient(struct evHandler * h) {
+	struct daemonCtx * d = h->ctx;
+	char buf[128], reply[256];
+	ssize_t n;
+	int len;
+
+	n = read(h->fd, buf, sizeof(buf) - 1);
+	if(n > 0) {
+		buf[n] = '\0';
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if(strcmp(buf, "apply") == 0) {
+			requestApply(d);
+			len = snprintf(reply, sizeof(reply), "ok\n");
+		}
+		else if(strcmp(buf, "stop") == 0) {
+			stopRequested = 1;
+			len = snprintf(reply, sizeof(reply), "ok\n");
+		}
+		else if(strcmp(buf, "status") == 0)
+			len = snprintf(reply, sizeof(reply), "governor %s, applies %ld, samples %ld, transitions %ld\n",
+				d->gov ? d->gov->name : "none", d->applies, d->gs.samples, d->gs.transitions);
+		else
+			len = snprintf(reply, sizeof(reply), "unknown command, use apply, status or stop\n");
+		if(write(h->fd, reply, len) != len)
+			perror("Replying on control socket");
+	}
+	evDel(h);
+	close(h->fd);
+	free(h);
+	return (0);
+}
+
+static int onControl(struct evHandler * h) {
+	struct evHandler * c;
+	int fd;
+
+	if((fd = accept(h->fd, NULL, NULL)) < 0)
+		return (0);
+	if((c = malloc(sizeof(*c))) == NULL) {
+		close(fd);
+		return (0);
+	}
+	c->fd = fd;
+	c->fn = onControlClient;
+	c->ctx = h->ctx;
+	if(evAdd(c)) {
+		close(fd);
+		free(c);
+	}
+	return (0);
+}
+
+static int openControlSocket(const char * path) {
+	struct sockaddr_un a;
+	int fd;
+
+	if(strlen(path) >= sizeof(a.sun_path)) {
+		fprintf(stderr, "Control socket path too long\n");
+		return (-1);
+	}
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, path);
+	unlink(path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+			|| bind(fd, (struct sockaddr *)&a, sizeof(a)) || listen(fd, 4)) {
+		perror("Opening control socket");
+		return (-1);
+	}
+	return fd;
+}
+
+static int openUeventSocket(void) {
+	struct sockaddr_nl a;
+	int fd;
+
+	memset(&a, 0, sizeof(a));
+	a.nl_family = AF_NETLINK;
+	a.nl_groups = 1;
+	if((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) < 0
+			|| bind(fd, (struct sockaddr *)&a, sizeof(a))) {
+		perror("Opening uevent socket");
+		return (-1);
+	}
+	return fd;
+}
+
+/** runDaemon
+ *
+ * Stay resident: keep the P-state settings applied across cpu hotplug and
+ * SIGHUP, run the governor if one is selected and answer the control
+ * socket. Everything is single threaded and waits in one epoll_wait; with
+ * no governor no timer is armed at all. */
+static int runDaemon(struct daemonCtx * d, const char * socketPath) {
+	struct itimerspec its;
+	sigset_t mask;
+	int ret;
+
+	if((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("Creating epoll instance");
+		return (1);
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	d->signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	d->signals.fn = onSignal;
+	d->apply.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	d->apply.fn = onApply;
+	d->uevent.fd = openUeventSocket();
+	d->uevent.fn = onUevent;
+	d->signals.ctx = d->apply.ctx = d->uevent.ctx = d->timer.ctx = d->control.ctx = d;
+	if(d->signals.fd < 0 || d->apply.fd < 0 || evAdd(&d->signals) || evAdd(&d->apply)) {
+		perror("Setting up daemon events");
+		return (1);
+	}
+		/* Hotplug tracking is best effort, e.g. in containers. */
+	if(d->uevent.fd >= 0)
+		evAdd(&d->uevent);
+	if(socketPath != NULL) {
+		if((d->control.fd = openControlSocket(socketPath)) < 0)
+			return (1);
+		d->control.fn = onControl;
+		evAdd(&d->control);
+	}
+	if(d->gov != NULL) {
+		if(govInit(&d->gs, d->gov))
+			return (1);
+		d->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		d->timer.fn = onTimer;
+		its.it_interval.tv_sec = d->intervalMs / 1000;
+		its.it_interval.tv_nsec = (d->intervalMs % 1000) * 1000000L;
+		its.it_value = its.it_interval;
+		if(d->timer.fd < 0 || timerfd_settime(d->timer.fd, 0, &its, NULL) || evAdd(&d->timer)) {
+			perror("Arming governor timer");
+			return (1);
+		}
+		printf("Running %s governor every %d ms\n", d->gov->name, d->intervalMs);
+		if(d->load != NULL && sloLoadStart(d->load, &d->gs.t, d->intervalMs))
+			return (1);
+	}
+	ret = evRun();
+	if(d->load != NULL)
+		sloLoadStop(d->load);
+	if(d->gov != NULL)
+		govFinish(&d->gs);
+	if(socketPath != NULL)
+		unlink(socketPath);
+	return (ret);
+}
+
+
+/*****************************************************************************
+ * Energy.
+ */
+
+	/** Full load power of the fastest P-state of a Family 14h core, in W,
+	 * used when the P-state definition has no current (IddValue) fused. */
+#define EST_P0_WATTS	4.5
+
+static double nowNs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** cpuTopology
+ *
+ * Return the package of a cpu and the first cpu of its core, which
+ * identifies the core across packages. */
+static void cpuTopology(int cpu, int * pkg, int * core) {
+	int cpus, packages, smt;
+	long latencyNs;
+	char path[128];
+	FILE * stream;
+
+	if(simActive()) {
+		simTopology(&cpus, &packages, &smt, &latencyNs);
+		*pkg = cpu / ((cpus + packages - 1) / packages);
+		*core = cpu / smt * smt;
+		return;
+	}
+	*pkg = 0;
+	*core = cpu;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	if((stream = fopen(path, "r")) != NULL) {
+		if(fscanf(stream, "%d", pkg) != 1 || *pkg < 0)
+			*pkg = 0;
+		fclose(stream);
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if((stream = fopen(path, "r")) != NULL) {
+		if(fscanf(stream, "%d", core) != 1)
+			*core = cpu;
+		fclose(stream);
+	}
+}
+
+enum { ENERGY_NONE, ENERGY_RAPL, ENERGY_MODEL };
+
+static const char * energySources[] = {"not available", "measured", "estimated"};
+
+/** energyMeter
+ *
+ * Energy used by the packages of the target cpus. With RAPL, one package
+ * counter is read from the first target cpu of each package, plus PP0 on
+ * Intel or one counter per core on AMD. On Family 14h, which has no energy
+ * counters, power is estimated per core from the current P-state as
+ * V * Idd (or EST_P0_WATTS scaled by V^2*f) times the busy fraction.
+ * unit is the energy unit of each package in J, 0 for packages without
+ * target cpus. opPkg holds the package of each RAPL counter, -1 - package
+ * for core counters, or the package of each cpu for the estimate. */
+struct energyMeter {
+	int source, npkg, nops;
+	struct msrOp * ops;
+	int * opPkg;
+	uint32_t * last;
+	double * unit, * pkgJ, * coreJ;
+	double lastNs;
+	struct pstateTable t;
+	unsigned long long * busy, * total, * lastBusy, * lastTotal;
+	uint64_t * status;
+};
+
+/* Set up the RAPL counters of the target cpus, 0 on success. */
+static int energyInitRapl(struct energyMeter * m) {
+	int amd = cpuVendor == VENDOR_AMD, j, k, pkg, core, n = 0;
+	uint64_t val;
+
+	forEachCpu(j, &targetCpus) {
+		cpuTopology(j, &pkg, &core);
+		if(pkg + 1 > m->npkg)
+			m->npkg = pkg + 1;
+	}
+	if((m->ops = calloc(2 * ncpu, sizeof(*m->ops))) == NULL
+			|| (m->opPkg = calloc(2 * ncpu, sizeof(*m->opPkg))) == NULL
+			|| (m->last = calloc(2 * ncpu, sizeof(*m->last))) == NULL
+			|| (m->unit = calloc(3 * m->npkg, sizeof(*m->unit))) == NULL)
+		return (1);
+	m->pkgJ = m->unit + m->npkg;
+	m->coreJ = m->pkgJ + m->npkg;
+		/* Package counters (and Intel PP0) from the first cpu of each
+		 * package, AMD core counters from the first cpu of each core. */
+	forEachCpu(j, &targetCpus) {
+		cpuTopology(j, &pkg, &core);
+		if(m->unit[pkg] == 0) {
+			if(rdmsr(j, amd ? MSR_AMD_RAPL_PWR_UNIT : MSR_RAPL_POWER_UNIT, &val))
+				return (1);
+			m->unit[pkg] = 1.0 / (1ULL << RAPL_POWER_UNIT_ENERGY(val));
+			m->opPkg[n] = pkg;
+			m->ops[n].cpu = j;
+			m->ops[n++].msr = amd ? MSR_AMD_PKG_ENERGY : MSR_PKG_ENERGY_STATUS;
+			if(!amd) {
+				m->opPkg[n] = -1 - pkg;
+				m->ops[n].cpu = j;
+				m->ops[n++].msr = MSR_PP0_ENERGY_STATUS;
+			}
+		}
+		if(amd && core == j) {
+			m->opPkg[n] = -1 - pkg;
+			m->ops[n].cpu = j;
+			m->ops[n++].msr = MSR_AMD_CORE_ENERGY;
+		}
+	}
+	msrBatch(m->ops, n);
+		/* Not all parts have the core counters (Intel servers lack PP0). */
+	for(k = j = 0; j < n; j++) {
+		if(m->ops[j].err != 0 && m->opPkg[j] >= 0)
+			return (1);
+		if(m->ops[j].err != 0)
+			continue;
+		m->ops[k] = m->ops[j];
+		m->opPkg[k] = m->opPkg[j];
+		m->last[k++] = (uint32_t)m->ops[j].val;
+	}
+	m->nops = k;
+	return (0);
+}
+
+/* Set up the Family 14h estimate of the target cpus, 0 on success. */
+static int energyInitModel(struct energyMeter * m) {
+	int j, core;
+
+	if((m->opPkg = calloc(ncpu, sizeof(*m->opPkg))) == NULL
+			|| (m->busy = calloc(4 * ncpu, sizeof(*m->busy))) == NULL
+			|| (m->status = calloc(ncpu, sizeof(*m->status))) == NULL)
+		return (1);
+	forEachCpu(j, &targetCpus) {
+		cpuTopology(j, &m->opPkg[j], &core);
+		if(m->opPkg[j] + 1 > m->npkg)
+			m->npkg = m->opPkg[j] + 1;
+	}
+	if((m->unit = calloc(3 * m->npkg, sizeof(*m->unit))) == NULL)
+		return (1);
+	forEachCpu(j, &targetCpus)
+		m->unit[m->opPkg[j]] = 1;
+	m->pkgJ = m->unit + m->npkg;
+	m->coreJ = m->pkgJ + m->npkg;
+	m->total = m->busy + ncpu;
+	m->lastBusy = m->total + ncpu;
+	m->lastTotal = m->lastBusy + ncpu;
+	if(loadPstateTable(cpuSetNext(&targetCpus, 0), &m->t)
+			|| readCpuTimes(ncpu, m->lastBusy, m->lastTotal))
+		return (1);
+	return (0);
+}
+
+static void energyFree(struct energyMeter * m) {
+	free(m->ops);
+	free(m->opPkg);
+	free(m->last);
+	free(m->unit);
+	free(m->busy);
+	free(m->status);
+	memset(m, 0, sizeof(*m));
+}
+
+/** energyInit
+ *
+ * Pick the energy source of the processor and take the first readings. The
+ * source is ENERGY_NONE if neither RAPL nor the estimate is available. */
+static void energyInit(struct energyMeter * m) {
+	memset(m, 0, sizeof(*m));
+	if(isFamily14h()) {
+		if(energyInitModel(m) == 0)
+			m->source = ENERGY_MODEL;
+	}
+	else if(energyInitRapl(m) == 0)
+		m->source = ENERGY_RAPL;
+	if(m->source == ENERGY_NONE)
+		energyFree(m);
+	m->lastNs = nowNs();
+}
+
+/** energySample
+ *
+ * Fill pkgJ and coreJ with the energy used by each package and by its cores
+ * since the previous sample, and return the seconds elapsed, or a negative
+ * value on error. The 32 bits RAPL counters wrap around in about a minute
+ * under load, so samples must be closer than that. */
+static double energySample(struct energyMeter * m) {
+	double now = nowNs(), seconds = (now - m->lastNs) / 1e9, v, watts;
+	uint32_t delta;
+	int j, k, p;
+
+	m->lastNs = now;
+	if(m->source == ENERGY_NONE)
+		return (-1);
+	memset(m->pkgJ, 0, 2 * m->npkg * sizeof(*m->pkgJ));
+	if(m->source == ENERGY_RAPL) {
+		if(msrBatch(m->ops, m->nops))
+			return (-1);
+		for(k = 0; k < m->nops; k++) {
+			delta = (uint32_t)m->ops[k].val - m->last[k];
+			m->last[k] = (uint32_t)m->ops[k].val;
+			p = m->opPkg[k] >= 0 ? m->opPkg[k] : -1 - m->opPkg[k];
+			if(m->opPkg[k] >= 0)
+				m->pkgJ[p] += delta * m->unit[p];
+			else
+				m->coreJ[p] += delta * m->unit[p];
+		}
+		return (seconds);
+	}
+	if(readCurrent(m->status) || readCpuTimes(ncpu, m->busy, m->total))
+		return (-1);
+	forEachCpu(j, &targetCpus) {
+		p = m->opPkg[j];
+		k = COFVID_STATUS_CUR_PSTATE(m->status[j]);
+		v = voltage(COFVID_STATUS_CUR_VID(m->status[j]));
+		if(k < m->t.min || k > m->t.max)
+			k = m->t.max;
+			/* The V^2 * f estimate follows a Vid changed since the table
+			 * was read. */
+		watts = m->t.idd[k] > 0 ? v * m->t.idd[k]
+			: EST_P0_WATTS * m->t.power[k] * v * v / (voltage(m->t.vid[k]) * voltage(m->t.vid[k]));
+		if(m->total[j] > m->lastTotal[j])
+			m->coreJ[p] += watts * seconds * (m->busy[j] - m->lastBusy[j]) / (m->total[j] - m->lastTotal[j]);
+		m->lastBusy[j] = m->busy[j];
+		m->lastTotal[j] = m->total[j];
+	}
+	for(p = 0; p < m->npkg; p++)
+		m->pkgJ[p] = m->coreJ[p];
+	return (seconds);
+}
+
+/** showPower
+ *
+ * Measure the power of the packages of the target cpus over intervalMs. */
+static int showPower(int intervalMs) {
+	struct energyMeter m;
+	struct timespec ts;
+	double seconds;
+	int p;
+
+	energyInit(&m);
+	if(m.source == ENERGY_NONE) {
+		fprintf(stderr, "Error: no energy counters or estimate for this processor\n");
+		return (1);
+	}
+	ts.tv_sec = intervalMs / 1000;
+	ts.tv_nsec = (intervalMs % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+	if((seconds = energySample(&m)) <= 0) {
+		fprintf(stderr, "Error reading energy counters\n");
+		energyFree(&m);
+		return (1);
+	}
+	for(p = 0; p < m.npkg; p++) {
+		if(m.unit[p] == 0)
+			continue;
+		printf("Package %d: %.2f W, cores %.2f W (%s over %d ms)\n", p,
+			m.pkgJ[p] / seconds, m.coreJ[p] / seconds, energySources[m.source], intervalMs);
+	}
+	energyFree(&m);
+	return (0);
+}
+
+static int nbFd = -1;
+
+/** readNbConfig
+ *
+ * Read a 32 bits register of the northbridge configuration space. The
+ * descriptor is kept open for sampling. */
+static int readNbConfig(unsigned off, uint32_t * val) {
+	if(nbFd < 0 && (nbFd = open(NB_PCI_CONFIG, O_RDONLY | O_CLOEXEC)) < 0)
+		return (1);
+	if(pread(nbFd, val, sizeof(*val), off) != sizeof(*val))
+		return (1);
+	return (0);
+}
+
+/** readTemperature
+ *
+ * Return the control temperature (CurTmp, in 1/8 degrees) in degrees
+ * Celsius, or NAN when not available. D18F3xA4 reports it on Family 14h
+ * only, other processors have no temperature here. */
+static double readTemperature(void) {
+	uint32_t val;
+
+	if(simActive())
+		return simTemperature();
+	if(!isFamily14h() || readNbConfig(NB_REPORTED_TEMP, &val))
+		return NAN;
+	return REPORTED_TEMP_CUR_TMP(val) * 0.125;
+}
+
+/** thermalModel
+ *
+ * Lumped RC model of the package temperature, T' = T(k + 1) from the
+ * temperature T, the power P and the fan duty d (0 to 1) of the previous
+ * second. The package loses heat to the ambient Ta through a conductance
+ * the fan raises, G = G0 + G1 * d, which linearises to:
+ *	T' = c0 * T + c1 * P + c2 + c3 * d * (T - Ta)
+ * where c0 = exp(-dt / RC), c1 = R * (1 - c0) and c2 = Ta * (1 - c0) without
+ * the fan. Ta is taken from the previous fit, the first temperature read
+ * until there is one. It is fitted online by least squares with a
+ * forgetting factor, so that it follows changes of the ambient and of the
+ * cooling. */
+#define THERMAL_NCOEFS	4
+
+struct thermalModel {
+	struct energyMeter em;
+	double xx[THERMAL_NCOEFS][THERMAL_NCOEFS], xy[THERMAL_NCOEFS], c[THERMAL_NCOEFS];
+	double lastT, lastP, lastD, ambient, nextNs;
+	long samples;
+	int ready, ran[8];
+};
+
+/** thermalSolve
+ *
+ * Solve the normal equations by Gaussian elimination. A small ridge keeps
+ * them solvable while the power or the fan has not varied. */
+static int thermalSolve(struct thermalModel * m) {
+	double a[THERMAL_NCOEFS][THERMAL_NCOEFS + 1], ridge = 0, f;
+	int i, j, k, pivot;
+
+	for(i = 0; i < THERMAL_NCOEFS; i++)
+		ridge += 1e-6 * m->xx[i][i];
+	for(i = 0; i < THERMAL_NCOEFS; i++) {
+		for(j = 0; j < THERMAL_NCOEFS; j++)
+			a[i][j] = m->xx[i][j] + (i == j ? ridge : 0);
+		a[i][THERMAL_NCOEFS] = m->xy[i];
+	}
+	for(k = 0; k < THERMAL_NCOEFS; k++) {
+		for(pivot = i = k; i < THERMAL_NCOEFS; i++)
+			if(fabs(a[i][k]) > fabs(a[pivot][k]))
+				pivot = i;
+		if(fabs(a[pivot][k]) < 1e-12)
+			return (1);
+		for(j = k; j <= THERMAL_NCOEFS; j++) {
+			f = a[k][j];
+			a[k][j] = a[pivot][j];
+			a[pivot][j] = f;
+		}
+		for(i = k + 1; i < THERMAL_NCOEFS; i++)
+			for(f = a[i][k] / a[k][k], j = k; j <= THERMAL_NCOEFS; j++)
+				a[i][j] -= f * a[k][j];
+	}
+	for(i = THERMAL_NCOEFS - 1; i >= 0; i--) {
+		for(f = a[i][THERMAL_NCOEFS], j = i + 1; j < THERMAL_NCOEFS; j++)
+			f -= a[i][j] * m->c[j];
+		m->c[i] = f / a[i][i];
+	}
+	return m->c[0] <= 0 || m->c[0] >= 1;
+}
+
+/** thermalPredict
+ *
+ * Temperature in horizon seconds from t degrees at a constant power and
+ * fan duty. */
+static double thermalPredict(const struct thermalModel * m, double t, double watts, double duty, double horizon) {
+	double rho = m->c[0] + m->c[3] * duty, tInf;
+
+	if(rho <= 0 || rho >= 1)
+		return INFINITY;
+	tInf = (m->c[1] * watts + m->c[2] - m->c[3] * duty * m->ambient) / (1 - rho);
+	return tInf + (t - tInf) * pow(rho, horizon * 1000 / GOV_THERMAL_DT_MS);
+}
+
+/*****************************************************************************
+ * Fan
+ *
+ * A PWM fan output of hwmon: pwm<n> sets the duty from 0 to 255 once
+ * pwm<n>_enable is 1 (manual). The firmware gets the fan back on exit.
+ *****************************************************************************/
+
+	/** Power of the fan at full duty in W, following the cube of the
+	 * speed, the duty steps the joint controller tries, and the duty added
+	 * now and then once the model is fitted to keep its fan term known. */
+#define FAN_WATTS	1.5
+#define FAN_STEPS	8
+#define FAN_DITHER	(1.0 / FAN_STEPS)
+
+static struct {
+	char pwm[PATH_MAX], enable[PATH_MAX];
+	int savedPwm, savedEnable, open;
+	double duty;
+} fan;
+
+	/** --fan : hwmon directory and PWM output, NULL when off. */
+static const char * fanSpec = NULL;
+
+static int sysfsRead(const char * path, int * val) {
+	char buf[32];
+
+	if(readProcFile(path, buf, sizeof(buf)) || sscanf(buf, "%d", val) != 1)
+		return (1);
+	return (0);
+}
+
+static int sysfsWrite(const char * path, int val) {
+	FILE * stream;
+	int ret;
+
+	if((stream = fopen(path, "w")) == NULL)
+		return (1);
+	ret = fprintf(stream, "%d\n", val) < 0;
+	return fclose(stream) || ret;
+}
+
+/** fanSet
+ *
+ * Set the duty of the fan, from 0 to 1. */
+static int fanSet(double duty) {
+	if(sysfsWrite(fan.pwm, (int)lround(duty * 255))) {
+		perror(fan.pwm);
+		return (1);
+	}
+	fan.duty = duty;
+	return (0);
+}
+
+/** fanOpen
+ *
+ * Take manual control of a fan given as <hwmon dir>[:<pwm no>], saving the
+ * settings to give back. */
+static int fanOpen(const char * spec) {
+	const char * colon = strrchr(spec, ':');
+	int n = 1, len = strlen(spec);
+
+	if(colon != NULL && sscanf(colon + 1, "%d", &n) == 1)
+		len = colon - spec;
+	snprintf(fan.pwm, sizeof(fan.pwm), "%.*s/pwm%d", len, spec, n);
+	snprintf(fan.enable, sizeof(fan.enable), "%.*s/pwm%d_enable", len, spec, n);
+	if(sysfsRead(fan.pwm, &fan.savedPwm) || sysfsRead(fan.enable, &fan.savedEnable)) {
+		fprintf(stderr, "Error reading %s and %s\n", fan.pwm, fan.enable);
+		return (1);
+	}
+	if(sysfsWrite(fan.enable, 1)) {
+		perror(fan.enable);
+		return (1);
+	}
+	fan.open = 1;
+	return fanSet(1);
+}
+
+static void fanClose(void) {
+	if(!fan.open)
+		return;
+	sysfsWrite(fan.pwm, fan.savedPwm);
+	sysfsWrite(fan.enable, fan.savedEnable);
+	fan.open = 0;
+}
+
+/** thermalRan
+ *
+ * Count the target cores running in each P-state, from their COFVID
+ * status (IA32_PERF_STATUS on Intel), into m->ran. */
+static int thermalRan(struct govState * g, struct thermalModel * m) {
+	int j, k, n = 0;
+
+	forEachCpu(j, &targetCpus) {
+		memset(&g->ops[n], 0, sizeof(g->ops[n]));
+		g->ops[n].cpu = j;
+		g->ops[n++].msr = cpuVendor == VENDOR_INTEL ? MSR_PERF_STATUS : MSR_COFVID_STATUS;
+	}
+	if(msrBatch(g->ops, n))
+		return (1);
+	memset(m->ran, 0, sizeof(m->ran));
+	for(k = 0; k < n; k++)
+		m->ran[cpuVendor == VENDOR_INTEL ? pstateOfRatio(&g->t, PERF_STATUS_RATIO(g->ops[k].val))
+			: (int)COFVID_STATUS_CUR_PSTATE(g->ops[k].val) & 7]++;
+	return (0);
+}
+
+/** thermalWatts
+ *
+ * The power measured scaled to a cap on the fastest P-state, by the V^2 * f
+ * estimate of the table: the cores that ran faster than the cap, or were
+ * held at the cap in force, would run at the new one, the others as they
+ * did. */
+static double thermalWatts(const struct govState * g, const struct thermalModel * m, double watts, int cap) {
+	double ran = 0, capped = 0;
+	int k;
+
+	for(k = g->t.min; k <= g->t.max; k++) {
+		ran += m->ran[k] * g->t.power[k];
+		capped += m->ran[k] * g->t.power[k < cap || k == g->thermalCap ? cap : k];
+	}
+	return ran > 0 ? watts * capped / ran : watts;
+}
+
+/** thermalDuty
+ *
+ * Find the fan duty that keeps the temperature predicted at the horizon
+ * margin below the limit with the least CPU plus fan power, return 1 when
+ * none does. */
+static int thermalDuty(const struct thermalModel * m, double t, double watts, double margin, double * duty) {
+	double best = INFINITY, total, d;
+	int s;
+
+	for(s = 0; s <= FAN_STEPS; s++) {
+		d = (double)s / FAN_STEPS;
+		total = watts + FAN_WATTS * d * d * d;
+		if(total < best && thermalPredict(m, t, watts, d, thermalHorizon) <= thermalLimit - margin) {
+			best = total;
+			*duty = d;
+		}
+	}
+	return best == INFINITY;
+}
+
+/** thermalTick
+ *
+ * Once every GOV_THERMAL_DT_MS, sample the temperature and the estimated
+ * power, update the model and move the fastest P-state allowed: one step
+ * slower when the temperature predicted at the horizon passes the limit,
+ * one step faster when the next faster P-state is predicted to stay
+ * GOV_THERMAL_HYST below it. The power under another cap is the one
+ * measured scaled by thermalWatts() from the P-states the cores ran at.
+ * With a fan, a cap holds when some duty keeps it under the limit, and the
+ * cheapest such duty is used; the fan goes full as soon as the limit is
+ * passed. */
+static void thermalTick(struct govState * g) {
+	struct thermalModel * m = g->thermal;
+	double now = nowNs(), seconds, t, watts = 0, x[THERMAL_NCOEFS], duty = fan.duty, faster;
+	int i, j, cap = g->thermalCap;
+
+	if(m == NULL) {
+		if((m = g->thermal = calloc(1, sizeof(*m))) == NULL) {
+			perror("Allocating thermal model");
+			exit(1);
+		}
+		energyInit(&m->em);
+		if(m->em.source == ENERGY_NONE || isnan(readTemperature()))
+			fprintf(stderr, "Warning: no temperature or power estimate, --thermal-limit is off\n");
+			/* Leave the fan to the firmware when there is nothing to
+			 * control it with. */
+		else if(fanSpec != NULL && fanOpen(fanSpec))
+			exit(1);
+		m->lastT = NAN;
+		m->nextNs = now;
+	}
+	if(now < m->nextNs || m->em.source == ENERGY_NONE)
+		return;
+	m->nextNs = now + GOV_THERMAL_DT_MS * 1e6;
+	if(isnan(t = readTemperature()) || (seconds = energySample(&m->em)) <= 0)
+		return;
+	for(i = 0; i < m->em.npkg; i++)
+		watts += m->em.pkgJ[i] / seconds;
+	if(thermalRan(g, m)) {
+		fprintf(stderr, "Error reading MSR register 0x%" PRIX64 "\n", (uint64_t)g->ops[0].msr);
+		return;
+	}
+	if(!isnan(m->lastT)) {
+		x[0] = m->lastT;
+		x[1] = m->lastP;
+		x[2] = 1;
+		x[3] = m->lastD * (m->lastT - m->ambient);
+		for(i = 0; i < THERMAL_NCOEFS; i++) {
+			for(j = 0; j < THERMAL_NCOEFS; j++)
+				m->xx[i][j] = GOV_THERMAL_FORGET * m->xx[i][j] + x[i] * x[j];
+			m->xy[i] = GOV_THERMAL_FORGET * m->xy[i] + x[i] * t;
+		}
+		m->samples++;
+	}
+	else
+		m->ambient = t;
+	m->lastT = t;
+	m->lastP = watts;
+	if(m->samples >= GOV_THERMAL_MIN_SAMPLES && thermalSolve(m) == 0) {
+		m->ambient = m->c[2] / (1 - m->c[0]);
+		m->ready = 1;
+	}
+	if(fan.open) {
+			/* Vary the fan while learning, then for one sample in
+			 * GOV_THERMAL_MIN_SAMPLES run it a little faster than
+			 * chosen, never slower, so that its effect keeps showing
+			 * at the temperatures it runs at. */
+		if(!m->ready)
+			duty = t > thermalLimit ? 1 : 1 - 0.25 * (m->samples % 3);
+		else {
+			if(thermalDuty(m, t, thermalWatts(g, m, watts, cap), 0, &duty)) {
+				if(cap < g->t.max)
+					cap++;
+				if(thermalDuty(m, t, thermalWatts(g, m, watts, cap), 0, &duty))
+					duty = 1;
+			}
+			else if(cap > g->t.min && thermalDuty(m, t, thermalWatts(g, m, watts, cap - 1), GOV_THERMAL_HYST,
+					&faster) == 0) {
+				cap--;
+				duty = faster;
+			}
+			if(t > thermalLimit)
+				duty = 1;
+			else if(m->samples % GOV_THERMAL_MIN_SAMPLES == 0)
+				duty = fmin(1, duty + FAN_DITHER);
+		}
+		if(duty != fan.duty)
+			fanSet(duty);
+		m->lastD = fan.duty;
+	}
+	else if(m->ready) {
+		if(thermalPredict(m, t, thermalWatts(g, m, watts, cap), 0, thermalHorizon) > thermalLimit) {
+			if(cap < g->t.max)
+				cap++;
+		}
+		else if(cap > g->t.min && thermalPredict(m, t, thermalWatts(g, m, watts, cap - 1), 0,
+				thermalHorizon) < thermalLimit - GOV_THERMAL_HYST)
+			cap--;
+	}
+	if(verbose)
+		printf("%.1f C, %.2f W, fan %.0f%%, fastest P-state %d -> %d\n", t, watts, 100 * fan.duty,
+			g->thermalCap, cap);
+	g->thermalCap = cap;
+}
+
+/** thermalFinish
+ *
+ * Report the model fitted and free it. */
+static void thermalFinish(struct govState * g) {
+	struct thermalModel * m = g->thermal;
+
+	fanClose();
+	if(m == NULL)
+		return;
+	if(m->ready) {
+		printf("%s governor: thermal time constant %.0f s, %.2f C/W, ambient %.1f C over %ld samples, "
+			"%ld P-state choices capped\n", g->gov->name, -GOV_THERMAL_DT_MS / 1000.0 / log(m->c[0]),
+			m->c[1] / (1 - m->c[0]), m->c[2] / (1 - m->c[0]), m->samples, g->thermalHeld);
+		if(fan.open)
+			printf("%s governor: %.2f C/W with the fan at full duty\n", g->gov->name,
+				m->c[1] / (1 - m->c[0] - m->c[3]));
+	}
+	energyFree(&m->em);
+	free(m);
+	g->thermal = NULL;
+}
+
+/*****************************************************************************
+ * Radeon DPM
+ *
+ * The GPU of the APU shares the power and thermal envelope of the cores.
+ * The radeon driver takes a power state (battery, balanced, performance)
+ * in power_dpm_state and a performance level (auto, low, high) in
+ * power_dpm_force_performance_level of the device directory. How busy the
+ * GPU is comes from gpu_busy_percent there when the driver has it (amdgpu,
+ * or a stand-in directory), else from the power level the radeon_pm_info of
+ * the card in debugfs reports, relative to the highest one seen. That level
+ * follows the load only while the performance level is auto, so while a
+ * shift forces it, it is given back to auto for one interval in
+ * GOV_APU_PROBE to be sampled.
+ *****************************************************************************/
+
+	/** A side is busy above GOV_APU_BUSY of its time (GPU) or of all the
+	 * cores (CPU), and a shift takes GOV_APU_CALM agreeing seconds. When
+	 * the GPU takes the budget, the cores are held to the fastest P-state
+	 * using at most GOV_APU_CPU_SHARE of the power of the fastest one. */
+#define GOV_APU_DT_MS		1000
+#define GOV_APU_BUSY		0.60
+#define GOV_APU_CALM		2
+#define GOV_APU_CPU_SHARE	0.50
+#define GOV_APU_PROBE		5
+#define DRI_DEBUGFS_DIR		"/sys/kernel/debug/dri"
+
+enum {
+	APU_BALANCED,
+	APU_GPU,
+	APU_CPU,
+	APU_NMODES
+};
+
+static const char * apuModeNames[APU_NMODES] = {"balanced", "GPU", "CPU"};
+	/** power_dpm_state and power_dpm_force_performance_level of a mode. */
+static const char * apuStates[APU_NMODES] = {"balanced", "performance", "battery"};
+static const char * apuLevels[APU_NMODES] = {"auto", "high", "low"};
+
+static struct {
+	char state[PATH_MAX], level[PATH_MAX], busy[PATH_MAX], pmInfo[PATH_MAX];
+	char savedState[32], savedLevel[32];
+	unsigned long long * cpuBusy, * cpuTotal, * nowBusy, * nowTotal;
+	double nextNs;
+	int open, mode, candidate, calm, maxLevel, hasBusy, forced, probing;
+	long seconds[APU_NMODES];
+} apu;
+
+static int sysfsWriteString(const char * path, const char * val) {
+	FILE * stream;
+	int ret;
+
+	if((stream = fopen(path, "w")) == NULL)
+		return (1);
+	ret = fprintf(stream, "%s\n", val) < 0;
+	return fclose(stream) || ret;
+}
+
+static int sysfsReadString(const char * path, char * buf, size_t size) {
+	if(readProcFile(path, buf, size))
+		return (1);
+	buf[strcspn(buf, "\n")] = '\0';
+	return (0);
+}
+
+/** apuCard
+ *
+ * Number of the drm card of the --apu directory, from a card<n> in its
+ * path or, for the device directory, from the drm/card<n> under it. -1 if
+ * none. */
+static int apuCard(void) {
+	const char * p;
+	struct dirent * ent;
+	char path[PATH_MAX];
+	DIR * dir;
+	int n = -1;
+
+	for(p = strstr(apuDir, "card"); p != NULL; p = strstr(p + 1, "card"))
+		if(sscanf(p, "card%d", &n) == 1)
+			return n;
+	snprintf(path, sizeof(path), "%s/drm", apuDir);
+	if((dir = opendir(path)) == NULL)
+		return (-1);
+	while((ent = readdir(dir)) != NULL)
+		if(sscanf(ent->d_name, "card%d", &n) == 1)
+			break;
+	closedir(dir);
+	return n;
+}
+
+/** gpuBusy
+ *
+ * Fraction of the last interval the GPU was busy, NAN when unknown, as is
+ * the radeon power level while a shift forces it. */
+static double gpuBusy(void) {
+	char buf[4096], * p;
+	int busy, level;
+
+	if(apu.hasBusy && sysfsRead(apu.busy, &busy) == 0)
+		return busy / 100.0;
+	if(apu.pmInfo[0] == '\0' || (apu.mode != APU_BALANCED && !apu.probing)
+			|| readProcFile(apu.pmInfo, buf, sizeof(buf)) || (p = strstr(buf, "power level")) == NULL
+			|| sscanf(p, "power level %d", &level) != 1)
+		return NAN;
+	if(level > apu.maxLevel)
+		apu.maxLevel = level;
+	return apu.maxLevel > 0 ? (double)level / apu.maxLevel : 0;
+}
+
+/** apuSet
+ *
+ * Give the budget to a side: the DPM state and level of the GPU, and the
+ * fastest P-state the cores may take. */
+static int apuSet(struct govState * g, int mode) {
+	int k;
+
+	if(sysfsWriteString(apu.state, apuStates[mode]) || sysfsWriteString(apu.level, apuLevels[mode])) {
+		fprintf(stderr, "Error setting the %s power state in %s\n", apuStates[mode], apu.state);
+		return (1);
+	}
+	apu.forced = apu.probing = 0;
+	g->apuCap = g->t.min;
+	if(mode == APU_GPU)
+		for(k = g->t.min; k <= g->t.max; k++)
+			if(g->t.power[k] <= GOV_APU_CPU_SHARE * g->t.power[g->t.min]) {
+				g->apuCap = k;
+				break;
+			}
+	apu.mode = mode;
+	return (0);
+}
+
+/** apuOpen
+ *
+ * Save the DPM settings of the GPU to give back, then start balanced. */
+static int apuOpen(struct govState * g) {
+	int busy, card;
+
+	snprintf(apu.state, sizeof(apu.state), "%s/power_dpm_state", apuDir);
+	snprintf(apu.level, sizeof(apu.level), "%s/power_dpm_force_performance_level", apuDir);
+	snprintf(apu.busy, sizeof(apu.busy), "%s/gpu_busy_percent", apuDir);
+	apu.hasBusy = sysfsRead(apu.busy, &busy) == 0;
+	if(!apu.hasBusy && (card = apuCard()) >= 0)
+		snprintf(apu.pmInfo, sizeof(apu.pmInfo), "%s/%d/radeon_pm_info", DRI_DEBUGFS_DIR, card);
+	if(!apu.hasBusy && apu.pmInfo[0] == '\0')
+		fprintf(stderr, "Warning: no GPU load in %s, the budget stays balanced\n", apuDir);
+	else if(verbose)
+		printf("GPU load from %s\n", apu.hasBusy ? apu.busy : apu.pmInfo);
+	if(sysfsReadString(apu.state, apu.savedState, sizeof(apu.savedState))
+			|| sysfsReadString(apu.level, apu.savedLevel, sizeof(apu.savedLevel))) {
+		fprintf(stderr, "Error reading %s and %s\n", apu.state, apu.level);
+		return (1);
+	}
+	if((apu.cpuBusy = calloc(4 * ncpu, sizeof(*apu.cpuBusy))) == NULL) {
+		perror("Allocating APU state");
+		exit(1);
+	}
+	apu.cpuTotal = apu.cpuBusy + ncpu;
+	apu.nowBusy = apu.cpuTotal + ncpu;
+	apu.nowTotal = apu.nowBusy + ncpu;
+	if(readCpuTimes(ncpu, apu.cpuBusy, apu.cpuTotal))
+		return (1);
+	apu.open = 1;
+	apu.nextNs = nowNs() + GOV_APU_DT_MS * 1e6;
+	return apuSet(g, APU_BALANCED);
+}
+
+/** apuTick
+ *
+ * Once every GOV_APU_DT_MS, compare how busy the cores and the GPU were,
+ * and once a side alone has been busy for GOV_APU_CALM intervals, shift the
+ * budget to it: the GPU gets its performance state while the cores are
+ * capped, or the cores get the fastest P-state while the GPU is held low.
+ * Both or neither busy goes back to balanced. Without gpu_busy_percent, a
+ * forced level is released to auto for one interval every GOV_APU_PROBE, so
+ * that the radeon power level shows the load again. */
+static int apuTick(struct govState * g) {
+	unsigned long long busy = 0, total = 0;
+	double now = nowNs(), cpu, gpu;
+	int j, mode;
+
+	if(!apu.open && apuOpen(g))
+		return (1);
+	if(now < apu.nextNs)
+		return (0);
+	apu.nextNs = now + GOV_APU_DT_MS * 1e6;
+	if(readCpuTimes(ncpu, apu.nowBusy, apu.nowTotal))
+		return (1);
+	forEachCpu(j, &targetCpus) {
+		busy += apu.nowBusy[j] - apu.cpuBusy[j];
+		total += apu.nowTotal[j] - apu.cpuTotal[j];
+	}
+	memcpy(apu.cpuBusy, apu.nowBusy, 2 * ncpu * sizeof(*apu.cpuBusy));
+	cpu = total > 0 ? (double)busy / total : 0;
+	apu.seconds[apu.mode]++;
+	if(isnan(gpu = gpuBusy())) {
+		if(apu.hasBusy || apu.pmInfo[0] == '\0' || apu.mode == APU_BALANCED || ++apu.forced < GOV_APU_PROBE)
+			return (0);
+		apu.forced = 0;
+		apu.probing = 1;
+		if(sysfsWriteString(apu.level, apuLevels[APU_BALANCED])) {
+			perror(apu.level);
+			return (1);
+		}
+		return (0);
+	}
+	if(apu.probing) {
+		apu.probing = 0;
+		if(sysfsWriteString(apu.level, apuLevels[apu.mode])) {
+			perror(apu.level);
+			return (1);
+		}
+	}
+	if(gpu > GOV_APU_BUSY && cpu <= GOV_APU_BUSY)
+		mode = APU_GPU;
+	else if(cpu > GOV_APU_BUSY && gpu <= GOV_APU_BUSY)
+		mode = APU_CPU;
+	else
+		mode = APU_BALANCED;
+	if(mode != apu.candidate) {
+		apu.candidate = mode;
+		apu.calm = 0;
+	}
+	if(verbose)
+		printf("CPU %.0f%% busy, GPU %.0f%% busy, budget to %s\n", 100 * cpu, 100 * gpu, apuModeNames[apu.mode]);
+	if(mode != apu.mode && ++apu.calm >= GOV_APU_CALM)
+		return apuSet(g, mode);
+	return (0);
+}
+
+/** apuFinish
+ *
+ * Give the GPU its DPM settings back and report how long each side had
+ * the budget. */
+static void apuFinish(struct govState * g) {
+	if(!apu.open)
+		return;
+	sysfsWriteString(apu.state, apu.savedState);
+	sysfsWriteString(apu.level, apu.savedLevel);
+	printf("%s governor: budget balanced %ld s, to the GPU %ld s, to the CPU %ld s, "
+		"%ld P-state choices capped for the GPU\n", g->gov->name, apu.seconds[APU_BALANCED], apu.seconds[APU_GPU],
+		apu.seconds[APU_CPU], g->apuHeld);
+	free(apu.cpuBusy);
+	apu.open = 0;
+}
+
+/** mainPllMHz
+ *
+ * Return the main PLL frequency, from which core frequencies are obtained
+ * by dividing by the P-state divisor. Falls back on cpufreq's maximum
+ * frequency times the divisor of the fastest P-state. On Intel this is the
+ * frequency of the fastest non-turbo ratio, from the 100 MHz bus clock. */
+static double mainPllMHz(const struct pstateTable * t) {
+	uint32_t val;
+	FILE * stream;
+	long khz;
+
+	if(cpuVendor == VENDOR_INTEL)
+		return 100.0 * t->ratio[t->min];
+	if(readNbConfig(NB_CLOCK_POWER_CTL, &val) == 0)
+		return 100.0 * (CLOCK_POWER_CTL_MAIN_PLL_OP_FREQ_ID(val) + 0x10);
+	if((stream = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r")) != NULL) {
+		if(fscanf(stream, "%ld", &khz) == 1) {
+			fclose(stream);
+			return khz / 1000.0 * t->div[t->min];
+		}
+		fclose(stream);
+	}
+	return 0;
+}
+
+	/** Dashboard layout: a title row, a header row, then one row per cpu. */
+#define TUI_FIRST_ROW	3
+#define TUI_NCOLS	6
+#define TUI_CELL	16
+
+static const struct {
+	int col, width;
+	const char * title;
+} tuiCols[TUI_NCOLS] = {
+	{1, 6, "CPU"}, {7, 9, "P-state"}, {16, 14, "Vid"},
+	{30, 8, "div"}, {38, 12, "MHz"}, {50, 12, "busy MHz"}
+};
+
+/** tuiState
+ *
+ * The dashboard keeps the text last drawn in every cell, so that a refresh
+ * only emits cursor moves and text for the cells that changed. */
+struct tuiState {
+	struct pstateTable t;
+	struct energyMeter energy;
+	double pllMHz;
+	uint64_t * aperf, * mperf, * sample;
+	struct msrOp * ops;
+	char (* cells)[TUI_NCOLS][TUI_CELL];
+	char title[80];
+	char out[16384];
+	size_t len;
+	int intervalMs;
+	struct evHandler timer, input, signals;
+	struct termios saved;
+};
+
+static void tuiEmit(struct tuiState * s, const char * text) {
+	size_t n = strlen(text);
+
+	if(s->len + n < sizeof(s->out)) {
+		memcpy(s->out + s->len, text, n);
+		s->len += n;
+	}
+}
+
+static void tuiFlush(struct tuiState * s) {
+	if(s->len > 0 && write(STDOUT_FILENO, s->out, s->len) < 0)
+		perror("Writing dashboard");
+	s->len = 0;
+}
+
+/* Draw text in a cell if it differs from what is on screen. */
+static void tuiCell(struct tuiState * s, char * prev, int row, int c, const char * text) {
+	char buf[64];
+
+	if(strcmp(prev, text) == 0)
+		return;
+	snprintf(buf, sizeof(buf), "\033[%d;%dH%-*.*s", row, tuiCols[c].col, tuiCols[c].width, tuiCols[c].width, text);
+	tuiEmit(s, buf);
+	snprintf(prev, TUI_CELL, "%s", text);
+}
+
+/* Clear the screen and forget all cells, e.g. after a resize. */
+static void tuiRedrawAll(struct tuiState * s) {
+	char buf[64];
+	int c;
+
+	memset(s->cells, 0, ncpu * sizeof(*s->cells));
+	s->title[0] = '\0';
+	tuiEmit(s, "\033[2J");
+	for(c = 0; c < TUI_NCOLS; c++) {
+		snprintf(buf, sizeof(buf), "\033[%d;%dH\033[7m%-*s\033[0m", TUI_FIRST_ROW - 1, tuiCols[c].col, tuiCols[c].width, tuiCols[c].title);
+		tuiEmit(s, buf);
+	}
+}
+
+/** tuiRefresh
+ *
+ * Sample the status register and the APERF/MPERF counters of each cpu and
+ * the temperature, then redraw the cells that changed. MHz is the
+ * frequency of the current P-state, busy MHz the average frequency while
+ * not halted over the last interval. */
+static int tuiRefresh(struct tuiState * s) {
+	char text[TUI_CELL], title[80];
+	uint64_t val, aperf, mperf;
+	float div;
+	double temp, seconds, volts;
+	int j, row, n, pstate;
+
+	temp = readTemperature();
+	n = snprintf(title, sizeof(title), "undervolt");
+	if(!isnan(temp))
+		n += snprintf(title + n, sizeof(title) - n, " - %.1f C", temp);
+	if((seconds = energySample(&s->energy)) > 0)
+		n += snprintf(title + n, sizeof(title) - n, " - %.1f W", s->energy.pkgJ[0] / seconds);
+	snprintf(title + n, sizeof(title) - n, " - every %d ms - q to quit", s->intervalMs);
+	if(strcmp(title, s->title) != 0) {
+		tuiEmit(s, "\033[1;1H\033[K");
+		tuiEmit(s, title);
+		strcpy(s->title, title);
+	}
+	if(sampleCpus(s->ops, s->sample, s->sample + ncpu, s->sample + 2 * ncpu))
+		return (1);
+	row = TUI_FIRST_ROW;
+	forEachCpu(j, &targetCpus) {
+		val = s->sample[j];
+		aperf = s->sample[ncpu + j];
+		mperf = s->sample[2 * ncpu + j];
+		pstate = statusDecode(&s->t, val, &volts, &div);
+		snprintf(text, sizeof(text), "%d", j);
+		tuiCell(s, s->cells[j][0], row, 0, text);
+		snprintf(text, sizeof(text), "%d", pstate);
+		tuiCell(s, s->cells[j][1], row, 1, text);
+		if(cpuVendor == VENDOR_INTEL)
+			snprintf(text, sizeof(text), "%.4fV", volts);
+		else
+			snprintf(text, sizeof(text), "0x%02" PRIX64 " %.4fV", COFVID_STATUS_CUR_VID(val), volts);
+		tuiCell(s, s->cells[j][2], row, 2, text);
+		snprintf(text, sizeof(text), "%.2f", div);
+		tuiCell(s, s->cells[j][3], row, 3, text);
+		snprintf(text, sizeof(text), "%.0f", div > 0 ? s->pllMHz / div : 0);
+		tuiCell(s, s->cells[j][4], row, 4, text);
+		if(s->mperf[j] != 0 && mperf != s->mperf[j])
+			snprintf(text, sizeof(text), "%.0f", s->pllMHz / s->t.div[s->t.min]
+				* (double)(aperf - s->aperf[j]) / (mperf - s->mperf[j]));
+		else
+			snprintf(text, sizeof(text), "-");
+		tuiCell(s, s->cells[j][5], row, 5, text);
+		s->aperf[j] = aperf;
+		s->mperf[j] = mperf;
+		row++;
+	}
+	if(s->len > 0) {
+		snprintf(title, sizeof(title), "\033[%d;1H", row);
+		tuiEmit(s, title);
+		tuiFlush(s);
+	}
+	return (0);
+}
+
+static int onTuiTimer(struct evHandler * h) {
+	uint64_t expirations;
+
+	if(read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return (0);
+	return tuiRefresh(h->ctx);
+}
+
+static int onTuiInput(struct evHandler * h) {
+	char c;
+
+	if(read(h->fd, &c, 1) == 1 && (c == 'q' || c == 'Q'))
+		stopRequested = 1;
+	return (0);
+}
+
+static int onTuiSignal(struct evHandler * h) {
+	struct tuiState * s = h->ctx;
+	struct signalfd_siginfo si;
+
+	if(read(h->fd, &si, sizeof(si)) != sizeof(si))
+		return (0);
+	if(si.ssi_signo == SIGWINCH) {
+		tuiRedrawAll(s);
+		return tuiRefresh(s);
+	}
+	stopRequested = 1;
+	return (0);
+}
+
+/** runTui
+ *
+ * Live dashboard of all cores, refreshed at most every 100 ms from the
+ * same event loop as the daemon. Only the cells whose text changed are
+ * redrawn, and all msr accesses go through cached descriptors. */
+static int runTui(int intervalMs) {
+	struct tuiState * s;
+	struct itimerspec its;
+	struct termios raw;
+	sigset_t mask;
+	int ret, tty;
+
+	if(intervalMs < 100)
+		intervalMs = 100;
+	if((s = calloc(1, sizeof(*s))) == NULL
+			|| (s->cells = calloc(ncpu, sizeof(*s->cells))) == NULL
+			|| (s->aperf = calloc(5 * ncpu, sizeof(*s->aperf))) == NULL
+			|| (s->ops = calloc(3 * ncpu, sizeof(*s->ops))) == NULL) {
+		perror("Allocating dashboard");
+		exit(1);
+	}
+	s->mperf = s->aperf + ncpu;
+	s->sample = s->mperf + ncpu;
+	s->intervalMs = intervalMs;
+	if(loadPstateTable(cpuSetNext(&targetCpus, 0), &s->t)) {
+		fprintf(stderr, "Error reading P-state table\n");
+		return (1);
+	}
+	s->pllMHz = mainPllMHz(&s->t);
+	energyInit(&s->energy);
+	if((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("Creating epoll instance");
+		return (1);
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	s->signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	s->signals.fn = onTuiSignal;
+	s->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	s->timer.fn = onTuiTimer;
+	s->input.fd = STDIN_FILENO;
+	s->input.fn = onTuiInput;
+	s->signals.ctx = s->timer.ctx = s->input.ctx = s;
+	its.it_interval.tv_sec = intervalMs / 1000;
+	its.it_interval.tv_nsec = (intervalMs % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if(s->signals.fd < 0 || s->timer.fd < 0 || timerfd_settime(s->timer.fd, 0, &its, NULL)
+			|| evAdd(&s->signals) || evAdd(&s->timer)) {
+		perror("Setting up dashboard events");
+		return (1);
+	}
+	if((tty = isatty(STDIN_FILENO)) && tcgetattr(STDIN_FILENO, &s->saved) == 0) {
+		raw = s->saved;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+		evAdd(&s->input);
+	}
+		/* Alternate screen, hidden cursor. */
+	tuiEmit(s, "\033[?1049h\033[?25l");
+	tuiRedrawAll(s);
+	ret = tuiRefresh(s);
+	if(ret == 0)
+		ret = evRun();
+	tuiEmit(s, "\033[?25h\033[?1049l");
+	tuiFlush(s);
+	if(tty)
+		tcsetattr(STDIN_FILENO, TCSANOW, &s->saved);
+	energyFree(&s->energy);
+	free(s->aperf);
+	free(s->ops);
+	free(s->cells);
+	free(s);
+	return (ret);
+}
+
+/*****************************************************************************
+ * Intel Hardware P-states.
+ */
+
+	/** Names of the energy-performance preference values, as the
+	 * intel_pstate driver exposes them. */
+static const struct {
+	const char * name;
+	int epp;
+} eppNames[] = {
+	{"performance", 0}, {"balance_performance", 128},
+	{"balance_power", 192}, {"power", 255}, {NULL, 0}
+};
+
+static const char * eppName(int epp) {
+	int i;
+
+	for(i = 0; eppNames[i].name != NULL; i++)
+		if(eppNames[i].epp == epp)
+			return eppNames[i].name;
+	return "custom";
+}
+
+/** hwpRequest
+ *
+ * HWP request fields to set, -1 leaving a field unchanged. */
+struct hwpRequest {
+	int min, max, desired, epp;
+};
+
+/** hwpParse
+ *
+ * Parse min=<perf>,max=<perf>,desired=<perf>,epp=<value or name>. */
+static int hwpParse(struct hwpRequest * r, const char * spec) {
+	char key[16], value[32];
+	const char * p = spec;
+	int used, i, * field;
+	long v;
+	char * end;
+
+	r->min = r->max = r->desired = r->epp = -1;
+	while(*p != '\0') {
+		if(sscanf(p, "%15[a-z]=%31[^,]%n", key, value, &used) != 2)
+			return (1);
+		p += used;
+		if(*p == ',')
+			p++;
+		if(strcmp(key, "min") == 0)
+			field = &r->min;
+		else if(strcmp(key, "max") == 0)
+			field = &r->max;
+		else if(strcmp(key, "desired") == 0)
+			field = &r->desired;
+		else if(strcmp(key, "epp") == 0)
+			field = &r->epp;
+		else
+			return (1);
+		v = strtol(value, &end, 0);
+		if(*end != '\0') {
+			if(field != &r->epp)
+				return (1);
+			for(i = 0; eppNames[i].name != NULL; i++)
+				if(strcmp(eppNames[i].name, value) == 0)
+					break;
+			if(eppNames[i].name == NULL)
+				return (1);
+			v = eppNames[i].epp;
+		}
+		if(v < 0 || v > 0xFF)
+			return (1);
+		*field = v;
+	}
+	return (0);
+}
+
+	/** Voltage planes of the overclocking mailbox. */
+static const char * ocPlanes[] = {"core", "gpu", "cache", "uncore", "analog I/O"};
+
+/* Wait for the mailbox to clear BUSY, return 0 with its value or 1 on
+ * timeout. */
+static int ocWait(int cpu, uint64_t * val) {
+	struct timespec ts = {0, 10000};
+	int i;
+
+	for(i = 0; i < OC_RETRIES; i++) {
+		if(rdmsr(cpu, MSR_OC_MAILBOX, val))
+			return (1);
+		if(!OC_MAILBOX_BUSY(*val))
+			return (0);
+		nanosleep(&ts, NULL);
+	}
+	return (1);
+}
+
+/** readVoltageOffset
+ *
+ * Read the voltage offset of a plane through the overclocking mailbox, in
+ * mV, once it is idle. The answer holds a status code in place of the
+ * command, 0 on success, and the offset as a signed 11 bits value in
+ * 1/1024 V. */
+static int readVoltageOffset(int cpu, int plane, double * mV) {
+	uint64_t val;
+	int64_t offset;
+
+	if(ocWait(cpu, &val))
+		return (1);
+	val = REG_ENCODE(OC_MAILBOX, BUSY, 1) | REG_ENCODE(OC_MAILBOX, CMD, OC_CMD_READ_OFFSET)
+		| REG_ENCODE(OC_MAILBOX, PLANE, plane);
+	if(wrmsr(cpu, MSR_OC_MAILBOX, val) || ocWait(cpu, &val) || OC_MAILBOX_CMD(val) != 0)
+		return (1);
+	offset = OC_MAILBOX_OFFSET(val);
+	if(offset >= 0x400)
+		offset -= 0x800;
+	*mV = offset * 1000.0 / 1024;
+	return (0);
+}
+
+/** hwpRead
+ *
+ * Read IA32_PM_ENABLE, IA32_HWP_CAPABILITIES and IA32_HWP_REQUEST of the
+ * target cpus in one batch. ops must hold 3 accesses per target cpu, in
+ * that order per cpu. */
+static int hwpRead(struct msrOp * ops, int * n) {
+	int j, k = 0;
+
+	forEachCpu(j, &targetCpus) {
+		memset(&ops[k], 0, 3 * sizeof(*ops));
+		ops[k].cpu = ops[k + 1].cpu = ops[k + 2].cpu = j;
+		ops[k].msr = MSR_PM_ENABLE;
+		ops[k + 1].msr = MSR_HWP_CAPABILITIES;
+		ops[k + 2].msr = MSR_HWP_REQUEST;
+		k += 3;
+	}
+	*n = k;
+	return msrBatch(ops, k) != 0;
+}
+
+/** showHwp
+ *
+ * Display the voltage offsets, then the HWP capabilities and request of
+ * every target cpu. */
+static int showHwp(void) {
+	struct msrOp * ops;
+	uint64_t caps, req;
+	double mV;
+	int k, n, plane;
+
+	printf("Voltage offsets:");
+	for(plane = 0; plane < (int)(sizeof(ocPlanes) / sizeof(ocPlanes[0])); plane++) {
+		if(readVoltageOffset(cpuSetNext(&targetCpus, 0), plane, &mV)) {
+			printf(" unavailable");
+			break;
+		}
+		printf(" %s %+.1f mV%s", ocPlanes[plane], mV, plane < 4 ? "," : "");
+	}
+	printf("\n");
+	if((ops = calloc(3 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(hwpRead(ops, &n)) {
+		fprintf(stderr, "Error reading HWP registers, does the cpu support HWP?\n");
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 3) {
+		caps = ops[k + 1].val;
+		req = ops[k + 2].val;
+		printf("CPU %d: HWP %s, performance lowest %" PRIu64 ", efficient %" PRIu64 ", guaranteed %" PRIu64
+			", highest %" PRIu64 ", request min %" PRIu64 ", max %" PRIu64 ", desired %" PRIu64 ", EPP %" PRIu64 " (%s)\n",
+			ops[k].cpu, PM_ENABLE_HWP_ENABLE(ops[k].val) ? "on" : "off",
+			HWP_CAPABILITIES_LOWEST(caps), HWP_CAPABILITIES_EFFICIENT(caps),
+			HWP_CAPABILITIES_GUARANTEED(caps), HWP_CAPABILITIES_HIGHEST(caps),
+			HWP_REQUEST_MIN(req), HWP_REQUEST_MAX(req), HWP_REQUEST_DESIRED(req),
+			HWP_REQUEST_EPP(req), eppName(HWP_REQUEST_EPP(req)));
+	}
+	free(ops);
+	return (0);
+}
+
+/** perfRequestRegs
+ *
+ * An HWP style performance request: the name and MSR of the request, how
+ * to read the enable bit, the capabilities and the request of the target
+ * cpus, three accesses per cpu in that order, and the accessors of the
+ * fields. */
+struct perfRequestRegs {
+	const char * name;
+	off_t msr;
+	int (* read)(struct msrOp * ops, int * n);
+	uint64_t (* enabled)(uint64_t v), (* lowest)(uint64_t v), (* highest)(uint64_t v);
+	uint64_t (* min)(uint64_t v), (* max)(uint64_t v), (* desired)(uint64_t v), (* epp)(uint64_t v);
+	uint64_t (* setMin)(uint64_t v, uint64_t x), (* setMax)(uint64_t v, uint64_t x);
+	uint64_t (* setDesired)(uint64_t v, uint64_t x), (* setEpp)(uint64_t v, uint64_t x);
+};
+
+static const struct perfRequestRegs hwpRegs = {
+	"HWP", MSR_HWP_REQUEST, hwpRead, PM_ENABLE_HWP_ENABLE, HWP_CAPABILITIES_LOWEST, HWP_CAPABILITIES_HIGHEST,
+	HWP_REQUEST_MIN, HWP_REQUEST_MAX, HWP_REQUEST_DESIRED, HWP_REQUEST_EPP,
+	HWP_REQUEST_MIN_set, HWP_REQUEST_MAX_set, HWP_REQUEST_DESIRED_set, HWP_REQUEST_EPP_set
+};
+
+/** applyPerfRequest
+ *
+ * Read-modify-write the HWP or CPPC request of all target cpus, checking
+ * the performance levels against each cpu's capabilities. A desired level
+ * of 0 leaves the choice to the hardware. */
+static int applyPerfRequest(const struct perfRequestRegs * p, const struct hwpRequest * r) {
+	struct msrOp * ops, * w;
+	uint64_t caps, req, val;
+	int k, n, m = 0;
+
+	if((ops = calloc(4 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	w = ops + 3 * ncpu;
+	if(p->read(ops, &n)) {
+		fprintf(stderr, "Error reading %s registers, does the cpu support %s?\n", p->name, p->name);
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 3) {
+		if(!p->enabled(ops[k].val)) {
+			fprintf(stderr, "Error: %s is not enabled on cpu %d\n", p->name, ops[k].cpu);
+			free(ops);
+			return (1);
+		}
+		caps = ops[k + 1].val;
+		req = val = ops[k + 2].val;
+		if(r->min >= 0)
+			val = p->setMin(val, r->min);
+		if(r->max >= 0)
+			val = p->setMax(val, r->max);
+		if(r->desired >= 0)
+			val = p->setDesired(val, r->desired);
+		if(r->epp >= 0)
+			val = p->setEpp(val, r->epp);
+		if(p->min(val) < p->lowest(caps) || p->max(val) > p->highest(caps) || p->min(val) > p->max(val)
+				|| (p->desired(val) != 0 && (p->desired(val) < p->min(val) || p->desired(val) > p->max(val)))) {
+			fprintf(stderr, "Error: cpu %d supports performance levels %" PRIu64 "-%" PRIu64
+				" with min <= desired <= max\n", ops[k].cpu, p->lowest(caps), p->highest(caps));
+			free(ops);
+			return (1);
+		}
+		printf("CPU %d: changing %s request min %" PRIu64 ", max %" PRIu64 ", desired %" PRIu64 ", EPP %" PRIu64
+			" to min %" PRIu64 ", max %" PRIu64 ", desired %" PRIu64 ", EPP %" PRIu64 "\n", ops[k].cpu, p->name,
+			p->min(req), p->max(req), p->desired(req), p->epp(req),
+			p->min(val), p->max(val), p->desired(val), p->epp(val));
+		w[m].cpu = ops[k].cpu;
+		w[m].write = 1;
+		w[m].msr = p->msr;
+		w[m++].val = val;
+	}
+	k = msrBatch(w, m);
+	free(ops);
+	if(k) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/*****************************************************************************
+ * AMD Family 17h and later: legacy P-states and CPPC.
+ */
+
+/** showF17hPstates
+ *
+ * Display the enabled P-state definitions of a cpu. The core frequency is
+ * FID / DfsId * 200 MHz and the Vid an SVI2 code (1.55 V - 6.25 mV * Vid). */
+static int showF17hPstates(int cpu) {
+	struct msrOp ops[8];
+	uint64_t val;
+	int i, min, max;
+
+	if(rdmsr(cpu, MSR_PSTATE_LIMIT, &val))
+		return (1);
+	max = PSTATE_LIMIT_MAX_VAL(val);
+	min = PSTATE_LIMIT_CUR_LIMIT(val);
+	memset(ops, 0, sizeof(ops));
+	for(i = min; i <= max; i++) {
+		ops[i].cpu = cpu;
+		ops[i].msr = MSR_PSTATE_DEF + i;
+	}
+	if(msrBatch(&ops[min], max - min + 1))
+		return (1);
+	printf("P-state\t\tVid\t\tVoltage\t\tMHz\n");
+	for(i = min; i <= max; i++) {
+		val = ops[i].val;
+		if(!F17H_PSTATE_DEF_EN(val) || F17H_PSTATE_DEF_DFS_ID(val) == 0)
+			continue;
+		printf("  %d\t\t0x%" PRIX64 "\t\t%.4fV\t\t%.0f\n", i, F17H_PSTATE_DEF_VID(val),
+			1.55 - 0.00625 * F17H_PSTATE_DEF_VID(val),
+			200.0 * F17H_PSTATE_DEF_FID(val) / F17H_PSTATE_DEF_DFS_ID(val));
+	}
+	return (0);
+}
+
+/** cppcRead
+ *
+ * Read the CPPC enable, capability 1 and request registers of the target
+ * cpus in one batch. ops must hold 3 accesses per target cpu, in that
+ * order per cpu. */
+static int cppcRead(struct msrOp * ops, int * n) {
+	int j, k = 0;
+
+	forEachCpu(j, &targetCpus) {
+		memset(&ops[k], 0, 3 * sizeof(*ops));
+		ops[k].cpu = ops[k + 1].cpu = ops[k + 2].cpu = j;
+		ops[k].msr = MSR_CPPC_ENABLE;
+		ops[k + 1].msr = MSR_CPPC_CAP1;
+		ops[k + 2].msr = MSR_CPPC_REQ;
+		k += 3;
+	}
+	*n = k;
+	return msrBatch(ops, k) != 0;
+}
+
+/** showCppc
+ *
+ * Display the CPPC capabilities and request of every target cpu. */
+static int showCppc(void) {
+	struct msrOp * ops;
+	uint64_t caps, req;
+	int k, n;
+
+	if((ops = calloc(3 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(cppcRead(ops, &n)) {
+		fprintf(stderr, "Error reading CPPC registers, does the cpu support CPPC?\n");
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 3) {
+		caps = ops[k + 1].val;
+		req = ops[k + 2].val;
+		printf("CPU %d: CPPC %s, performance lowest %" PRIu64 ", lowest nonlinear %" PRIu64 ", nominal %" PRIu64
+			", highest %" PRIu64 ", request min %" PRIu64 ", max %" PRIu64 ", desired %" PRIu64 ", EPP %" PRIu64 " (%s)\n",
+			ops[k].cpu, CPPC_ENABLE_EN(ops[k].val) ? "on" : "off",
+			CPPC_CAP1_LOWEST(caps), CPPC_CAP1_LOWEST_NONLINEAR(caps),
+			CPPC_CAP1_NOMINAL(caps), CPPC_CAP1_HIGHEST(caps),
+			CPPC_REQ_MIN(req), CPPC_REQ_MAX(req), CPPC_REQ_DESIRED(req),
+			CPPC_REQ_EPP(req), eppName(CPPC_REQ_EPP(req)));
+	}
+	free(ops);
+	return (0);
+}
+
+	/** The CPPC request, set by applyPerfRequest(). CPPC must have been
+	 * enabled, e.g. by the amd-pstate driver, as the enable bit cannot be
+	 * cleared once set. */
+static const struct perfRequestRegs cppcRegs = {
+	"CPPC", MSR_CPPC_REQ, cppcRead, CPPC_ENABLE_EN, CPPC_CAP1_LOWEST, CPPC_CAP1_HIGHEST,
+	CPPC_REQ_MIN, CPPC_REQ_MAX, CPPC_REQ_DESIRED, CPPC_REQ_EPP,
+	CPPC_REQ_MIN_set, CPPC_REQ_MAX_set, CPPC_REQ_DESIRED_set, CPPC_REQ_EPP_set
+};
+
+/*****************************************************************************
+ * AMD System Management Unit.
+ *
+ * The package power (PPT) and current (TDC, EDC) limits of Family 17h and
+ * later are set with messages to the SMU firmware. Its mailbox registers
+ * are in the SMN (system management network) address space, reached
+ * through an index/data register pair in the PCI configuration space of
+ * the root complex. --smu-file replaces the SMN by a file and the SMU by an
+ * emulation of its mailbox, for testing without the hardware.
+ */
+
+#define SMN_PCI_CONFIG	"/sys/bus/pci/devices/0000:00:00.0/config"
+#define SMN_INDEX	0x60
+#define SMN_DATA	0x64
+	/** Table of the ryzen_smu driver, where Matisse and Vermeer report
+	 * the PPT, TDC and EDC limits as floats at indexes 0, 2 and 8. */
+#define SMU_PM_TABLE	"/sys/kernel/ryzen_smu_drv/pm_table"
+#define SMU_NARGS	6
+	/** Polls of the response register, 100 us apart. */
+#define SMU_RETRIES	10000
+	/** SMN offset of the limits kept by the emulated SMU. */
+#define SMU_EMU_STATE	0x100
+
+enum { SMU_OK = 0x1, SMU_FAILED = 0xFF, SMU_UNKNOWN_CMD = 0xFE, SMU_REJECTED_PREREQ = 0xFD, SMU_BUSY = 0xFC };
+
+enum { SMU_PPT, SMU_TDC, SMU_EDC, SMU_NLIMITS };
+
+static const char * smuLimitNames[SMU_NLIMITS] = {"PPT", "TDC", "EDC"};
+static const char * smuLimitUnits[SMU_NLIMITS] = {"W", "A", "A"};
+
+/** smuFamily
+ *
+ * Mailbox registers and message IDs of the processors of a family and
+ * model range. Limits are passed in mW and mA. Mobile parts have no PPT
+ * and take the sustained (STAPM) power and the VRM currents instead. A
+ * get message of 0 means there is none; pmTable tells if the limits can
+ * be read from the ryzen_smu driver's table instead. */
+static const struct smuFamily {
+	const char * name;
+	int family, firstModel, lastModel;
+	uint32_t msg, rsp, args;
+	uint32_t set[SMU_NLIMITS], get[SMU_NLIMITS];
+	int pmTable;
+} smuFamilies[] = {
+	{"Raven Ridge/Picasso", 0x17, 0x11, 0x18, 0x3B10528, 0x3B10564, 0x3B10998, {0x1A, 0x20, 0x22}, {0, 0, 0}, 0},
+	{"Matisse", 0x17, 0x71, 0x71, 0x3B10524, 0x3B10570, 0x3B10A40, {0x53, 0x54, 0x55}, {0, 0, 0}, 1},
+	{"Renoir/Lucienne", 0x17, 0x60, 0x68, 0x3B10528, 0x3B10564, 0x3B10998, {0x1A, 0x20, 0x22}, {0, 0, 0}, 0},
+	{"Vermeer", 0x19, 0x21, 0x21, 0x3B10524, 0x3B10570, 0x3B10A40, {0x53, 0x54, 0x55}, {0, 0, 0}, 1},
+	{"Cezanne/Barcelo", 0x19, 0x50, 0x50, 0x3B10528, 0x3B10564, 0x3B10998, {0x1A, 0x20, 0x22}, {0, 0, 0}, 0},
+	{"emulated", 0, 0, 0, 0x3B10524, 0x3B10570, 0x3B10A40, {0x53, 0x54, 0x55}, {0x60, 0x61, 0x62}, 0}
+};
+
+#define SMU_NFAMILIES	(int)(sizeof(smuFamilies) / sizeof(smuFamilies[0]))
+
+static int smnFd = -1;
+	/** The file standing in for the SMN, if any. */
+static const char * smuFile = NULL;
+
+/** smuFind
+ *
+ * Return the SMU family of the processor, the emulated one with
+ * --smu-file, or NULL if it is not known. */
+static const struct smuFamily * smuFind(void) {
+	int i;
+
+	if(smuFile != NULL)
+		return &smuFamilies[SMU_NFAMILIES - 1];
+	for(i = 0; i < SMU_NFAMILIES - 1; i++)
+		if(cpuVendor == VENDOR_AMD && cpuFamily == smuFamilies[i].family
+				&& cpuModel >= smuFamilies[i].firstModel && cpuModel <= smuFamilies[i].lastModel)
+			return &smuFamilies[i];
+	return NULL;
+}
+
+static void smuEmulate(const struct smuFamily * f);
+
+/** smnRead
+ *
+ * Read a 32 bits SMN register. The index/data pair is shared with the
+ * kernel, which does not expect it to change under it, so accesses should
+ * be kept to the few the mailbox needs. */
+static int smnRead(uint32_t addr, uint32_t * val) {
+	ssize_t r;
+
+	if(smuFile != NULL) {
+			/* Unwritten parts of the file read as 0. */
+		if((r = pread(smnFd, val, sizeof(*val), addr)) < 0)
+			return (1);
+		if(r != sizeof(*val))
+			*val = 0;
+		return (0);
+	}
+	if(pwrite(smnFd, &addr, sizeof(addr), SMN_INDEX) != sizeof(addr)
+			|| pread(smnFd, val, sizeof(*val), SMN_DATA) != sizeof(*val))
+		return (1);
+	return (0);
+}
+
+static int smnWrite(const struct smuFamily * f, uint32_t addr, uint32_t val) {
+	if(smuFile != NULL) {
+		if(pwrite(smnFd, &val, sizeof(val), addr) != sizeof(val))
+			return (1);
+		if(addr == f->msg)
+			smuEmulate(f);
+		return (0);
+	}
+	if(pwrite(smnFd, &addr, sizeof(addr), SMN_INDEX) != sizeof(addr)
+			|| pwrite(smnFd, &val, sizeof(val), SMN_DATA) != sizeof(val))
+		return (1);
+	return (0);
+}
+
+/** smuEmulate
+ *
+ * Run the message just written to the emulated mailbox: keep the limits
+ * set, return them to get messages, and answer in the response register. */
+static void smuEmulate(const struct smuFamily * f) {
+	uint32_t msg, val, rsp = SMU_UNKNOWN_CMD;
+	int i;
+
+	if(smnRead(f->msg, &msg))
+		return;
+	for(i = 0; i < SMU_NLIMITS; i++) {
+		if(msg == f->set[i] && smnRead(f->args, &val) == 0) {
+			rsp = pwrite(smnFd, &val, sizeof(val), SMU_EMU_STATE + 4 * i) == sizeof(val) ? SMU_OK : SMU_FAILED;
+			break;
+		}
+		if(msg == f->get[i] && smnRead(SMU_EMU_STATE + 4 * i, &val) == 0) {
+			rsp = pwrite(smnFd, &val, sizeof(val), f->args) == sizeof(val) ? SMU_OK : SMU_FAILED;
+			break;
+		}
+	}
+	if(pwrite(smnFd, &rsp, sizeof(rsp), f->rsp) != sizeof(rsp))
+		perror("Writing emulated SMU");
+}
+
+static int smnOpen(const struct smuFamily * f) {
+	uint32_t rsp = SMU_OK;
+	struct stat st;
+
+	if(smnFd >= 0)
+		return (0);
+	if((smnFd = open(smuFile != NULL ? smuFile : SMN_PCI_CONFIG, O_RDWR | O_CLOEXEC | (smuFile != NULL ? O_CREAT : 0), 0644)) < 0) {
+		perror("Opening SMN access");
+		return (1);
+	}
+		/* A new emulated SMU is idle, ready for a message. */
+	if(smuFile != NULL && fstat(smnFd, &st) == 0 && st.st_size == 0
+			&& pwrite(smnFd, &rsp, sizeof(rsp), f->rsp) != sizeof(rsp)) {
+		perror("Writing emulated SMU");
+		return (1);
+	}
+	return (0);
+}
+
+/* Wait for the response register to leave 0, return it or 0 on timeout. */
+static uint32_t smuWait(const struct smuFamily * f) {
+	struct timespec ts = {0, 100000};
+	uint32_t rsp;
+	int i;
+
+	for(i = 0; i < SMU_RETRIES; i++) {
+		if(smnRead(f->rsp, &rsp))
+			return 0;
+		if(rsp != 0)
+			return rsp;
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/** smuCommand
+ *
+ * Send a message with its arguments to the SMU and wait for the answer,
+ * after which args holds the values returned. Returns 0 on success. */
+static int smuCommand(const struct smuFamily * f, uint32_t msg, uint32_t * args) {
+	uint32_t rsp;
+	int i;
+
+	if(smnOpen(f))
+		return (1);
+	if(smuWait(f) == 0) {
+		fprintf(stderr, "Error: the SMU is busy\n");
+		return (1);
+	}
+	if(smnWrite(f, f->rsp, 0))
+		return (1);
+	for(i = 0; i < SMU_NARGS; i++)
+		if(smnWrite(f, f->args + 4 * i, args[i]))
+			return (1);
+	if(smnWrite(f, f->msg, msg))
+		return (1);
+	switch(rsp = smuWait(f)) {
+	case SMU_OK:
+		break;
+	case 0:
+		fprintf(stderr, "Error: SMU message 0x%X timed out\n", msg);
+		return (1);
+	case SMU_UNKNOWN_CMD:
+		fprintf(stderr, "Error: SMU message 0x%X is not supported by this firmware\n", msg);
+		return (1);
+	case SMU_REJECTED_PREREQ:
+	case SMU_BUSY:
+		fprintf(stderr, "Error: SMU message 0x%X was rejected\n", msg);
+		return (1);
+	default:
+		fprintf(stderr, "Error: SMU message 0x%X failed (0x%X)\n", msg, rsp);
+		return (1);
+	}
+	for(i = 0; i < SMU_NARGS; i++)
+		if(smnRead(f->args + 4 * i, &args[i]))
+			return (1);
+	return (0);
+}
+
+/** smuLimitParse
+ *
+ * Parse ppt=<W>,tdc=<A>,edc=<A> into limits, negative leaving a limit
+ * unchanged. */
+static int smuLimitParse(double * limits, const char * spec) {
+	char key[16];
+	const char * p = spec;
+	double v;
+	int used, i;
+
+	for(i = 0; i < SMU_NLIMITS; i++)
+		limits[i] = -1;
+	while(*p != '\0') {
+		if(sscanf(p, "%15[a-z]=%lf%n", key, &v, &used) != 2 || v <= 0)
+			return (1);
+		p += used;
+		if(*p == ',')
+			p++;
+		for(i = 0; i < SMU_NLIMITS; i++)
+			if(strcasecmp(key, smuLimitNames[i]) == 0)
+				break;
+		if(i == SMU_NLIMITS)
+			return (1);
+		limits[i] = v;
+	}
+	return (0);
+}
+
+/* Read the limits from the ryzen_smu driver's table, NAN if unavailable. */
+static void smuReadPmTable(double * limits) {
+	static const int index[SMU_NLIMITS] = {0, 2, 8};
+	float table[9];
+	FILE * stream;
+	int i;
+
+	if((stream = fopen(SMU_PM_TABLE, "r")) == NULL)
+		return;
+	if(fread(table, sizeof(table), 1, stream) == 1)
+		for(i = 0; i < SMU_NLIMITS; i++)
+			limits[i] = table[index[i]];
+	fclose(stream);
+}
+
+/** showSmu
+ *
+ * Display the PPT, TDC and EDC limits, where they can be read. */
+static int showSmu(void) {
+	const struct smuFamily * f;
+	uint32_t args[SMU_NARGS];
+	double limits[SMU_NLIMITS] = {NAN, NAN, NAN};
+	int i;
+
+	if((f = smuFind()) == NULL) {
+		fprintf(stderr, "Error: no SMU message table for family %Xh model %Xh\n", cpuFamily, cpuModel);
+		return (1);
+	}
+	if(f->pmTable)
+		smuReadPmTable(limits);
+	for(i = 0; i < SMU_NLIMITS; i++) {
+		if(f->get[i] == 0)
+			continue;
+		memset(args, 0, sizeof(args));
+		if(smuCommand(f, f->get[i], args))
+			return (1);
+		limits[i] = args[0] / 1000.0;
+	}
+	printf("SMU (%s):", f->name);
+	for(i = 0; i < SMU_NLIMITS; i++) {
+		if(isnan(limits[i]))
+			printf(" %s unavailable%s", smuLimitNames[i], i < SMU_NLIMITS - 1 ? "," : "\n");
+		else
+			printf(" %s %.1f %s%s", smuLimitNames[i], limits[i], smuLimitUnits[i], i < SMU_NLIMITS - 1 ? "," : "\n");
+	}
+	return (0);
+}
+
+/** applySmu
+ *
+ * Send the limits given (not negative) to the SMU, which applies them to
+ * the whole package. */
+static int applySmu(const double * limits) {
+	const struct smuFamily * f;
+	uint32_t args[SMU_NARGS];
+	int i;
+
+	if((f = smuFind()) == NULL) {
+		fprintf(stderr, "Error: no SMU message table for family %Xh model %Xh\n", cpuFamily, cpuModel);
+		return (1);
+	}
+	for(i = 0; i < SMU_NLIMITS; i++) {
+		if(limits[i] < 0)
+			continue;
+		memset(args, 0, sizeof(args));
+		args[0] = lround(limits[i] * 1000);
+		if(smuCommand(f, f->set[i], args))
+			return (1);
+		printf("SMU (%s): %s limit set to %.1f %s\n", f->name, smuLimitNames[i], limits[i], smuLimitUnits[i]);
+	}
+	return (0);
+}
+
+/*****************************************************************************
+ * Intel uncore frequency.
+ */
+
+/** packageCpus
+ *
+ * Fill first, which must hold ncpu entries, with the first target cpu of
+ * each package, -1 for packages without target cpus. Returns the number of
+ * packages. */
+static int packageCpus(int * first) {
+	int j, pkg, core, n = 0;
+
+	for(j = 0; j < ncpu; j++)
+		first[j] = -1;
+	forEachCpu(j, &targetCpus) {
+		cpuTopology(j, &pkg, &core);
+		if(pkg >= ncpu)
+			continue;
+		if(first[pkg] < 0)
+			first[pkg] = j;
+		if(pkg + 1 > n)
+			n = pkg + 1;
+	}
+	return n;
+}
+
+/** packageRead
+ *
+ * Read nmsrs package registers from the first target cpu of each package in
+ * one batch. ops must hold nmsrs * ncpu accesses, nmsrs per package in the
+ * order of msrs; packages without target cpus are left out. */
+static int packageRead(struct msrOp * ops, int * n, const off_t * msrs, int nmsrs) {
+	int * first, p, npkg, i, k = 0;
+
+	if((first = calloc(ncpu, sizeof(*first))) == NULL) {
+		perror("Allocating packages");
+		return (1);
+	}
+	npkg = packageCpus(first);
+	for(p = 0; p < npkg; p++) {
+		if(first[p] < 0)
+			continue;
+		for(i = 0; i < nmsrs; i++, k++) {
+			memset(&ops[k], 0, sizeof(*ops));
+			ops[k].cpu = first[p];
+			ops[k].msr = msrs[i];
+		}
+	}
+	free(first);
+	*n = k;
+	return msrBatch(ops, k) != 0;
+}
+
+/** uncoreRead
+ *
+ * Read the uncore ratio limits and current ratio of the packages of the
+ * target cpus, two accesses per package in that order. */
+static int uncoreRead(struct msrOp * ops, int * n) {
+	static const off_t msrs[] = {MSR_UNCORE_RATIO_LIMIT, MSR_UNCORE_PERF_STATUS};
+
+	return packageRead(ops, n, msrs, 2);
+}
+
+/** showUncore
+ *
+ * Display the uncore ratio limits and current ratio of each package. */
+static int showUncore(void) {
+	struct msrOp * ops;
+	int k, n, pkg, core;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(uncoreRead(ops, &n)) {
+		fprintf(stderr, "Error reading uncore registers, does the cpu support them?\n");
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 2) {
+		cpuTopology(ops[k].cpu, &pkg, &core);
+		printf("Package %d: uncore ratio limits min %" PRIu64 " (%" PRIu64 " MHz), max %" PRIu64 " (%" PRIu64 " MHz), current %"
+			PRIu64 " (%" PRIu64 " MHz)\n", pkg,
+			UNCORE_RATIO_LIMIT_MIN_RATIO(ops[k].val), 100 * UNCORE_RATIO_LIMIT_MIN_RATIO(ops[k].val),
+			UNCORE_RATIO_LIMIT_MAX_RATIO(ops[k].val), 100 * UNCORE_RATIO_LIMIT_MAX_RATIO(ops[k].val),
+			UNCORE_PERF_STATUS_CURRENT_RATIO(ops[k + 1].val), 100 * UNCORE_PERF_STATUS_CURRENT_RATIO(ops[k + 1].val));
+	}
+	free(ops);
+	return (0);
+}
+
+/** applyUncore
+ *
+ * Read-modify-write the uncore ratio limits of the packages of the target
+ * cpus, keeping min <= max. Only min and max of the request are used, and
+ * the changes are displayed if report is set. */
+static int applyUncore(const struct hwpRequest * r, int report) {
+	struct msrOp * ops;
+	uint64_t val;
+	int k, n, pkg, core;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(uncoreRead(ops, &n)) {
+		fprintf(stderr, "Error reading uncore registers, does the cpu support them?\n");
+		free(ops);
+		return (1);
+	}
+		/* Reuse the pairs for the writes, one per package. */
+	for(k = 0; k < n; k += 2) {
+		val = ops[k].val;
+		if(r->min >= 0)
+			val = UNCORE_RATIO_LIMIT_MIN_RATIO_set(val, r->min);
+		if(r->max >= 0)
+			val = UNCORE_RATIO_LIMIT_MAX_RATIO_set(val, r->max);
+		if(regCheck(REG_UNCORE_RATIO_LIMIT, val) || UNCORE_RATIO_LIMIT_MIN_RATIO(val) > UNCORE_RATIO_LIMIT_MAX_RATIO(val)) {
+			fprintf(stderr, "Error: uncore ratios must be 0-127 with min <= max\n");
+			free(ops);
+			return (1);
+		}
+		if(report) {
+			cpuTopology(ops[k].cpu, &pkg, &core);
+			printf("Package %d: changing uncore ratio limits min %" PRIu64 ", max %" PRIu64 " to min %" PRIu64 ", max %" PRIu64 "\n",
+				pkg, UNCORE_RATIO_LIMIT_MIN_RATIO(ops[k].val), UNCORE_RATIO_LIMIT_MAX_RATIO(ops[k].val),
+				UNCORE_RATIO_LIMIT_MIN_RATIO(val), UNCORE_RATIO_LIMIT_MAX_RATIO(val));
+		}
+		ops[k / 2] = ops[k];
+		ops[k / 2].write = 1;
+		ops[k / 2].val = val;
+	}
+	k = msrBatch(ops, n / 2);
+	free(ops);
+	if(k) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/*****************************************************************************
+ * Intel package power limits.
+ */
+
+	/** Measured power above a limit by less than this is not reported
+	 * as exceeding it, RAPL allows for short excursions. */
+#define POWER_LIMIT_SLACK	1.05
+
+/** powerLimit
+ *
+ * The two package power limits in W, with their time windows in s. When
+ * setting, a negative value leaves a field unchanged; setting a power also
+ * enables and clamps its limit. */
+struct powerLimit {
+	double pl1, time1, pl2, time2;
+	int en1, en2, locked;
+};
+
+/** powerLimitParse
+ *
+ * Parse pl1=<W>,time1=<s>,pl2=<W>,time2=<s>. */
+static int powerLimitParse(struct powerLimit * l, const char * spec) {
+	char key[16];
+	const char * p = spec;
+	double v, * field;
+	int used;
+
+	memset(l, 0, sizeof(*l));
+	l->pl1 = l->time1 = l->pl2 = l->time2 = -1;
+	while(*p != '\0') {
+		if(sscanf(p, "%15[a-z0-9]=%lf%n", key, &v, &used) != 2 || v <= 0)
+			return (1);
+		p += used;
+		if(*p == ',')
+			p++;
+		if(strcmp(key, "pl1") == 0)
+			field = &l->pl1;
+		else if(strcmp(key, "time1") == 0)
+			field = &l->time1;
+		else if(strcmp(key, "pl2") == 0)
+			field = &l->pl2;
+		else if(strcmp(key, "time2") == 0)
+			field = &l->time2;
+		else
+			return (1);
+		*field = v;
+	}
+	return (0);
+}
+
+	/** A time window is 2^Y * (1 + Z / 4) time units. */
+static double windowSeconds(unsigned y, unsigned z, double unit) {
+	return ldexp(1 + z / 4.0, y) * unit;
+}
+
+/* Find the Y and Z of the time window closest to seconds. */
+static void windowEncode(double seconds, double unit, unsigned * y, unsigned * z) {
+	double best = INFINITY;
+	unsigned yy, zz;
+
+	*y = *z = 0;
+	for(yy = 0; yy < 32; yy++)
+		for(zz = 0; zz < 4; zz++)
+			if(fabs(windowSeconds(yy, zz, unit) - seconds) < best) {
+				best = fabs(windowSeconds(yy, zz, unit) - seconds);
+				*y = yy;
+				*z = zz;
+			}
+}
+
+/* Decode MSR_PKG_POWER_LIMIT with the units of MSR_RAPL_POWER_UNIT. */
+static void powerLimitDecode(uint64_t val, uint64_t units, struct powerLimit * l) {
+	double pu = 1.0 / (1 << RAPL_POWER_UNIT_POWER(units)), tu = 1.0 / (1 << RAPL_POWER_UNIT_TIME(units));
+
+	l->pl1 = PKG_POWER_LIMIT_PL1(val) * pu;
+	l->time1 = windowSeconds(PKG_POWER_LIMIT_PL1_TIME_Y(val), PKG_POWER_LIMIT_PL1_TIME_Z(val), tu);
+	l->en1 = PKG_POWER_LIMIT_PL1_EN(val);
+	l->pl2 = PKG_POWER_LIMIT_PL2(val) * pu;
+	l->time2 = windowSeconds(PKG_POWER_LIMIT_PL2_TIME_Y(val), PKG_POWER_LIMIT_PL2_TIME_Z(val), tu);
+	l->en2 = PKG_POWER_LIMIT_PL2_EN(val);
+	l->locked = PKG_POWER_LIMIT_LOCK(val);
+}
+
+/** powerLimitRead
+ *
+ * Read MSR_RAPL_POWER_UNIT and MSR_PKG_POWER_LIMIT of the packages of the
+ * target cpus, two accesses per package in that order. */
+static int powerLimitRead(struct msrOp * ops, int * n) {
+	static const off_t msrs[] = {MSR_RAPL_POWER_UNIT, MSR_PKG_POWER_LIMIT};
+
+	if(packageRead(ops, n, msrs, 2)) {
+		fprintf(stderr, "Error reading power limit registers, does the cpu support RAPL?\n");
+		return (1);
+	}
+	return (0);
+}
+
+/** showPowerLimits
+ *
+ * Display PL1 and PL2 of each package. */
+static int showPowerLimits(void) {
+	struct msrOp * ops;
+	struct powerLimit l;
+	int k, n, pkg, core;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(powerLimitRead(ops, &n)) {
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 2) {
+		cpuTopology(ops[k].cpu, &pkg, &core);
+		powerLimitDecode(ops[k + 1].val, ops[k].val, &l);
+		printf("Package %d: PL1 %.3f W over %.3f s (%s), PL2 %.3f W over %.3f s (%s)%s\n", pkg,
+			l.pl1, l.time1, l.en1 ? "on" : "off", l.pl2, l.time2, l.en2 ? "on" : "off",
+			l.locked ? ", locked" : "");
+	}
+	free(ops);
+	return (0);
+}
+
+/** applyPowerLimits
+ *
+ * Read-modify-write MSR_PKG_POWER_LIMIT of the packages of the target cpus,
+ * in the units of each package. Fails if a package has its limits locked. */
+static int applyPowerLimits(const struct powerLimit * l) {
+	struct msrOp * ops;
+	struct powerLimit old, set;
+	uint64_t val;
+	double pu, tu;
+	unsigned y, z;
+	int k, n, pkg, core;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	if(powerLimitRead(ops, &n)) {
+		free(ops);
+		return (1);
+	}
+	for(k = 0; k < n; k += 2) {
+		cpuTopology(ops[k].cpu, &pkg, &core);
+		pu = 1.0 / (1 << RAPL_POWER_UNIT_POWER(ops[k].val));
+		tu = 1.0 / (1 << RAPL_POWER_UNIT_TIME(ops[k].val));
+		val = ops[k + 1].val;
+		if(PKG_POWER_LIMIT_LOCK(val)) {
+			fprintf(stderr, "Error: the power limits of package %d are locked until reset\n", pkg);
+			free(ops);
+			return (1);
+		}
+		if(l->pl1 > 0 && l->pl1 / pu <= 0x7FFF)
+			val = PKG_POWER_LIMIT_PL1_set(PKG_POWER_LIMIT_PL1_EN_set(PKG_POWER_LIMIT_PL1_CLAMP_set(val, 1), 1), lround(l->pl1 / pu));
+		if(l->pl2 > 0 && l->pl2 / pu <= 0x7FFF)
+			val = PKG_POWER_LIMIT_PL2_set(PKG_POWER_LIMIT_PL2_EN_set(PKG_POWER_LIMIT_PL2_CLAMP_set(val, 1), 1), lround(l->pl2 / pu));
+		if(l->time1 > 0) {
+			windowEncode(l->time1, tu, &y, &z);
+			val = PKG_POWER_LIMIT_PL1_TIME_Z_set(PKG_POWER_LIMIT_PL1_TIME_Y_set(val, y), z);
+		}
+		if(l->time2 > 0) {
+			windowEncode(l->time2, tu, &y, &z);
+			val = PKG_POWER_LIMIT_PL2_TIME_Z_set(PKG_POWER_LIMIT_PL2_TIME_Y_set(val, y), z);
+		}
+		powerLimitDecode(ops[k + 1].val, ops[k].val, &old);
+		powerLimitDecode(val, ops[k].val, &set);
+		if((l->pl1 > 0 && fabs(set.pl1 - l->pl1) > pu) || (l->pl2 > 0 && fabs(set.pl2 - l->pl2) > pu)) {
+			fprintf(stderr, "Error: package %d power limits must be below %.0f W\n", pkg, 0x7FFF * pu);
+			free(ops);
+			return (1);
+		}
+		if(set.en1 && set.en2 && set.pl1 > set.pl2)
+			fprintf(stderr, "Warning: package %d PL1 is above PL2\n", pkg);
+		printf("Package %d: changing PL1 %.3f W over %.3f s, PL2 %.3f W over %.3f s to PL1 %.3f W over %.3f s, PL2 %.3f W over %.3f s\n",
+			pkg, old.pl1, old.time1, old.pl2, old.time2, set.pl1, set.time1, set.pl2, set.time2);
+		ops[k / 2] = ops[k + 1];
+		ops[k / 2].write = 1;
+		ops[k / 2].val = val;
+	}
+	k = msrBatch(ops, n / 2);
+	free(ops);
+	if(k) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+	/** Iterations of the spinning load between two counter updates. */
+#define SPIN_ITERATIONS		4096
+
+/** spinLoad
+ *
+ * A thread spinning on a target cpu, counting the units of work done. */
+struct spinLoad {
+	unsigned long long count;
+	int cpu, stop;
+	pthread_t thread;
+};
+
+static void * spinLoadRun(void * arg) {
+	struct spinLoad * c = arg;
+	volatile double x = 1;
+	cpu_set_t mask;
+	int k;
+
+	CPU_ZERO(&mask);
+	CPU_SET(c->cpu, &mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	while(!__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+		for(k = 0; k < SPIN_ITERATIONS; k++)
+			x = x * 1.000001 + 1e-9;
+		__atomic_add_fetch(&c->count, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void spinStop(struct spinLoad * spin, int n) {
+	int k;
+
+	for(k = 0; k < n; k++)
+		__atomic_store_n(&spin[k].stop, 1, __ATOMIC_RELAXED);
+	for(k = 0; k < n; k++)
+		pthread_join(spin[k].thread, NULL);
+	free(spin);
+}
+
+/** spinStart
+ *
+ * Start a spinning thread on every target cpu, returning how many in n. */
+static struct spinLoad * spinStart(int * n) {
+	struct spinLoad * spin;
+	int j;
+
+	if((spin = calloc(cpuSetCount(&targetCpus), sizeof(*spin))) == NULL) {
+		perror("Allocating load");
+		exit(1);
+	}
+	*n = 0;
+	forEachCpu(j, &targetCpus) {
+		spin[*n].cpu = j;
+		if(pthread_create(&spin[*n].thread, NULL, spinLoadRun, &spin[*n])) {
+			fprintf(stderr, "Error starting the load\n");
+			spinStop(spin, *n);
+			return NULL;
+		}
+		(*n)++;
+	}
+	return spin;
+}
+
+/** verifyPowerLimits
+ *
+ * Load all target cpus for the longest enabled PL1 time window, or
+ * intervalMs if longer, sampling the power of each package with RAPL every
+ * intervalMs. The average over the whole run is held against PL1 and the
+ * highest sample against PL2. A limit is only meaningful under load, an
+ * idle package respects any. Returns 1 if a limit is exceeded. */
+static int verifyPowerLimits(int intervalMs) {
+	struct energyMeter m;
+	struct msrOp * ops;
+	struct powerLimit l;
+	struct spinLoad * spin;
+	struct timespec ts;
+	double seconds, total = 0, runSeconds, watts, * joules, * peak;
+	int k, n, nSpin, pkg, core, ret = 0;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL) {
+		perror("Allocating MSR accesses");
+		return (1);
+	}
+	energyInit(&m);
+	if(powerLimitRead(ops, &n) || m.source != ENERGY_RAPL) {
+		if(m.source != ENERGY_RAPL)
+			fprintf(stderr, "Error: no RAPL energy counters\n");
+		energyFree(&m);
+		free(ops);
+		return (1);
+	}
+	if((joules = calloc(2 * m.npkg, sizeof(*joules))) == NULL) {
+		perror("Allocating power samples");
+		exit(1);
+	}
+	peak = joules + m.npkg;
+	runSeconds = intervalMs / 1000.0;
+	for(k = 0; k < n; k += 2) {
+		powerLimitDecode(ops[k + 1].val, ops[k].val, &l);
+		if(l.en1 && l.time1 > runSeconds)
+			runSeconds = l.time1;
+	}
+	if((spin = spinStart(&nSpin)) == NULL) {
+		free(joules);
+		energyFree(&m);
+		free(ops);
+		return (1);
+	}
+	printf("Loading %d cpus for %.1f s\n", nSpin, runSeconds);
+	ts.tv_sec = intervalMs / 1000;
+	ts.tv_nsec = (intervalMs % 1000) * 1000000L;
+	energySample(&m);
+	while(total < runSeconds) {
+		nanosleep(&ts, NULL);
+		if((seconds = energySample(&m)) <= 0) {
+			fprintf(stderr, "Error reading energy counters\n");
+			ret = 1;
+			break;
+		}
+		total += seconds;
+		for(pkg = 0; pkg < m.npkg; pkg++) {
+			joules[pkg] += m.pkgJ[pkg];
+			if(m.pkgJ[pkg] / seconds > peak[pkg])
+				peak[pkg] = m.pkgJ[pkg] / seconds;
+		}
+	}
+	spinStop(spin, nSpin);
+	for(k = 0; ret == 0 && k < n; k += 2) {
+		cpuTopology(ops[k].cpu, &pkg, &core);
+		powerLimitDecode(ops[k + 1].val, ops[k].val, &l);
+		watts = pkg < m.npkg ? joules[pkg] / total : 0;
+		printf("Package %d: %.2f W over %.1f s, peak %.2f W over %d ms", pkg, watts, total,
+			pkg < m.npkg ? peak[pkg] : 0, intervalMs);
+		if(!l.en1)
+			printf(", PL1 off");
+		else if(watts <= l.pl1 * POWER_LIMIT_SLACK)
+			printf(", PL1 %.2f W respected", l.pl1);
+		else {
+			printf(", PL1 %.2f W EXCEEDED", l.pl1);
+			ret = 1;
+		}
+		if(!l.en2)
+			printf(", PL2 off\n");
+		else if(pkg >= m.npkg || peak[pkg] <= l.pl2 * POWER_LIMIT_SLACK)
+			printf(", PL2 %.2f W respected\n", l.pl2);
+		else {
+			printf(", PL2 %.2f W EXCEEDED\n", l.pl2);
+			ret = 1;
+		}
+	}
+	free(joules);
+	energyFree(&m);
+	free(ops);
+	return (ret);
+}
+
+	/** Minimum time spent measuring each command of the benchmark. */
+#define BENCH_MIN_NS	200000000.0
+
+enum { BENCH_READ, BENCH_CURRENT, BENCH_APPLY, BENCH_SAMPLE, BENCH_NCMDS };
+
+/* Run one command the way main() does, without output. */
+static int benchCommand(int cmd, struct msrOp * ops, uint64_t * buf) {
+	static const uint64_t vidToSet[8] = {0x28, 0x30, 0x38, 0, 0, 0, 0, 0};
+	static const float divToSet[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	struct pstateTable t;
+
+	switch(cmd) {
+	case BENCH_READ:
+		return loadPstateTable(0, &t);
+	case BENCH_CURRENT:
+		return readCurrent(buf);
+	case BENCH_APPLY:
+		if(loadPstateTable(0, &t))
+			return (1);
+		return applyPstates(vidToSet, divToSet, t.min, t.max);
+	default:
+		return sampleCpus(ops, buf, buf + ncpu, buf + 2 * ncpu);
+	}
+}
+
+/** benchScale
+ *
+ * Measure -r, -c, -p and sampling throughput (commands per second) of each
+ * backend on simulated topologies of 1 to maxCpus cpus, doubling each time,
+ * with the packages, SMT and latency of the --sim topology. */
+static int benchScale(int maxCpus, int packages, int smt, long latencyNs) {
+	static const char * cmdNames[BENCH_NCMDS] = {"-r/s", "-c/s", "-p/s", "sample/s"};
+	struct msrOp * ops;
+	uint64_t * buf;
+	double start, elapsed;
+	long reps;
+	int cpus, b, c, saved = msrBackend;
+
+	if((ops = calloc(3 * maxCpus, sizeof(*ops))) == NULL
+			|| (buf = calloc(3 * maxCpus, sizeof(*buf))) == NULL) {
+		perror("Allocating benchmark");
+		exit(1);
+	}
+	quiet = 1;
+	printf("Simulated topology: %d packages, %d threads per core, %.1f us per cross-cpu access\n",
+		packages, smt, latencyNs / 1000.0);
+	printf("cpus\tbackend\t");
+	for(c = 0; c < BENCH_NCMDS; c++)
+		printf("\t%10s", cmdNames[c]);
+	printf("\n");
+	for(cpus = smt; ; cpus *= 2) {
+		if(cpus > maxCpus)
+			cpus = maxCpus;
+		for(b = 0; b < BACKEND_NCOUNT; b++) {
+			msrBackend = b;
+			printf("%d\t%-8s", cpus, backendNames[b]);
+			for(c = 0; c < BENCH_NCMDS; c++) {
+				simSetup(cpus, packages, smt, latencyNs);
+				cpuSetFill(&targetCpus, cpus);
+				start = nowNs();
+				reps = 0;
+				do {
+					if(benchCommand(c, ops, buf)) {
+						fprintf(stderr, "Benchmark command failed\n");
+						exit(1);
+					}
+					reps++;
+				} while((elapsed = nowNs() - start) < BENCH_MIN_NS);
+				printf("\t%10.1f", reps * 1e9 / elapsed);
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+		if(cpus == maxCpus)
+			break;
+	}
+	msrBackend = saved;
+	quiet = 0;
+	free(ops);
+	free(buf);
+	return (0);
+}
+
+	/** Time spent at each uncore ratio, and size of the buffer copied,
+	 * well above the last level cache. */
+#define BENCH_UNCORE_NS		1000000000.0
+#define BENCH_UNCORE_BYTES	(64 << 20)
+
+/** benchUncore
+ *
+ * Pin the uncore of the packages of the target cpus to each ratio of a
+ * comma separated list in turn, and measure the throughput of a memory copy
+ * from the first target cpu and the package power (measured or estimated)
+ * at that ratio. The limits each package had are put back afterwards, and
+ * the affinity of the thread too. */
+static int benchUncore(const char * list) {
+	struct energyMeter m;
+	struct hwpRequest r;
+	struct msrOp * ops;
+	char * src, * end;
+	const char * p = list;
+	double start, elapsed, seconds, bytes, watts;
+	long ratio;
+	int k, n, ret = 0;
+	cpu_set_t affinity, savedAffinity;
+	volatile char sink;
+
+	if((ops = calloc(2 * ncpu, sizeof(*ops))) == NULL || (src = malloc(BENCH_UNCORE_BYTES)) == NULL) {
+		perror("Allocating benchmark");
+		exit(1);
+	}
+	if(uncoreRead(ops, &n) || n == 0) {
+		fprintf(stderr, "Error reading uncore registers, does the cpu support them?\n");
+		free(ops);
+		free(src);
+		return (1);
+	}
+		/* Keep the ratio limit of each package, as the writes to put back. */
+	for(k = 0; k < n; k += 2) {
+		ops[k / 2] = ops[k];
+		ops[k / 2].write = 1;
+	}
+	n /= 2;
+		/* Copy from a cpu of the packages being pinned. Best effort, the
+		 * simulated cpus may not exist. */
+	sched_getaffinity(0, sizeof(savedAffinity), &savedAffinity);
+	CPU_ZERO(&affinity);
+	CPU_SET(cpuSetNext(&targetCpus, 0), &affinity);
+	sched_setaffinity(0, sizeof(affinity), &affinity);
+	memset(src, 1, BENCH_UNCORE_BYTES);
+	energyInit(&m);
+	printf("Uncore ratio\tMHz\t\tGB/s\t\tPackage W\tnJ/byte\n");
+	do {
+		ratio = strtol(p, &end, 0);
+		if(end == p || ratio <= 0 || ratio > 0x7F) {
+			fprintf(stderr, "Error parsing uncore ratio list '%s', it should be like 12,16,20\n", list);
+			ret = 1;
+			break;
+		}
+		p = end;
+		r.min = r.max = ratio;
+		if(applyUncore(&r, 0)) {
+			ret = 1;
+			break;
+		}
+		energySample(&m);
+		start = nowNs();
+		bytes = 0;
+		do {
+			memmove(src + BENCH_UNCORE_BYTES / 2, src, BENCH_UNCORE_BYTES / 2);
+			memmove(src, src + BENCH_UNCORE_BYTES / 2, BENCH_UNCORE_BYTES / 2);
+			bytes += 2.0 * BENCH_UNCORE_BYTES;
+		} while((elapsed = nowNs() - start) < BENCH_UNCORE_NS);
+		sink = src[BENCH_UNCORE_BYTES - 1];
+		(void)sink;
+		printf("%ld\t\t%ld\t\t%.2f", ratio, 100 * ratio, bytes / elapsed);
+		if((seconds = energySample(&m)) > 0) {
+			for(watts = 0, k = 0; k < m.npkg; k++)
+				watts += m.pkgJ[k] / seconds;
+			printf("\t\t%.2f\t\t%.3f\n", watts, watts * seconds / bytes * 1e9);
+		}
+		else
+			printf("\t\t-\t\t-\n");
+		fflush(stdout);
+	} while(*p++ == ',');
+	if(msrBatch(ops, n)) {
+		fprintf(stderr, "Error writing MSR register\n");
+		ret = 1;
+	}
+	sched_setaffinity(0, sizeof(savedAffinity), &savedAffinity);
+	energyFree(&m);
+	free(ops);
+	free(src);
+	return (ret);
+}
+
+/*****************************************************************************
+ * ACPI
+ *
+ * The firmware declares the frequency and power of each P-state in _PSS
+ * packages of the DSDT and SSDTs. Only the constant forms are read:
+ * Name(_PSS, Package() {Package() {MHz, mW, latency, latency, control,
+ * status}, ...}) and Method(_PSS) {Return(Package() {...})}, scanned for in
+ * the AML byte code without interpreting it. AMD BIOSes often name the
+ * package SPSS or NPSS and return it from a _PSS method, so any name
+ * ending in PSS is accepted. The processor a
+ * package belongs to is the innermost Scope, Device or Processor term
+ * around it, e.g. Scope(\_PR.CPU0) in an SSDT.
+ *****************************************************************************/
+
+#define ACPI_TABLES_DIR		"/sys/firmware/acpi/tables"
+#define AML_SCOPE_OP		0x10
+#define AML_NAME_OP		0x08
+#define AML_PACKAGE_OP		0x12
+#define AML_METHOD_OP		0x14
+#define AML_RETURN_OP		0xA4
+#define AML_EXT_OP		0x5B
+#define AML_DEVICE_OP		0x82
+#define AML_PROCESSOR_OP	0x83
+#define AML_DUAL_NAME		0x2E
+#define AML_MULTI_NAME		0x2F
+#define PSS_FIELDS		6
+#define ACPI_PATH_MAX		64
+
+static const char * acpiDir = ACPI_TABLES_DIR;
+
+/** acpiPss
+ *
+ * A _PSS package and the path of the processor scope declaring it, e.g.
+ * \_PR.CPU0.SPSS. */
+struct acpiPss {
+	char path[ACPI_PATH_MAX];
+	int n;
+	uint64_t mhz[8], mW[8], control[8];
+};
+
+/** amlScope
+ *
+ * The extent of a Scope, Device or Processor term of a table and its
+ * name, absolute or relative to the enclosing scope. */
+struct amlScope {
+	ssize_t begin, end;
+	char name[ACPI_PATH_MAX];
+};
+
+/** amlPkgLength
+ *
+ * Decode a PkgLength, return the number of bytes it takes or 0. */
+static int amlPkgLength(const uint8_t * p, const uint8_t * end, size_t * len) {
+	int i, n = 1 + (p[0] >> 6);
+
+	if(end - p < n)
+		return (0);
+	if(n == 1) {
+		*len = p[0] & 0x3F;
+		return (1);
+	}
+	*len = p[0] & 0x0F;
+	for(i = 1; i < n; i++)
+		*len |= (size_t)p[i] << (8 * i - 4);
+	return (n);
+}
+
+/** amlInteger
+ *
+ * Decode an integer constant, return the number of bytes it takes or 0. */
+static int amlInteger(const uint8_t * p, const uint8_t * end, uint64_t * val) {
+	int i, n;
+
+	switch(p[0]) {
+	case 0x00: *val = 0; return (1);
+	case 0x01: *val = 1; return (1);
+	case 0xFF: *val = ~(uint64_t)0; return (1);
+	case 0x0A: n = 1; break;
+	case 0x0B: n = 2; break;
+	case 0x0C: n = 4; break;
+	case 0x0E: n = 8; break;
+	default: return (0);
+	}
+	if(end - p <= n)
+		return (0);
+	for(*val = 0, i = 0; i < n; i++)
+		*val |= (uint64_t)p[1 + i] << (8 * i);
+	return (1 + n);
+}
+
+/** amlNameString
+ *
+ * Decode a NameString into a dotted path without the trailing underscores
+ * of its segments, e.g. \_PR.CPU0. Return the number of bytes it takes or
+ * 0 if it is not a valid name. */
+static int amlNameString(const uint8_t * p, const uint8_t * end, char * name, size_t size) {
+	const uint8_t * q = p;
+	size_t len = 0;
+	int i, k, segs = 1;
+
+	while(q < end && (*q == '\\' || *q == '^') && len + 1 < size)
+		name[len++] = *q++;
+	if(q < end && *q == AML_DUAL_NAME) {
+		segs = 2;
+		q++;
+	}
+	else if(q + 1 < end && *q == AML_MULTI_NAME) {
+		segs = q[1];
+		q += 2;
+	}
+	if(segs == 0 || end - q < 4 * segs)
+		return (0);
+	for(i = 0; i < segs; i++, q += 4) {
+		for(k = 0; k < 4; k++)
+			if(!(q[k] == '_' || (q[k] >= 'A' && q[k] <= 'Z') || (k > 0 && q[k] >= '0' && q[k] <= '9')))
+				return (0);
+		if(i > 0 && len + 1 < size)
+			name[len++] = '.';
+		for(k = 4; k > 1 && q[k - 1] == '_'; k--)
+			;
+		if(len + k < size) {
+			memcpy(&name[len], q, k);
+			len += k;
+		}
+	}
+	name[len] = '\0';
+	return (q - p);
+}
+
+/** amlScopes
+ *
+ * Find the Scope, Device and Processor terms of a table: an opcode, a
+ * PkgLength ending within the table and a valid NameString. Return how
+ * many were found, or -1 when out of memory. */
+static int amlScopes(const uint8_t * buf, ssize_t len, struct amlScope ** scopes) {
+	struct amlScope * s = NULL, * grown;
+	size_t pkgLen;
+	ssize_t i, start;
+	int n = 0, size = 0, used;
+
+	for(i = 36; i + 6 < len; i++) {
+		if(buf[i] == AML_SCOPE_OP)
+			start = i + 1;
+		else if(buf[i] == AML_EXT_OP && (buf[i + 1] == AML_DEVICE_OP || buf[i + 1] == AML_PROCESSOR_OP))
+			start = i + 2;
+		else
+			continue;
+		if((used = amlPkgLength(&buf[start], buf + len, &pkgLen)) == 0 || pkgLen > (size_t)(len - start))
+			continue;
+		if(n == size) {
+			size = size ? 2 * size : 16;
+			if((grown = realloc(s, size * sizeof(*s))) == NULL) {
+				free(s);
+				return (-1);
+			}
+			s = grown;
+		}
+		if(amlNameString(&buf[start + used], buf + start + pkgLen, s[n].name, sizeof(s[n].name)) == 0)
+			continue;
+		s[n].begin = i;
+		s[n++].end = start + pkgLen;
+	}
+	*scopes = s;
+	return (n);
+}
+
+/** amlScopePath
+ *
+ * Build the path of the innermost scope around offset i, prefixing
+ * relative names with the scopes around them. */
+static void amlScopePath(const struct amlScope * scopes, int n, ssize_t i, char * path, size_t size) {
+	char name[2 * ACPI_PATH_MAX];
+	int k, best;
+
+	path[0] = '\0';
+	while(path[0] != '\\') {
+		for(k = 0, best = -1; k < n; k++)
+			if(scopes[k].begin < i && scopes[k].end > i && (best < 0 || scopes[k].begin > scopes[best].begin))
+				best = k;
+		if(best < 0)
+			break;
+		i = scopes[best].begin;
+		snprintf(name, sizeof(name), "%s%s%s", scopes[best].name, path[0] ? "." : "", path);
+		snprintf(path, size, "%.*s", (int)size - 1, name);
+	}
+}
+
+/** amlPss
+ *
+ * Parse the package of P-states following the PackageOp at p. */
+static int amlPss(const uint8_t * p, const uint8_t * end, struct acpiPss * pss) {
+	const uint8_t * q, * e;
+	size_t len;
+	uint64_t f[PSS_FIELDS];
+	int i, k, n, used;
+
+	if(p >= end || (used = amlPkgLength(p, end, &len)) == 0 || (size_t)(end - p) < len)
+		return (1);
+	end = p + len;
+	p += used;
+	if(p >= end || (n = *p++) == 0)
+		return (1);
+	for(i = 0; i < n && i < 8; i++) {
+		if(p >= end || *p++ != AML_PACKAGE_OP || (used = amlPkgLength(p, end, &len)) == 0
+				|| (size_t)(end - p) < len)
+			return (1);
+		q = p + used;
+		e = p + len;
+		if(q >= e || *q++ != PSS_FIELDS)
+			return (1);
+		for(k = 0; k < PSS_FIELDS; k++, q += used)
+			if(q >= e || (used = amlInteger(q, e, &f[k])) == 0)
+				return (1);
+		pss->mhz[i] = f[0];
+		pss->mW[i] = f[1];
+		pss->control[i] = f[4];
+		p = e;
+	}
+	pss->n = i;
+	return (0);
+}
+
+/** acpiLoadPss
+ *
+ * Scan the DSDT and SSDTs for _PSS packages, into an array of *count
+ * entries the caller frees. */
+static int acpiLoadPss(struct acpiPss ** pss, int * count) {
+	char path[PATH_MAX], scope[ACPI_PATH_MAX];
+	struct acpiPss found, * grown;
+	struct amlScope * scopes;
+	struct dirent * ent;
+	struct stat st;
+	uint8_t * buf;
+	DIR * dir;
+	int fd, nScopes, used, size = 0;
+	size_t pkgLen;
+	ssize_t len, i, nameAt, pkg;
+
+	*pss = NULL;
+	*count = 0;
+	if((dir = opendir(acpiDir)) == NULL) {
+		perror("Opening ACPI tables");
+		return (1);
+	}
+	while((ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, "DSDT") != 0 && strncmp(ent->d_name, "SSDT", 4) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", acpiDir, ent->d_name);
+		if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0
+				|| (buf = malloc(st.st_size + 1)) == NULL) {
+			perror(path);
+			if(fd >= 0)
+				close(fd);
+			continue;
+		}
+		len = read(fd, buf, st.st_size);
+		close(fd);
+		if((nScopes = amlScopes(buf, len, &scopes)) < 0) {
+			perror("Scanning ACPI tables");
+			free(buf);
+			continue;
+		}
+			/* The AML code starts after the 36 bytes table header. */
+		for(i = 36; i + 6 < len; i++) {
+			if(buf[i] == AML_NAME_OP && buf[i + 5] == AML_PACKAGE_OP) {
+				nameAt = i + 1;
+				pkg = i + 6;
+			}
+				/* NameString, flags, then the ReturnOp. */
+			else if(buf[i] == AML_METHOD_OP && (used = amlPkgLength(&buf[i + 1], buf + len, &pkgLen)) > 0
+					&& i + used + 7 < len && buf[i + used + 6] == AML_RETURN_OP
+					&& buf[i + used + 7] == AML_PACKAGE_OP) {
+				nameAt = i + 1 + used;
+				pkg = i + used + 8;
+			}
+			else
+				continue;
+			if(memcmp(&buf[nameAt + 1], "PSS", 3) != 0)
+				continue;
+			memset(&found, 0, sizeof(found));
+			if(amlPss(&buf[pkg], buf + len, &found))
+				continue;
+			amlScopePath(scopes, nScopes, i, scope, sizeof(scope));
+			snprintf(found.path, sizeof(found.path), "%.*s%s%.4s", (int)sizeof(found.path) - 6, scope,
+				scope[0] ? "." : "", &buf[nameAt]);
+			if(*count == size) {
+				size = size ? 2 * size : 16;
+				if((grown = realloc(*pss, size * sizeof(**pss))) == NULL) {
+					perror("Loading _PSS packages");
+					break;
+				}
+				*pss = grown;
+			}
+			(*pss)[(*count)++] = found;
+		}
+		free(scopes);
+		free(buf);
+	}
+	closedir(dir);
+	if(*count == 0) {
+		fprintf(stderr, "No _PSS package found in the ACPI tables of %s\n", acpiDir);
+		free(*pss);
+		*pss = NULL;
+		return (1);
+	}
+	return (0);
+}
+
+/** pssSame
+ *
+ * Whether two _PSS packages declare the same P-states. */
+static int pssSame(const struct acpiPss * a, const struct acpiPss * b) {
+	return a->n == b->n && memcmp(a->mhz, b->mhz, sizeof(a->mhz)) == 0 && memcmp(a->mW, b->mW, sizeof(a->mW)) == 0
+		&& memcmp(a->control, b->control, sizeof(a->control)) == 0;
+}
+
+/** showPss
+ *
+ * Display the P-states of a _PSS next to the MSR ones, with the declared
+ * power and our estimate for the Vids now set: V * Idd where the P-state
+ * declares its current, else the declared P0 power scaled by V^2 * f. */
+static void showPss(const struct pstateTable * t, const struct acpiPss * pss, double pllMHz) {
+	double v, watts;
+	int i, k;
+
+	printf("_PSS\t\tP-state\t\tMHz\t\tDeclared MHz\tDeclared W\tEstimate W\n");
+	for(i = 0; i < pss->n; i++) {
+		if(cpuVendor == VENDOR_INTEL)
+			k = pstateOfRatio(t, (pss->control[i] >> 8) & 0xFF);
+		else
+			k = pss->control[i] & 7;
+		if(k < t->min || k > t->max) {
+			printf("  %d\t\t-\t\t-\t\t%" PRIu64 "\t\t%.3f\n", i, pss->mhz[i], pss->mW[i] / 1000.0);
+			continue;
+		}
+		v = voltage(t->vid[k]);
+		if(cpuVendor != VENDOR_INTEL && t->idd[k] > 0)
+			watts = v * t->idd[k];
+		else
+			watts = pss->mW[0] / 1000.0 * t->power[k] / t->power[t->min];
+		printf("  %d\t\t%d\t\t%.0f\t\t%" PRIu64 "\t\t%.3f\t\t%.3f\n", i, k, pllMHz > 0 ? pllMHz / t->div[k] : 0,
+			pss->mhz[i], pss->mW[i] / 1000.0, watts);
+	}
+}
+
+/** showAcpi
+ *
+ * Display the _PSS of each processor mapped onto the MSR P-states, once
+ * per distinct package with the processors declaring it, warning when the
+ * processors do not all declare the same one. */
+static int showAcpi(const struct pstateTable * t) {
+	struct acpiPss * pss;
+	double pllMHz = mainPllMHz(t);
+	char * shown;
+	int i, j, count, distinct = 0;
+
+	if(acpiLoadPss(&pss, &count))
+		return (1);
+	if((shown = calloc(count, 1)) == NULL) {
+		perror("Loading _PSS packages");
+		free(pss);
+		return (1);
+	}
+	for(i = 0; i < count; i++) {
+		if(shown[i])
+			continue;
+		printf("%s", distinct++ ? "\n" : "");
+		for(j = i; j < count; j++)
+			if(!shown[j] && pssSame(&pss[i], &pss[j])) {
+				shown[j] = 1;
+				printf("%s%s", j > i ? ", " : "", pss[j].path[0] ? pss[j].path : "(no scope)");
+			}
+		printf(":\n");
+		showPss(t, &pss[i], pllMHz);
+	}
+	if(distinct > 1)
+		fprintf(stderr, "Warning: the %d _PSS packages found declare %d different sets of P-states\n", count, distinct);
+	free(shown);
+	free(pss);
+	return (0);
+}
+
+/*****************************************************************************
+ * What-if
+ *
+ * Estimate the energy a proposed set of -p values would save over the
+ * P-state residency recorded on hosts running the current table. A
+ * residency file has one line per P-state, either P<n> <seconds> or the
+ * <kHz> <time in 10 ms> lines of cpufreq's stats/time_in_state. A host
+ * running another table points to it, saved from -r, on a first line
+ *
+ *	table <file> [<P0 MHz>]
+ *
+ * the file relative to the residency one, and the P0 frequency needed to
+ * map time_in_state lines.
+ *****************************************************************************/
+
+#define WHATIF_MAX_FILES	64
+
+/** pstateWatts
+ *
+ * Full load power of a P-state of the table run at another Vid and
+ * divisor, in W: V * Idd where the current is fused, else EST_P0_WATTS
+ * scaled by V^2 * f, then scaled by V^2 * f from the current definition to
+ * the given one. */
+static double pstateWatts(const struct pstateTable * t, int i, long vid, float div) {
+	double v = voltage(t->vid[i]), base;
+
+	base = t->idd[i] > 0 ? v * t->idd[i] : EST_P0_WATTS * t->power[i];
+	if(v <= 0 || div <= 0)
+		return base;
+	return base * voltage(vid) * voltage(vid) / (v * v) * t->div[i] / div;
+}
+
+/** loadResidency
+ *
+ * Add the seconds spent in each P-state of the table from a file, after
+ * replacing the table and its main PLL frequency by the host's own if the
+ * file names one, then setting *own. The frequencies of time_in_state are
+ * mapped to the P-state running closest to them. */
+static int loadResidency(const char * path, struct pstateTable * t, double * pllMHz, double * seconds, int * own) {
+	FILE * stream;
+	char line[256], file[256], tablePath[PATH_MAX], * p, c;
+	double time, khz, best, d, p0MHz;
+	int i, k, n, lineNo = 0, samples = 0;
+
+	if((stream = fopen(path, "r")) == NULL) {
+		perror(path);
+		return (1);
+	}
+	while(fgets(line, sizeof(line), stream) != NULL) {
+		lineNo++;
+		if((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if(sscanf(line, " %c", &c) != 1)
+			continue;
+		if((n = sscanf(line, " table %255s %lf", file, &p0MHz)) >= 1) {
+			p = strrchr(path, '/');
+			if(file[0] != '/' && p != NULL)
+				snprintf(tablePath, sizeof(tablePath), "%.*s/%s", (int)(p - path), path, file);
+			else
+				snprintf(tablePath, sizeof(tablePath), "%s", file);
+			if(samples > 0 || *own) {
+				fprintf(stderr, "%s:%d: the table must come first, once\n", path, lineNo);
+				fclose(stream);
+				return (1);
+			}
+			if(loadPstateFile(tablePath, t) || t->ratio[t->min] != 0) {
+				if(t->ratio[t->min] != 0)
+					fprintf(stderr, "%s: the P-state table has no Vids\n", tablePath);
+				fclose(stream);
+				return (1);
+			}
+			*pllMHz = (n == 2) ? p0MHz * t->div[t->min] : 0;
+			*own = 1;
+			continue;
+		}
+		samples++;
+		if(sscanf(line, " P%d %lf", &k, &time) == 2) {
+			if(k < t->min || k > t->max) {
+				fprintf(stderr, "%s:%d: P-state %d is not valid\n", path, lineNo, k);
+				fclose(stream);
+				return (1);
+			}
+		}
+		else if(sscanf(line, "%lf %lf", &khz, &time) == 2) {
+			if(*pllMHz <= 0) {
+				fprintf(stderr, "%s:%d: the P-state frequencies are unknown, use P<n> lines\n", path, lineNo);
+				fclose(stream);
+				return (1);
+			}
+			for(i = k = t->min, best = HUGE_VAL; i <= t->max; i++)
+				if((d = fabs(*pllMHz / t->div[i] - khz / 1000)) < best) {
+					best = d;
+					k = i;
+				}
+			time /= 100;
+		}
+		else {
+			fprintf(stderr, "%s:%d: expected P<n> <seconds> or <kHz> <10 ms units>\n", path, lineNo);
+			fclose(stream);
+			return (1);
+		}
+		seconds[k] += time;
+	}
+	fclose(stream);
+	return (0);
+}
+
+/** whatIfWatts
+ *
+ * Compute and display the current and proposed full load power of each
+ * P-state of a table. The -p values are proposed as is, an --offset of
+ * offsetMv, if not NULL, shifts the table's own Vids instead. */
+static void whatIfWatts(const struct pstateTable * t, const uint64_t * vidToSet, const float * divToSet,
+		const double * offsetMv, double * now, double * next) {
+	long vid;
+	float div;
+	int i;
+
+	printf("P-state\t\tVid\t\tProposed\tW\t\tProposed W\n");
+	for(i = t->min; i <= t->max; i++) {
+		vid = vidToSet[i] != 0 ? (long)vidToSet[i] : t->vid[i];
+		if(offsetMv != NULL) {
+			vid = t->vid[i] - lround(*offsetMv / VID_STEP_MV);
+			vid = vid < 0 ? 0 : vid > VID_LAST ? VID_LAST : vid;
+		}
+		div = divToSet[i] > 0 ? divToSet[i] : t->div[i];
+		now[i] = pstateWatts(t, i, t->vid[i], t->div[i]);
+		next[i] = pstateWatts(t, i, vid, div);
+		printf("  %d\t\t0x%lX\t\t0x%lX\t\t%.3f\t\t%.3f\n", i, t->vid[i], vid, now[i], next[i]);
+	}
+}
+
+/** whatIf
+ *
+ * Report the energy of the recorded residency with each host's table and
+ * with the proposed Vids and divisors, per file and over all of them. On
+ * the current table, vidToSet already holds the Vids of an --offset. A
+ * P-state counts at full load for all its residency, so energies are upper
+ * bounds, but the saving applies as is to the busy time. The residency is
+ * assumed not to change with a proposed divisor. */
+static int whatIf(const char ** paths, int nPaths, const struct pstateTable * local, const uint64_t * vidToSet,
+		const float * divToSet, const double * offsetMv) {
+	struct pstateTable t;
+	double now[8], next[8], localNow[8], localNext[8], seconds[8], pllMHz, span, e0, e1, total0 = 0, total1 = 0;
+	int i, f, own, shown = 0;
+
+	for(f = 0; f < nPaths; f++) {
+		t = *local;
+		pllMHz = mainPllMHz(local);
+		own = 0;
+		memset(seconds, 0, sizeof(seconds));
+		if(loadResidency(paths[f], &t, &pllMHz, seconds, &own))
+			return (1);
+		if(own) {
+			printf("%s:\n", paths[f]);
+			whatIfWatts(&t, vidToSet, divToSet, offsetMv, now, next);
+		}
+		else {
+			if(!shown++)
+				whatIfWatts(local, vidToSet, divToSet, NULL, localNow, localNext);
+			memcpy(now, localNow, sizeof(now));
+			memcpy(next, localNext, sizeof(next));
+		}
+		span = e0 = e1 = 0;
+		for(i = t.min; i <= t.max; i++) {
+			span += seconds[i];
+			e0 += now[i] * seconds[i];
+			e1 += next[i] * seconds[i];
+		}
+		printf("%s: %.0f s, current %.1f J, proposed %.1f J, saving %.2f%%\n", paths[f], span, e0, e1,
+			e0 > 0 ? 100 * (e0 - e1) / e0 : 0);
+		total0 += e0;
+		total1 += e1;
+	}
+	if(nPaths > 1)
+		printf("All %d hosts: current %.1f J, proposed %.1f J, saving %.2f%%\n", nPaths, total0, total1,
+			total0 > 0 ? 100 * (total0 - total1) / total0 : 0);
+	return (0);
+}
+
+/*****************************************************************************
+ * Profiles
+ *
+ * A profile file holds the options for each kind of machine of a fleet, so
+ * that the same boot command fits them all:
+ *
+ *	# C-60 netbooks
+ *	[c60-1015bx]
+ *	family = 0x14
+ *	model = 2
+ *	board_name = 1015BX*
+ *	options = -p 0:0x28 -p 1:0x28,3 -p 2:0x38
+ *
+ * family, model and stepping are compared with the cpu identity, any other
+ * key names a file of /sys/class/dmi/id matched against a shell pattern.
+ * The first profile whose keys all match is selected, a profile without
+ * keys matches any machine.
+ *****************************************************************************/
+
+#define DMI_ID_DIR		"/sys/class/dmi/id"
+#define PROFILE_MAX_ARGS	64
+
+static const char * dmiDir = DMI_ID_DIR;
+
+/** trimSpaces
+ *
+ * Remove the leading and trailing blanks of a string, in place. */
+static char * trimSpaces(char * s) {
+	char * e;
+
+	while(*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while(e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' || e[-1] == '\r'))
+		e--;
+	*e = '\0';
+	return (s);
+}
+
+/** dmiMatch
+ *
+ * Check a DMI identifier, e.g. board_name, against a shell pattern. A
+ * missing or unreadable identifier does not match. */
+static int dmiMatch(const char * key, const char * pattern) {
+	char path[PATH_MAX], value[256];
+	FILE * stream;
+
+	if(strchr(key, '/') != NULL)
+		return (0);
+	snprintf(path, sizeof(path), "%s/%s", dmiDir, key);
+	if((stream = fopen(path, "r")) == NULL)
+		return (0);
+	if(fgets(value, sizeof(value), stream) == NULL)
+		value[0] = '\0';
+	fclose(stream);
+	return fnmatch(pattern, trimSpaces(value), 0) == 0;
+}
+
+/** profileSelect
+ *
+ * Find the first profile of a file that matches this machine, or the one
+ * named wanted if not NULL, and split its options into a new argument
+ * vector, behind argv0. The vector and the strings it points to are one
+ * allocation, which the caller frees with the vector. */
+static int profileSelect(const char * path, const char * wanted, char * argv0, int * argc, char *** argv) {
+	FILE * stream;
+	char * line = NULL, * key, * value, * options = NULL, * strings, * arg, * save, name[64] = "";
+	size_t len = 0;
+	int lineNo = 0, inProfile = 0, matches = 0, found = 0, syntax = 0, id;
+
+	if((stream = fopen(path, "r")) == NULL) {
+		perror("Opening profiles");
+		return (1);
+	}
+	while(!found && !syntax && getline(&line, &len, stream) != -1) {
+		lineNo++;
+		key = trimSpaces(line);
+		if(*key == '\0' || *key == '#')
+			continue;
+		if(*key == '[') {
+			if(inProfile && matches) {
+				found = 1;
+				break;
+			}
+			if(sscanf(key, "[%63[^]]]", name) != 1) {
+				syntax = 1;
+				break;
+			}
+			inProfile = 1;
+			matches = wanted == NULL || strcmp(name, wanted) == 0;
+			free(options);
+			options = NULL;
+			continue;
+		}
+		if(!inProfile || (value = strchr(key, '=')) == NULL) {
+			syntax = 1;
+			break;
+		}
+		*value++ = '\0';
+		key = trimSpaces(key);
+		value = trimSpaces(value);
+		if(strcmp(key, "options") == 0) {
+			free(options);
+			options = strdup(value);
+		}
+		else if(wanted != NULL)
+			continue;
+		else if(strcmp(key, "family") == 0 || strcmp(key, "model") == 0 || strcmp(key, "stepping") == 0) {
+			if(sscanf(value, "%i", &id) != 1) {
+				syntax = 1;
+				break;
+			}
+			matches &= id == (key[0] == 'f' ? cpuFamily : (key[0] == 'm' ? cpuModel : cpuStepping));
+		}
+		else
+			matches &= dmiMatch(key, value);
+	}
+	found |= !syntax && inProfile && matches;
+	free(line);
+	fclose(stream);
+	if(syntax) {
+		fprintf(stderr, "%s:%d: expected [name] or key = value\n", path, lineNo);
+		free(options);
+		return (1);
+	}
+	if(!found && wanted != NULL) {
+		fprintf(stderr, "%s: no profile '%s'\n", path, wanted);
+		free(options);
+		return (1);
+	}
+	if(!found) {
+		fprintf(stderr, "%s: no profile matches family %Xh model %Xh stepping %d\n", path, cpuFamily, cpuModel, cpuStepping);
+		free(options);
+		return (1);
+	}
+	if(options == NULL) {
+		fprintf(stderr, "%s: profile '%s' has no options\n", path, name);
+		return (1);
+	}
+	if(wanted == NULL)
+		printf("Profile: %s\n", name);
+	if((*argv = calloc(1, (PROFILE_MAX_ARGS + 1) * sizeof(**argv) + strlen(options) + 1)) == NULL) {
+		perror("Loading profile");
+		free(options);
+		return (1);
+	}
+	strings = (char *)(*argv + PROFILE_MAX_ARGS + 1);
+	strcpy(strings, options);
+	free(options);
+	(*argv)[0] = argv0;
+	*argc = 1;
+	for(arg = strtok_r(strings, " \t", &save); arg != NULL; arg = strtok_r(NULL, " \t", &save)) {
+		if(*argc == PROFILE_MAX_ARGS) {
+			fprintf(stderr, "%s: profile '%s' has too many options\n", path, name);
+			free(*argv);
+			*argv = NULL;
+			return (1);
+		}
+		(*argv)[(*argc)++] = arg;
+	}
+	return (0);
+}
+
+/*****************************************************************************
+ * Profile comparison
+ *
+ * Back to back runs of a benchmark under two settings are biased by the
+ * temperature rising and by whatever else runs meanwhile. --compare runs
+ * short trials of the same workload instead, each block of trials taking
+ * every profile once in a random order, and compares the means of the
+ * throughput and of the energy per unit of work with Welch's t-test.
+ *****************************************************************************/
+
+#define COMPARE_MAX_ARMS	8
+#define COMPARE_TRIALS		10
+#define COMPARE_TRIAL_MS	1000
+
+	/** A profile compared: the PSTATE_DEF value of every target cpu and
+	 * P-state, and the throughput, power and energy per unit of work of
+	 * each of its trials. */
+struct compareArm {
+	const char * name;
+	uint64_t * defs;
+	double * ops, * watts, * joules;
+	int n;
+};
+
+/** compareLoadArm
+ *
+ * Read the -p and --offset options of a profile into the PSTATE_DEF values
+ * it gives each target cpu, from those read before the comparison. */
+static int compareLoadArm(const char * path, char * argv0, const struct pstateTable * t, const uint64_t * base,
+		int nDefs, struct compareArm * a) {
+	uint64_t vidToSet[8] = {0}, val;
+	float divToSet[8] = {0}, div;
+	char ** args, * end;
+	double mV;
+	int nargs, k, i, pstate, vid, n;
+
+	if(profileSelect(path, a->name, argv0, &nargs, &args))
+		return (1);
+	for(k = 1; k < nargs; k++) {
+		if(k + 1 < nargs && strcmp(args[k], "-p") == 0) {
+			div = 0.0;
+			n = sscanf(args[++k], "%1d:%i,%f", &pstate, &vid, &div);
+			if((n != 2 && n != 3) || pstate < t->min || pstate > t->max) {
+				fprintf(stderr, "%s: profile '%s': invalid -p %s\n", path, a->name, args[k]);
+				free(args);
+				return (1);
+			}
+			vidToSet[pstate] = vid;
+			divToSet[pstate] = div;
+		}
+		else if(k + 1 < nargs && strcmp(args[k], "--offset") == 0) {
+			mV = strtod(args[++k], &end);
+			if(*end != '\0' || offsetVids(t, mV, vidToSet)) {
+				free(args);
+				return (1);
+			}
+		}
+		else {
+			fprintf(stderr, "%s: profile '%s': only -p and --offset can be compared\n", path, a->name);
+			free(args);
+			return (1);
+		}
+	}
+	free(args);
+	for(k = 0; k < nDefs; k++) {
+		i = t->min + k % (t->max - t->min + 1);
+		val = base[k];
+		if(vidToSet[i] != 0)
+			val = PSTATE_DEF_VID_set(val, vidToSet[i]);
+		if(divToSet[i] != 0.0)
+			divtomsr(divToSet[i], &val);
+		a->defs[k] = val;
+	}
+	return (0);
+}
+
+/** compareSwitch
+ *
+ * Write the PSTATE_DEF values of an arm that differ from the current ones,
+ * in one batch that also reads where each cpu written to is, then move the
+ * cpus whose current P-state was redefined to it again, so that the new
+ * Vid takes effect now rather than at the next transition. cur is updated
+ * for the writes that succeeded only. ops has room for 3 * nDefs accesses. */
+static int compareSwitch(const struct pstateTable * t, struct msrOp * ops, const int * cpus, int nDefs,
+		uint64_t * cur, const uint64_t * defs) {
+	int k, j, n = 0, m = 0, last = -1, pstates = t->max - t->min + 1;
+	struct msrOp * sel = ops + 2 * nDefs;
+
+	for(k = 0; k < nDefs; k++) {
+		if(defs[k] == cur[k])
+			continue;
+		if(cpus[k] != last) {
+			ops[n].cpu = last = cpus[k];
+			ops[n].write = 0;
+			ops[n++].msr = MSR_COFVID_STATUS;
+		}
+		ops[n].cpu = cpus[k];
+		ops[n].write = 1;
+		ops[n].msr = MSR_PSTATE_DEF + t->min + k % pstates;
+		ops[n++].val = defs[k];
+	}
+	if(n == 0)
+		return (0);
+	j = msrBatch(ops, n);
+	/* Only the values that were written are current now. */
+	for(k = 0, n = 0, last = -1; k < nDefs; k++) {
+		if(defs[k] == cur[k])
+			continue;
+		if(cpus[k] != last) {
+			last = cpus[k];
+			n++;
+		}
+		if(ops[n++].err == 0)
+			cur[k] = defs[k];
+	}
+	if(j) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	for(k = 0; k < n; k++) {
+		if(ops[k].write)
+			continue;
+		last = COFVID_STATUS_CUR_PSTATE(ops[k].val);
+		for(j = k + 1; j < n && ops[j].write; j++)
+			if((int)(ops[j].msr - MSR_PSTATE_DEF) == last) {
+				sel[m].cpu = ops[k].cpu;
+				pstateSelect(t, last, &sel[m++]);
+				break;
+			}
+	}
+	if(m > 0 && msrBatch(sel, m)) {
+		fprintf(stderr, "Error writing MSR register\n");
+		return (1);
+	}
+	return (0);
+}
+
+/** welch
+ *
+ * Difference of the means of two samples and the half width of its 95%
+ * confidence interval, from Welch's t with a Cornish-Fisher expansion of
+ * the quantile. The half width is NAN with fewer than 2 values a side. */
+static double welch(const double * a, int na, const double * b, int nb, double * half) {
+	double ma = 0, mb = 0, va = 0, vb = 0, df, z = 1.959964, q;
+	int k;
+
+	for(k = 0; k < na; k++)
+		ma += a[k] / na;
+	for(k = 0; k < nb; k++)
+		mb += b[k] / nb;
+	*half = NAN;
+	if(na < 2 || nb < 2)
+		return mb - ma;
+	for(k = 0; k < na; k++)
+		va += (a[k] - ma) * (a[k] - ma) / (na - 1) / na;
+	for(k = 0; k < nb; k++)
+		vb += (b[k] - mb) * (b[k] - mb) / (nb - 1) / nb;
+	if(va + vb <= 0) {
+		*half = 0;
+		return mb - ma;
+	}
+	df = (va + vb) * (va + vb) / (va * va / (na - 1) + vb * vb / (nb - 1));
+	q = z + (z * z * z + z) / (4 * df) + (5 * pow(z, 5) + 16 * z * z * z + 3 * z) / (96 * df * df);
+	*half = q * sqrt(va + vb);
+	return mb - ma;
+}
+
+static double mean(const double * x, int n) {
+	double m = 0;
+	int k;
+
+	for(k = 0; k < n; k++)
+		m += x[k] / n;
+	return m;
+}
+
+/** compareInterrupted
+ *
+ * Wait up to ms for SIGINT or SIGTERM on the signalfd, and tell if one
+ * came. */
+static int compareInterrupted(int sfd, int ms) {
+	struct signalfd_siginfo si;
+	struct pollfd pfd = {sfd, POLLIN, 0};
+
+	if(poll(&pfd, 1, ms) <= 0 || read(sfd, &si, sizeof(si)) != sizeof(si))
+		return (0);
+	fprintf(stderr, "Interrupted, putting the P-state definitions back\n");
+	return (1);
+}
+
+/** compareTrial
+ *
+ * Run the workload for trialMs and return the units of work done: the
+ * iterations of the built-in spinning threads, or the runs of the workload
+ * command, the last of which is waited for. -1 on error or interrupt. */
+static double compareTrial(const char * workload, struct spinLoad * spin, int nSpin, int trialMs, int sfd) {
+	double end = nowNs() + trialMs * 1e6, work = 0;
+	unsigned long long before = 0;
+	sigset_t mask;
+	int k, status;
+	pid_t pid;
+
+	if(workload == NULL) {
+		for(k = 0; k < nSpin; k++)
+			before += __atomic_load_n(&spin[k].count, __ATOMIC_RELAXED);
+		if(compareInterrupted(sfd, trialMs))
+			return (-1);
+		for(k = 0; k < nSpin; k++)
+			work += __atomic_load_n(&spin[k].count, __ATOMIC_RELAXED);
+		return work - before;
+	}
+	do {
+		if((pid = fork()) < 0) {
+			perror("Starting the workload");
+			return (-1);
+		}
+		if(pid == 0) {
+				/* The workload takes the signals as usual. */
+			sigemptyset(&mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+			execl("/bin/sh", "sh", "-c", workload, (char *)NULL);
+			_exit(127);
+		}
+		k = waitpid(pid, &status, 0);
+		if(compareInterrupted(sfd, 0))
+			return (-1);
+		if(k < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Workload '%s' failed\n", workload);
+			return (-1);
+		}
+		work++;
+	} while(nowNs() < end);
+	return work;
+}
+
+/** compareProfiles
+ *
+ * Compare the profiles named in a comma separated list over trials blocks
+ * of trialMs trials, each block running every profile once in a random
+ * order. Switching only writes the PSTATE_DEF registers that differ, in one
+ * batch. The P-state definitions found are put back at the end, also on
+ * SIGINT or SIGTERM, which are blocked meanwhile and polled for. */
+static int compareProfiles(const char * path, const char * list, char * argv0, const struct pstateTable * t,
+		const char * workload, int trials, int trialMs) {
+	struct compareArm arms[COMPARE_MAX_ARMS];
+	struct spinLoad * spin = NULL;
+	struct energyMeter m;
+	struct msrOp * ops;
+	char * names, * name, * save;
+	uint64_t * base, * cur;
+	int * cpus, order[COMPARE_MAX_ARMS];
+	int nArms = 0, nDefs, nSpin = 0, pstates = t->max - t->min + 1, a, b, j, k, ret = 1, sfd;
+	sigset_t mask, saved;
+	unsigned short seed[3];
+	double start, switchNs = 0, work, seconds, joules, d, half, ref;
+
+	nDefs = cpuSetCount(&targetCpus) * pstates;
+	if((names = strdup(list)) == NULL || (ops = calloc(3 * nDefs, sizeof(*ops))) == NULL
+			|| (cpus = calloc(nDefs, sizeof(*cpus))) == NULL
+			|| (base = calloc((COMPARE_MAX_ARMS + 2) * nDefs, sizeof(*base))) == NULL) {
+		perror("Allocating comparison");
+		exit(1);
+	}
+	cur = base + nDefs;
+	memset(&m, 0, sizeof(m));
+		/* Blocked before the spinning threads start, so they inherit it. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &saved);
+	if((sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		perror("Setting up signals");
+		goto out;
+	}
+	k = 0;
+	forEachCpu(j, &targetCpus)
+		for(a = t->min; a <= t->max; a++) {
+			cpus[k] = ops[k].cpu = j;
+			ops[k++].msr = MSR_PSTATE_DEF + a;
+		}
+		/* Until read, base and cur are equal and nothing is put back. */
+	if(msrBatch(ops, nDefs)) {
+		fprintf(stderr, "Error reading MSR register\n");
+		goto out;
+	}
+	for(k = 0; k < nDefs; k++)
+		base[k] = cur[k] = ops[k].val;
+	for(name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+		if(nArms == COMPARE_MAX_ARMS) {
+			fprintf(stderr, "Error: at most %d profiles to compare\n", COMPARE_MAX_ARMS);
+			goto out;
+		}
+		a = nArms++;
+		memset(&arms[a], 0, sizeof(arms[a]));
+		arms[a].name = name;
+		arms[a].defs = cur + (a + 1) * nDefs;
+		if((arms[a].ops = calloc(3 * trials, sizeof(double))) == NULL) {
+			perror("Allocating comparison");
+			exit(1);
+		}
+		arms[a].watts = arms[a].ops + trials;
+		arms[a].joules = arms[a].watts + trials;
+		if(compareLoadArm(path, argv0, t, base, nDefs, &arms[a]))
+			goto out;
+	}
+	if(nArms < 2) {
+		fprintf(stderr, "Error: --compare needs at least 2 profiles\n");
+		goto out;
+	}
+	energyInit(&m);
+	if(m.source == ENERGY_NONE)
+		fprintf(stderr, "Warning: no power measurement or estimate, comparing the throughput only\n");
+	if(workload == NULL && (spin = spinStart(&nSpin)) == NULL)
+		goto out;
+	start = nowNs();
+	seed[0] = (unsigned short)start;
+	seed[1] = (unsigned short)getpid();
+	seed[2] = 0x330E;
+	printf("Comparing %d profiles over %d blocks of %d ms trials\n", nArms, trials, trialMs);
+	for(b = 0; b < trials; b++) {
+			/* Fisher-Yates shuffle of the profiles of this block. */
+		for(a = 0; a < nArms; a++)
+			order[a] = a;
+		for(a = nArms - 1; a > 0; a--) {
+			k = (int)(erand48(seed) * (a + 1));
+			j = order[a];
+			order[a] = order[k];
+			order[k] = j;
+		}
+		for(j = 0; j < nArms; j++) {
+			a = order[j];
+			start = nowNs();
+			if(compareSwitch(t, ops, cpus, nDefs, cur, arms[a].defs))
+				goto out;
+			switchNs += nowNs() - start;
+			energySample(&m);
+			if((work = compareTrial(workload, spin, nSpin, trialMs, sfd)) < 0)
+				goto out;
+			seconds = energySample(&m);
+			for(joules = 0, k = 0; k < m.npkg; k++)
+				joules += m.pkgJ[k];
+			arms[a].ops[arms[a].n] = work / seconds;
+			arms[a].watts[arms[a].n] = joules / seconds;
+			arms[a].joules[arms[a].n] = work > 0 ? joules / work : 0;
+			arms[a].n++;
+			if(verbose)
+				printf("block %d: %s, %.4g units/s, %.3f W\n", b, arms[a].name, work / seconds, joules / seconds);
+		}
+	}
+	printf("Mean switch time %.1f us\n", switchNs / 1000 / (trials * nArms));
+	printf("%-16s %14s %10s %14s\n", "profile", "units/s", "W", "J/unit");
+	for(a = 0; a < nArms; a++)
+		printf("%-16s %14.6g %10.3f %14.6g\n", arms[a].name, mean(arms[a].ops, arms[a].n),
+			mean(arms[a].watts, arms[a].n), mean(arms[a].joules, arms[a].n));
+	printf("Differences to %s, with 95%% confidence intervals (%s energy):\n", arms[0].name, energySources[m.source]);
+	for(a = 1; a < nArms; a++) {
+		ref = mean(arms[0].ops, arms[0].n);
+		d = welch(arms[0].ops, arms[0].n, arms[a].ops, arms[a].n, &half);
+		printf("%-16s throughput %+.2f%% +/- %.2f%%", arms[a].name, 100 * d / ref, 100 * half / ref);
+		if(m.source != ENERGY_NONE) {
+			ref = mean(arms[0].joules, arms[0].n);
+			d = welch(arms[0].joules, arms[0].n, arms[a].joules, arms[a].n, &half);
+			printf(", energy per unit %+.2f%% +/- %.2f%%", 100 * d / ref, 100 * half / ref);
+		}
+		printf("\n");
+	}
+	ret = 0;
+out:
+	if(spin != NULL)
+		spinStop(spin, nSpin);
+		/* Put the P-state definitions back. */
+	if(compareSwitch(t, ops, cpus, nDefs, cur, base))
+		ret = 1;
+	if(sfd >= 0)
+		close(sfd);
+	sigprocmask(SIG_SETMASK, &saved, NULL);
+	energyFree(&m);
+	for(a = 0; a < nArms; a++)
+		free(arms[a].ops);
+	free(base);
+	free(cpus);
+	free(ops);
+	free(names);
+	return ret;
+}
+
+	/** Long only options. */
+enum {
+	OPT_INTERVAL = 256,
+	OPT_GOVERNOR_EVAL,
+	OPT_TRANSITION,
+	OPT_PSTATE_TABLE,
+	OPT_RT_FLOOR,
+	OPT_SLO_TARGET,
+	OPT_SLO_METRIC,
+	OPT_SLO_LOAD,
+	OPT_THERMAL_LIMIT,
+	OPT_THERMAL_HORIZON,
+	OPT_FAN,
+	OPT_APU,
+	OPT_SOCKET,
+	OPT_SIM,
+	OPT_BACKEND,
+	OPT_THREADS,
+	OPT_BENCH_SCALE,
+	OPT_CPUS,
+	OPT_HWP,
+	OPT_HWP_SET,
+	OPT_POWER,
+	OPT_CPPC,
+	OPT_CPPC_SET,
+	OPT_FORCE_PSTATE,
+	OPT_FORCE_RATIO,
+	OPT_OFFSET,
+	OPT_SMU,
+	OPT_SMU_SET,
+	OPT_SMU_FILE,
+	OPT_POWER_LIMIT,
+	OPT_POWER_LIMIT_SET,
+	OPT_POWER_LIMIT_VERIFY,
+	OPT_UNCORE,
+	OPT_UNCORE_SET,
+	OPT_BENCH_UNCORE,
+	OPT_PROFILES,
+	OPT_ACPI,
+	OPT_ACPI_TABLES,
+	OPT_WHAT_IF,
+	OPT_COMPARE,
+	OPT_COMPARE_TRIALS,
+	OPT_WORKLOAD,
+	OPT_DMI
+};
+
+static const struct option longOptions[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"governor", required_argument, NULL, 'g'},
+	{"interval", required_argument, NULL, OPT_INTERVAL},
+	{"governor-eval", required_argument, NULL, OPT_GOVERNOR_EVAL},
+	{"transition-latency", required_argument, NULL, OPT_TRANSITION},
+	{"pstate-table", required_argument, NULL, OPT_PSTATE_TABLE},
+	{"rt-floor", required_argument, NULL, OPT_RT_FLOOR},
+	{"slo-target", required_argument, NULL, OPT_SLO_TARGET},
+	{"slo-metric", required_argument, NULL, OPT_SLO_METRIC},
+	{"slo-load", required_argument, NULL, OPT_SLO_LOAD},
+	{"thermal-limit", required_argument, NULL, OPT_THERMAL_LIMIT},
+	{"thermal-horizon", required_argument, NULL, OPT_THERMAL_HORIZON},
+	{"fan", required_argument, NULL, OPT_FAN},
+	{"apu", required_argument, NULL, OPT_APU},
+	{"daemon", no_argument, NULL, 'd'},
+	{"top", no_argument, NULL, 't'},
+	{"sim", required_argument, NULL, OPT_SIM},
+	{"backend", required_argument, NULL, OPT_BACKEND},
+	{"threads", required_argument, NULL, OPT_THREADS},
+	{"bench-scale", no_argument, NULL, OPT_BENCH_SCALE},
+	{"cpus", required_argument, NULL, OPT_CPUS},
+	{"hwp", no_argument, NULL, OPT_HWP},
+	{"hwp-set", required_argument, NULL, OPT_HWP_SET},
+	{"power", no_argument, NULL, OPT_POWER},
+	{"cppc", no_argument, NULL, OPT_CPPC},
+	{"cppc-set", required_argument, NULL, OPT_CPPC_SET},
+	{"force-pstate", required_argument, NULL, OPT_FORCE_PSTATE},
+	{"force-ratio", required_argument, NULL, OPT_FORCE_RATIO},
+	{"offset", required_argument, NULL, OPT_OFFSET},
+	{"smu", no_argument, NULL, OPT_SMU},
+	{"smu-set", required_argument, NULL, OPT_SMU_SET},
+	{"smu-file", required_argument, NULL, OPT_SMU_FILE},
+	{"power-limit", no_argument, NULL, OPT_POWER_LIMIT},
+	{"power-limit-set", required_argument, NULL, OPT_POWER_LIMIT_SET},
+	{"power-limit-verify", no_argument, NULL, OPT_POWER_LIMIT_VERIFY},
+	{"uncore", no_argument, NULL, OPT_UNCORE},
+	{"uncore-set", required_argument, NULL, OPT_UNCORE_SET},
+	{"bench-uncore", required_argument, NULL, OPT_BENCH_UNCORE},
+	{"socket", required_argument, NULL, OPT_SOCKET},
+	{"profiles", required_argument, NULL, OPT_PROFILES},
+	{"dmi", required_argument, NULL, OPT_DMI},
+	{"acpi", no_argument, NULL, OPT_ACPI},
+	{"acpi-tables", required_argument, NULL, OPT_ACPI_TABLES},
+	{"what-if", required_argument, NULL, OPT_WHAT_IF},
+	{"compare", required_argument, NULL, OPT_COMPARE},
+	{"compare-trials", required_argument, NULL, OPT_COMPARE_TRIALS},
+	{"workload", required_argument, NULL, OPT_WORKLOAD},
+	{NULL, 0, NULL, 0}
+};
+
+/** options
+ *
+ * The commands and settings of the command line, then of the profile
+ * matching the machine, as parseArgs() found them. */
+struct options {
+	int read, current, top, resident, power, acpi, benchmark, cpusGiven;
+	const struct governor * gov;
+	int intervalMs;
+	const char * traceFile, * tableFile, * socketPath;
+	double transitionUs;
+	struct sloLoad load;
+	int loadGiven;
+		/** There is a max of 8 P-states in Family 14h. */
+	uint64_t vidToSet[8];
+	float divToSet[8];
+	int setPstates, offsetGiven;
+	double offsetMv;
+	int forcePstate, forceRatio;
+	int hwpShow, hwpSet, cppcShow, cppcSet;
+	struct hwpRequest hwpReq, cppcReq;
+	int uncoreShow, uncoreSet;
+	struct hwpRequest uncoreReq;
+	const char * uncoreRatios;
+	int limitShow, limitSet, limitVerify;
+	struct powerLimit limit;
+	int smuShow, smuSet;
+	double smuLimits[SMU_NLIMITS];
+	const char * profileFile;
+	const char * whatIfFiles[WHATIF_MAX_FILES];
+	int nWhatIf;
+	const char * compareList, * workload;
+	int compareTrials, compareTrialMs;
+};
+
+/** parseArgs
+ *
+ * Scan an argument vector into opt, the command line or, with from set to
+ * the profiles file, the options of the profile selected in it, args[0]
+ * being the program name in both cases. */
+static void parseArgs(int nargs, char ** args, const char * from, struct options * opt) {
+	int i, o, n, pstateId, vid;
+	float div;
+	char * end;
+
+	optind = 0;
+	while((o = getopt_long(nargs, args, "hcvrdtp:g:", longOptions, NULL)) != -1){
+ 		switch(o){
+ 		case 'h':
+ 			usage(args[0]);
+ 			exit(0);
+ 		case 'v':
+ 			verbose = 1;
+ 			break;
+ 		case 'r':
+ 			opt->read = 1;
+ 			break;
+ 		case 'c':
+ 			opt->current = 1;
+ 			break;
+ 		case 'g':
+ 			if((opt->gov = findGovernor(optarg)) == NULL) {
+ 				fprintf(stderr, "Unknown governor policy '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_INTERVAL:
+ 			opt->intervalMs = atoi(optarg);
+ 			if(opt->intervalMs <= 0) {
+ 				fprintf(stderr, "Invalid interval '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_GOVERNOR_EVAL:
+ 			opt->traceFile = optarg;
+ 			break;
+ 		case OPT_PSTATE_TABLE:
+ 			opt->tableFile = optarg;
+ 			break;
+ 		case OPT_SLO_TARGET:
+ 			sloTargetUs = strtod(optarg, &end);
+ 			if(*end != '\0' || end == optarg || sloTargetUs <= 0) {
+ 				fprintf(stderr, "Invalid latency target '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_SLO_METRIC:
+ 			sloMetric = optarg;
+ 			break;
+ 		case OPT_SLO_LOAD:
+ 			if(sscanf(optarg, "%lf,%lf%n", &opt->load.rate, &opt->load.workUs, &n) != 2 || optarg[n] != '\0'
+ 					|| opt->load.rate <= 0 || opt->load.workUs <= 0) {
+ 				fprintf(stderr, "Error parsing '%s', it should be <requests/s>,<us>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->loadGiven = 1;
+ 			break;
+ 		case OPT_THERMAL_LIMIT:
+ 			thermalLimit = strtod(optarg, &end);
+ 			if(*end != '\0' || end == optarg || thermalLimit <= 0) {
+ 				fprintf(stderr, "Invalid temperature '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_THERMAL_HORIZON:
+ 			thermalHorizon = strtod(optarg, &end);
+ 			if(*end != '\0' || end == optarg || thermalHorizon <= 0) {
+ 				fprintf(stderr, "Invalid horizon '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_FAN:
+ 			fanSpec = optarg;
+ 			break;
+ 		case OPT_APU:
+ 			apuDir = optarg;
+ 			break;
+ 		case OPT_RT_FLOOR:
+ 			rtFloor = strtol(optarg, &end, 10);
+ 			if(*end != '\0' || end == optarg || rtFloor < 0 || rtFloor >= 8) {
+ 				fprintf(stderr, "Invalid P-state '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_TRANSITION:
+ 			opt->transitionUs = strtod(optarg, &end);
+ 			if(*end != '\0' || end == optarg || opt->transitionUs < 0) {
+ 				fprintf(stderr, "Invalid transition latency '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case 'd':
+ 			opt->resident = 1;
+ 			break;
+ 		case 't':
+ 			opt->top = 1;
+ 			break;
+ 		case OPT_SOCKET:
+ 			opt->socketPath = optarg;
+ 			break;
+ 		case OPT_SIM:
+ 			if(simInit(optarg)) {
+ 				fprintf(stderr, "Invalid simulated topology '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_BACKEND:
+ 			for(i = 0; i < BACKEND_NCOUNT; i++)
+ 				if(strcmp(optarg, backendNames[i]) == 0)
+ 					break;
+ 			if(i == BACKEND_NCOUNT) {
+ 				fprintf(stderr, "Unknown backend '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			msrBackend = i;
+ 			break;
+ 		case OPT_THREADS:
+ 			msrThreads = atoi(optarg);
+ 			break;
+ 		case OPT_BENCH_SCALE:
+ 			opt->benchmark = 1;
+ 			break;
+ 		case OPT_HWP:
+ 			opt->hwpShow = 1;
+ 			break;
+ 		case OPT_HWP_SET:
+ 			if(hwpParse(&opt->hwpReq, optarg)) {
+ 				fprintf(stderr, "Error parsing '%s', it should be min=<perf>,max=<perf>,desired=<perf>,epp=<0-255 or name>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->hwpSet = 1;
+ 			break;
+ 		case OPT_CPPC:
+ 			opt->cppcShow = 1;
+ 			break;
+ 		case OPT_CPPC_SET:
+ 			if(hwpParse(&opt->cppcReq, optarg)) {
+ 				fprintf(stderr, "Error parsing '%s', it should be min=<perf>,max=<perf>,desired=<perf>,epp=<0-255 or name>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->cppcSet = 1;
+ 			break;
+ 		case OPT_OFFSET:
+ 			opt->offsetMv = strtod(optarg, &end);
+ 			if(*end != '\0' || end == optarg || fabs(opt->offsetMv) > 500) {
+ 				fprintf(stderr, "Invalid voltage offset '%s', it should be in mV, e.g. -50\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->offsetGiven = 1;
+ 			break;
+ 		case OPT_PROFILES:
+ 			if(from != NULL) {
+ 				fprintf(stderr, "Error: --profiles is not allowed in a profile\n");
+ 				exit(1);
+ 			}
+ 			opt->profileFile = optarg;
+ 			break;
+ 		case OPT_DMI:
+ 			dmiDir = optarg;
+ 			break;
+ 		case OPT_ACPI:
+ 			opt->acpi = 1;
+ 			break;
+ 		case OPT_ACPI_TABLES:
+ 			acpiDir = optarg;
+ 			break;
+ 		case OPT_WHAT_IF:
+ 			if(opt->nWhatIf == WHATIF_MAX_FILES) {
+ 				fprintf(stderr, "Error: at most %d residency files\n", WHATIF_MAX_FILES);
+ 				exit(1);
+ 			}
+ 			opt->whatIfFiles[opt->nWhatIf++] = optarg;
+ 			break;
+ 		case OPT_COMPARE:
+ 			opt->compareList = optarg;
+ 			break;
+ 		case OPT_COMPARE_TRIALS:
+ 			if(sscanf(optarg, "%d,%d", &opt->compareTrials, &opt->compareTrialMs) != 2 || opt->compareTrials < 1 || opt->compareTrialMs < 1) {
+ 				fprintf(stderr, "Error parsing '%s', it should be <trials>,<ms>\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_WORKLOAD:
+ 			opt->workload = optarg;
+ 			break;
+ 		case OPT_SMU:
+ 			opt->smuShow = 1;
+ 			break;
+ 		case OPT_SMU_SET:
+ 			if(smuLimitParse(opt->smuLimits, optarg)) {
+ 				fprintf(stderr, "Error parsing '%s', it should be ppt=<W>,tdc=<A>,edc=<A>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->smuSet = 1;
+ 			break;
+ 		case OPT_SMU_FILE:
+ 			smuFile = optarg;
+ 			break;
+ 		case OPT_POWER_LIMIT:
+ 			opt->limitShow = 1;
+ 			break;
+ 		case OPT_POWER_LIMIT_SET:
+ 			if(powerLimitParse(&opt->limit, optarg)) {
+ 				fprintf(stderr, "Error parsing '%s', it should be pl1=<W>,time1=<s>,pl2=<W>,time2=<s>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->limitSet = 1;
+ 			break;
+ 		case OPT_POWER_LIMIT_VERIFY:
+ 			opt->limitVerify = 1;
+ 			break;
+ 		case OPT_UNCORE:
+ 			opt->uncoreShow = 1;
+ 			break;
+ 		case OPT_UNCORE_SET:
+ 			if(hwpParse(&opt->uncoreReq, optarg) || opt->uncoreReq.desired >= 0 || opt->uncoreReq.epp >= 0) {
+ 				fprintf(stderr, "Error parsing '%s', it should be min=<ratio>,max=<ratio>\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->uncoreSet = 1;
+ 			break;
+ 		case OPT_BENCH_UNCORE:
+ 			opt->uncoreRatios = optarg;
+ 			break;
+ 		case OPT_FORCE_PSTATE:
+ 			opt->forcePstate = atoi(optarg);
+ 			if(opt->forcePstate < 0 || opt->forcePstate >= 8) {
+ 				fprintf(stderr, "P-state %d is out of bounds\n", opt->forcePstate);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_FORCE_RATIO:
+ 			opt->forceRatio = atoi(optarg);
+ 			if(opt->forceRatio <= 0 || opt->forceRatio > 0xFF) {
+ 				fprintf(stderr, "Invalid ratio '%s'\n", optarg);
+ 				exit(1);
+ 			}
+ 			break;
+ 		case OPT_POWER:
+ 			opt->power = 1;
+ 			break;
+ 		case OPT_CPUS:
+ 			if(cpuSetParse(&targetCpus, optarg)) {
+ 				fprintf(stderr, "Error parsing cpu list '%s', it should be like 0-3,8,10-15\n", optarg);
+ 				exit(1);
+ 			}
+ 			opt->cpusGiven = 1;
+ 			break;
+ 		case 'p':
+ 			div = 0.0;
+			n = sscanf(optarg, "%1d:%i,%f", &pstateId, &vid, &div);
+			if(n != 2 && n != 3) {
+				fprintf(stderr, "Error parsing '%s', it should be coreid:vid[,div]\n", optarg);
+				exit(1);
+			}
+ 			if(pstateId < 0 || pstateId >= 8) {
+ 				fprintf(stderr, "P-state %d is out of bounds\n", pstateId);
+ 				exit(1);
+ 			}
+ 			if(opt->vidToSet[pstateId] != 0) {
+ 				if(from != NULL)
+ 					fprintf(stderr, "Duplicate -p %d: option, also set by the profile selected in %s\n", pstateId, from);
+ 				else
+ 					fprintf(stderr, "Duplicate -p %d: option\n", pstateId);
+ 				exit(1);
+ 			}
+ 			opt->vidToSet[pstateId] = vid;
+ 			opt->divToSet[pstateId] = div;
+ 			opt->setPstates = 1;
+ 			if(verbose) printf("vid 0x%x/%d / %.4fV, div %.02f to set for pstate %d\n", vid, vid, voltage(vid), div, pstateId);
+ 			break;
+ 		default:
+ 			if(optind != (nargs -1)){
+ 				fprintf(stderr, "Invalid argument %s\n", args[optind - 1]);
+ 				usage(args[0]);
+ 				exit(EXIT_FAILURE);
+ 			}
+ 			else {
+	 			usage(args[0]);
+	 			exit(0);
+ 			}
+ 		}
+    }
+}
+
+/** main
+ *
+ * setup, scan command line options, check the validity of the command
+ * line options, and apply the commands. */
+int main (int argc, char **argv)
+{
+	int i, maxPstate, minPstate, pstateCmds, simCpus, simPackages, simSmt;
+	uint64_t val, * status;
+	struct pstateTable t;
+	long simLatencyNs;
+	struct daemonCtx d;
+	struct options opt = {
+		.intervalMs = 100,
+		.transitionUs = GOV_TRANSITION_US,
+		.forcePstate = -1,
+		.compareTrials = COMPARE_TRIALS,
+		.compareTrialMs = COMPARE_TRIAL_MS
+	};
+	int nargs;
+	char ** args;
+
+	parseArgs(argc, argv, NULL, &opt);
+		/* --bench-scale : runs on the simulated backend only. */
+	if(opt.benchmark) {
+		if(!simActive() && simInit("cpus=256,packages=2,smt=2,latency=20")) {
+			fprintf(stderr, "Error setting up the simulated backend\n");
+			exit(1);
+		}
+		simTopology(&simCpus, &simPackages, &simSmt, &simLatencyNs);
+		exit(benchScale(simCpus, simPackages, simSmt, simLatencyNs));
+	}
+		/* --pstate-table : replay offline, on the recorded machine's table. */
+	if(opt.tableFile != NULL) {
+		if(opt.traceFile == NULL) {
+			fprintf(stderr, "--pstate-table requires --governor-eval\n");
+			exit(1);
+		}
+		exit(evalGovernors(opt.traceFile, opt.tableFile, opt.intervalMs, opt.transitionUs));
+	}
+	if(!simActive() && cpuIdCheck())
+		exit(1);
+		/* --profiles : parse the options of the profile matching this
+		 * machine as if they followed the command line ones. */
+	if(opt.profileFile != NULL && opt.compareList == NULL) {
+		if(profileSelect(opt.profileFile, NULL, argv[0], &nargs, &args))
+			exit(1);
+			/* The options point into args, kept until exit. */
+		parseArgs(nargs, args, opt.profileFile, &opt);
+	}
+	if(!opt.cpusGiven)
+		cpuSetFill(&targetCpus, ncpu);
+	else if(cpuSetNext(&targetCpus, ncpu) >= 0 || cpuSetCount(&targetCpus) == 0) {
+		fprintf(stderr, "Error: cpu list must select cpus among 0-%d\n", ncpu - 1);
+		exit(1);
+	}
+	if((opt.smuShow || opt.smuSet) && !isFamily17h() && smuFile == NULL) {
+		fprintf(stderr, "Error: SMU commands need an AMD Family 17h or later processor\n");
+		exit(1);
+	}
+	if((opt.cppcShow || opt.cppcSet) && !isFamily17h()) {
+		fprintf(stderr, "Error: CPPC commands need an AMD Family 17h or later processor\n");
+		exit(1);
+	}
+	if((opt.hwpShow || opt.hwpSet || opt.forceRatio > 0 || opt.uncoreShow || opt.uncoreSet || opt.uncoreRatios != NULL
+			|| opt.limitShow || opt.limitSet || opt.limitVerify) && cpuVendor != VENDOR_INTEL) {
+		fprintf(stderr, "Error: HWP, ratio, uncore and power limit commands need an Intel processor\n");
+		exit(1);
+	}
+	if(opt.gov != NULL && (opt.gov->flags & GOV_SLO) && sloTargetUs <= 0) {
+		fprintf(stderr, "Error: the slo policy needs --slo-target\n");
+		exit(1);
+	}
+	if(opt.loadGiven && (opt.gov == NULL || !(opt.gov->flags & GOV_SLO))) {
+		fprintf(stderr, "Error: --slo-load runs with -g slo\n");
+		exit(1);
+	}
+	if((rtFloor >= 0 || thermalLimit > 0 || apuDir != NULL) && opt.gov == NULL) {
+		fprintf(stderr, "Error: --rt-floor, --thermal-limit and --apu need a governor, -g\n");
+		exit(1);
+	}
+	if(fanSpec != NULL && thermalLimit <= 0) {
+		fprintf(stderr, "Error: --fan runs with --thermal-limit\n");
+		exit(1);
+	}
+	if(opt.setPstates && opt.offsetGiven) {
+		fprintf(stderr, "Error: use either -p or --offset\n");
+		exit(1);
+	}
+	opt.setPstates |= opt.offsetGiven;
+	if(opt.compareList != NULL && (opt.profileFile == NULL || opt.setPstates)) {
+		fprintf(stderr, "Error: --compare takes the profiles of --profiles, not -p or --offset\n");
+		exit(1);
+	}
+	pstateCmds = opt.read || opt.current || opt.top || opt.setPstates || opt.gov != NULL || opt.traceFile != NULL || opt.resident
+		|| opt.forcePstate >= 0 || opt.forceRatio > 0 || opt.acpi || opt.nWhatIf || opt.compareList != NULL;
+		/* Newer AMD processors : only the CPPC and power commands and -r
+		 * apply. Intel processors : the bus ratios stand for P-states, but
+		 * there are no Vids to set. */
+	if((!isFamily14h() && (opt.setPstates || opt.nWhatIf || opt.compareList != NULL)) || (cpuVendor == VENDOR_INTEL && opt.resident && opt.gov == NULL)
+			|| (isFamily17h() && (opt.current || opt.top || opt.gov != NULL || opt.traceFile != NULL || opt.resident || opt.forcePstate >= 0 || opt.acpi))) {
+		fprintf(stderr, "Error: P-state commands need an AMD Family 14h processor\n");
+		exit(1);
+	}
+	if(opt.hwpSet && applyPerfRequest(&hwpRegs, &opt.hwpReq))
+		exit(1);
+	if(opt.hwpShow && showHwp())
+		exit(1);
+	if(opt.cppcSet && applyPerfRequest(&cppcRegs, &opt.cppcReq))
+		exit(1);
+	if(opt.smuSet && applySmu(opt.smuLimits))
+		exit(1);
+	if(opt.smuShow && showSmu())
+		exit(1);
+	if(opt.uncoreSet && applyUncore(&opt.uncoreReq, 1))
+		exit(1);
+	if(opt.uncoreShow && showUncore())
+		exit(1);
+	if(opt.limitSet && applyPowerLimits(&opt.limit))
+		exit(1);
+	if(opt.limitShow && showPowerLimits())
+		exit(1);
+	if(opt.limitVerify && verifyPowerLimits(opt.intervalMs))
+		exit(1);
+	if(opt.uncoreRatios != NULL)
+		exit(benchUncore(opt.uncoreRatios));
+	if(isFamily17h()) {
+			/* -r shows the CPPC state beside the legacy P-states. */
+		if(opt.read && (showF17hPstates(cpuSetNext(&targetCpus, 0)) || showCppc()))
+			exit(1);
+		if(opt.cppcShow && !opt.read && showCppc())
+			exit(1);
+	}
+	if(!isFamily14h() && (isFamily17h() || !pstateCmds)) {
+		if(opt.power && showPower(opt.intervalMs))
+			exit(1);
+		exit(0);
+	}
+		/** Get maxPstate and minPstate. */
+	if(loadPstateTable(cpuSetNext(&targetCpus, 0), &t)) {
+		fprintf(stderr, "Failed reading msr register. Is the msr module loaded?\n");
+		exit(1);
+	}
+	maxPstate = t.max;
+	minPstate = t.min;
+	if(cpuVendor == VENDOR_INTEL && (opt.forcePstate >= 0 || opt.forceRatio > 0 || opt.gov != NULL) && cpuHwp
+			&& rdmsr(cpuSetNext(&targetCpus, 0), MSR_PM_ENABLE, &val) == 0 && PM_ENABLE_HWP_ENABLE(val))
+		fprintf(stderr, "Warning: HWP is enabled, IA32_PERF_CTL requests are ignored\n");
+	if(minPstate != 0) {
+		if(verbose) printf("Beware! Highest performance P-states are desactivated.\n");
+	}
+		/* Now check to see if the input is correct. */
+	for(i = 0; i < 8; i++) {
+		if(opt.vidToSet[i] != 0 && (i > maxPstate || i < minPstate)) {
+			fprintf(stderr, "Error: P-state %d is not valid\n", i);
+		}
+	}
+		/* read command : read the MSR registers and display all */
+	if(opt.read && cpuVendor == VENDOR_INTEL) {
+		printf("P-state\t\tRatio\t\tMHz\n");
+		for(i = minPstate; i <= maxPstate; i++)
+			printf("  %d\t\t%d\t\t%d\n", i, t.ratio[i], 100 * t.ratio[i]);
+	}
+	else if(opt.read) {
+		printf("P-state\t\tVid\t\tVoltage\t\tdiv\n");
+		for(i = minPstate; i <= maxPstate; i++)
+			printf("  %d\t\t0x%lX\t\t%.4fV\t\t%.02f\n", i, t.vid[i], voltage(t.vid[i]), t.div[i]);
+	}
+		/* --acpi : the firmware view of the same P-states. */
+	if(opt.acpi && showAcpi(&t))
+		exit(1);
+		/* --offset : the same shift for all P-states. */
+	if(opt.offsetGiven && offsetVids(&t, opt.offsetMv, opt.vidToSet)) {
+		fprintf(stderr, "Error reading MSR register 0x%X\n", MSR_COFVID_STATUS);
+		exit(1);
+	}
+		/* --what-if : estimate the proposed values instead of writing them. */
+	if(opt.nWhatIf)
+		exit(whatIf(opt.whatIfFiles, opt.nWhatIf, &t, opt.vidToSet, opt.divToSet, opt.offsetGiven ? &opt.offsetMv : NULL));
+		/* --compare : the profiles in turn, then the P-states as found. */
+	if(opt.compareList != NULL)
+		exit(compareProfiles(opt.profileFile, opt.compareList, argv[0], &t, opt.workload, opt.compareTrials, opt.compareTrialMs));
+		/* write new Vid values in MSR registers, if any has been set. */
+	if(applyPstates(opt.vidToSet, opt.divToSet, minPstate, maxPstate))
+		exit(1);
+		/* --force-pstate, --force-ratio : pin the cores. */
+	if(opt.forcePstate >= 0 || opt.forceRatio > 0) {
+		if(opt.forcePstate > maxPstate || (opt.forcePstate >= 0 && opt.forcePstate < minPstate)) {
+			fprintf(stderr, "Error: P-state %d is not valid\n", opt.forcePstate);
+			exit(1);
+		}
+		if(forcePstates(&t, opt.forcePstate, opt.forceRatio))
+			exit(1);
+	}
+		/* Command -c : read the current state of the cpu cores. */
+	if(opt.current) {
+		if((status = calloc(ncpu, sizeof(*status))) == NULL || readCurrent(status)) {
+			fprintf(stderr, "Error reading MSR register 0x%" PRIX64 "\n", (uint64_t)MSR_CURRENT_STATUS);
+			exit(1);
+		}
+		forEachCpu(i, &targetCpus) {
+			val = status[i];
+			if(cpuVendor == VENDOR_INTEL)
+				printf("CPU %d: current P-state: %d, current ratio: %" PRIu64 "/%" PRIu64 " MHz, current voltage: %.4fV\n", i,
+					pstateOfRatio(&t, PERF_STATUS_RATIO(val)), PERF_STATUS_RATIO(val), 100 * PERF_STATUS_RATIO(val),
+					PERF_STATUS_VOLTAGE(val) / 8192.0);
+			else
+				printf("CPU %d: current P-state: %" PRIu64 ", current Vid: 0x%" PRIX64 "/%.4fV, current div: %.02f\n", i, COFVID_STATUS_CUR_PSTATE(val), COFVID_STATUS_CUR_VID(val), voltage(COFVID_STATUS_CUR_VID(val)), msrtodiv(val));
+		}
+	}
+		/* --power : measured or estimated over one interval. */
+	if(opt.power && showPower(opt.intervalMs))
+		exit(1);
+		/* --governor-eval : replay a trace on the P-state table just set. */
+	if(opt.traceFile != NULL && evalGovernors(opt.traceFile, NULL, opt.intervalMs, opt.transitionUs))
+		exit(1);
+		/* Command -t : interactive, runs until the user quits. */
+	if(opt.top && runTui(opt.intervalMs))
+		exit(1);
+		/* Commands -d and -g : stay resident, so they come last. */
+	if(opt.resident || opt.gov != NULL) {
+		memset(&d, 0, sizeof(d));
+		d.vidToSet = opt.vidToSet;
+		d.divToSet = opt.divToSet;
+		d.minPstate = minPstate;
+		d.maxPstate = maxPstate;
+		d.intervalMs = opt.intervalMs;
+		d.gov = opt.gov;
+		d.load = opt.loadGiven ? &opt.load : NULL;
+		if(runDaemon(&d, opt.socketPath))
+			exit(1);
+	}
+	exit(0);
+}
+
+	/** Open msr device descriptors indexed by cpu, so that repeated
+	 * accesses (sampling, governor) do not pay an open and close each. */
+static int * msrFds = NULL, nMsrFds = 0;
+
+/* Grow the descriptor cache to hold cpu. Not thread safe, the threaded
+ * backend calls it before starting its workers. */
+static int msrFdReserve(int cpu) {
+	int * fds, k;
+
+	if(cpu < nMsrFds)
+		return (0);
+	if((fds = realloc(msrFds, (cpu + 1) * sizeof(*fds))) == NULL) {
+		perror("Caching msr device");
+		return (1);
+	}
+	for(k = nMsrFds; k <= cpu; k++)
+		fds[k] = -1;
+	msrFds = fds;
+	nMsrFds = cpu + 1;
+	return (0);
+}
+
+/** msrFd
+ *
+ * Return the cached descriptor of /dev/cpu/cpu_no/msr, opening it on first
+ * use. */
+static int msrFd(int cpu) {
+	char path[512];
+
+	if(msrFdReserve(cpu))
+		return (-1);
+	if(msrFds[cpu] < 0) {
+		snprintf(path, 512, "/dev/cpu/%d/msr", cpu);
+		if((msrFds[cpu] = open(path, O_RDWR | O_CLOEXEC)) < 0)
+			perror("Open msr device");
+	}
+	return msrFds[cpu];
+}
+
+/*****************************************************************************
+ * Simulated msr backend.
+ *
+ * An in-memory register file with a configurable topology and an injected
+ * latency per cross-cpu access, so that everything above rdmsr/wrmsr can be
+ * exercised and benchmarked without the hardware. It models a Family 14h
+ * part: registers are per thread, per core (shared by SMT siblings) or per
+ * package, and writing PstateCmd moves the core to the requested P-state.
+ * The Intel architectural registers are there too, for vendor=intel, and
+ * the CPPC registers and RAPL energy counters, which advance at a constant
+ * power, for Family 17h (family=0x17) and Intel. On Family 17h the P-state
+ * definitions are rewritten in that family's layout.
+ */
+
+enum { SIM_THREAD, SIM_CORE, SIM_PACKAGE };
+
+	/** Voltage of an Intel bus ratio in IA32_PERF_STATUS units (1/8192 V). */
+#define SIM_RATIO_VOLTAGE(ratio)	(uint64_t)((0.6 + 0.015 * (ratio)) * 8192)
+
+static const struct simReg {
+	off_t msr;
+	int scope;
+	uint64_t init;
+} simRegs[] = {
+	{MSR_MPERF, SIM_THREAD, 0},
+	{MSR_APERF, SIM_THREAD, 0},
+	{MSR_PSTATE_LIMIT, SIM_CORE, 0x20},
+	{MSR_PSTATE_CTL, SIM_CORE, 0},
+	{MSR_PSTATE_STATUS, SIM_CORE, 0},
+	{MSR_PSTATE_DEF + 0, SIM_CORE, REG_ENCODE(PSTATE_DEF, EN, 1) | REG_ENCODE(PSTATE_DEF, VID, 0x28)},
+	{MSR_PSTATE_DEF + 1, SIM_CORE, REG_ENCODE(PSTATE_DEF, EN, 1) | REG_ENCODE(PSTATE_DEF, VID, 0x30) | REG_ENCODE(PSTATE_DEF, DID_LSD, 2)},
+	{MSR_PSTATE_DEF + 2, SIM_CORE, REG_ENCODE(PSTATE_DEF, EN, 1) | REG_ENCODE(PSTATE_DEF, VID, 0x38) | REG_ENCODE(PSTATE_DEF, DID_MSD, 2)},
+	{MSR_PSTATE_DEF + 3, SIM_CORE, 0},
+	{MSR_PSTATE_DEF + 4, SIM_CORE, 0},
+	{MSR_PSTATE_DEF + 5, SIM_CORE, 0},
+	{MSR_PSTATE_DEF + 6, SIM_CORE, 0},
+	{MSR_PSTATE_DEF + 7, SIM_CORE, 0},
+	{MSR_COFVID_STATUS, SIM_CORE, REG_ENCODE(COFVID_STATUS, CUR_VID, 0x28) | REG_ENCODE(COFVID_STATUS, MAX_VID, 0x10)
+		| REG_ENCODE(COFVID_STATUS, MIN_VID, 0x48)},
+	{MSR_PLATFORM_INFO, SIM_PACKAGE, REG_ENCODE(PLATFORM_INFO, MAX_NON_TURBO_RATIO, 30)
+		| REG_ENCODE(PLATFORM_INFO, MAX_EFFICIENCY_RATIO, 8)},
+	{MSR_OC_MAILBOX, SIM_PACKAGE, 0},
+	{MSR_PERF_STATUS, SIM_THREAD, REG_ENCODE(PERF_STATUS, RATIO, 30) | REG_ENCODE(PERF_STATUS, VOLTAGE, SIM_RATIO_VOLTAGE(30))},
+	{MSR_PERF_CTL, SIM_THREAD, REG_ENCODE(PERF_CTL, RATIO, 30)},
+	{MSR_UNCORE_RATIO_LIMIT, SIM_PACKAGE, REG_ENCODE(UNCORE_RATIO_LIMIT, MIN_RATIO, 8) | REG_ENCODE(UNCORE_RATIO_LIMIT, MAX_RATIO, 24)},
+	{MSR_UNCORE_PERF_STATUS, SIM_PACKAGE, REG_ENCODE(UNCORE_PERF_STATUS, CURRENT_RATIO, 24)},
+	{MSR_PM_ENABLE, SIM_PACKAGE, REG_ENCODE(PM_ENABLE, HWP_ENABLE, 1)},
+	{MSR_HWP_CAPABILITIES, SIM_THREAD, REG_ENCODE(HWP_CAPABILITIES, HIGHEST, 45) | REG_ENCODE(HWP_CAPABILITIES, GUARANTEED, 30)
+		| REG_ENCODE(HWP_CAPABILITIES, EFFICIENT, 12) | REG_ENCODE(HWP_CAPABILITIES, LOWEST, 8)},
+	{MSR_HWP_REQUEST_PKG, SIM_PACKAGE, 0},
+	{MSR_HWP_REQUEST, SIM_THREAD, REG_ENCODE(HWP_REQUEST, MIN, 8) | REG_ENCODE(HWP_REQUEST, MAX, 45)
+		| REG_ENCODE(HWP_REQUEST, EPP, 128)},
+	{MSR_CPPC_CAP1, SIM_THREAD, REG_ENCODE(CPPC_CAP1, LOWEST, 20) | REG_ENCODE(CPPC_CAP1, LOWEST_NONLINEAR, 55)
+		| REG_ENCODE(CPPC_CAP1, NOMINAL, 120) | REG_ENCODE(CPPC_CAP1, HIGHEST, 166)},
+	{MSR_CPPC_ENABLE, SIM_THREAD, REG_ENCODE(CPPC_ENABLE, EN, 1)},
+	{MSR_CPPC_CAP2, SIM_THREAD, REG_ENCODE(CPPC_CAP2, CONSTRAINED, 166)},
+	{MSR_CPPC_REQ, SIM_THREAD, REG_ENCODE(CPPC_REQ, MAX, 166) | REG_ENCODE(CPPC_REQ, MIN, 55)
+		| REG_ENCODE(CPPC_REQ, EPP, 128)},
+	{MSR_AMD_RAPL_PWR_UNIT, SIM_PACKAGE, REG_ENCODE(AMD_RAPL_PWR_UNIT, POWER, 3) | REG_ENCODE(AMD_RAPL_PWR_UNIT, ENERGY, 16)
+		| REG_ENCODE(AMD_RAPL_PWR_UNIT, TIME, 10)},
+	{MSR_AMD_CORE_ENERGY, SIM_CORE, 0},
+	{MSR_AMD_PKG_ENERGY, SIM_PACKAGE, 0},
+	{MSR_RAPL_POWER_UNIT, SIM_PACKAGE, REG_ENCODE(RAPL_POWER_UNIT, POWER, 3) | REG_ENCODE(RAPL_POWER_UNIT, ENERGY, 14)
+		| REG_ENCODE(RAPL_POWER_UNIT, TIME, 10)},
+	{MSR_PKG_POWER_LIMIT, SIM_PACKAGE, REG_ENCODE(PKG_POWER_LIMIT, PL1, 120) | REG_ENCODE(PKG_POWER_LIMIT, PL1_EN, 1)
+		| REG_ENCODE(PKG_POWER_LIMIT, PL1_TIME_Y, 14) | REG_ENCODE(PKG_POWER_LIMIT, PL1_TIME_Z, 3)
+		| REG_ENCODE(PKG_POWER_LIMIT, PL2, 200) | REG_ENCODE(PKG_POWER_LIMIT, PL2_EN, 1)
+		| REG_ENCODE(PKG_POWER_LIMIT, PL2_TIME_Y, 1)},
+	{MSR_PKG_ENERGY_STATUS, SIM_PACKAGE, 0},
+	{MSR_PP0_ENERGY_STATUS, SIM_PACKAGE, 0}
+};
+
+	/** Constant power of the simulated RAPL domains, in W. */
+#define SIM_PKG_WATTS	15.0
+#define SIM_CORE_WATTS	2.0
+
+	/** Simulated package temperature: ambient in degrees Celsius, thermal
+	 * resistance in C/W and time constant in s without airflow, and how
+	 * many times the fan at full duty multiplies the conductance. */
+#define SIM_AMBIENT	40.0
+#define SIM_THERMAL_R	6.0
+#define SIM_THERMAL_TAU	20.0
+#define SIM_FAN_GAIN	2.0
+
+#define SIM_NREGS	(int)(sizeof(simRegs) / sizeof(simRegs[0]))
+
+static struct {
+	int cpus, packages, smt;
+	long latencyNs;
+	double startNs, tempC, tempNs;
+	uint64_t * vals[SIM_NREGS];
+} sim;
+
+	/** The cpu the calling thread runs on as far as the simulation is
+	 * concerned; accesses to it do not pay the cross-cpu latency. */
+static __thread int simLocalCpu = -1;
+
+static void simDelay(void) {
+	struct timespec ts;
+
+	if(sim.latencyNs <= 0)
+		return;
+	ts.tv_sec = sim.latencyNs / 1000000000L;
+	ts.tv_nsec = sim.latencyNs % 1000000000L;
+	nanosleep(&ts, NULL);
+}
+
+/* Return the storage of a register for a cpu, or NULL for an unknown
+ * register, which reads as EIO like on the hardware. */
+static uint64_t * simSlot(int cpu, off_t msr, int * reg) {
+	int r, perPackage;
+
+	for(r = 0; r < SIM_NREGS; r++)
+		if(simRegs[r].msr == msr)
+			break;
+	if(r == SIM_NREGS || cpu < 0 || cpu >= sim.cpus)
+		return NULL;
+	*reg = r;
+	switch(simRegs[r].scope) {
+	case SIM_CORE:
+		return &sim.vals[r][cpu / sim.smt];
+	case SIM_PACKAGE:
+		perPackage = (sim.cpus + sim.packages - 1) / sim.packages;
+		return &sim.vals[r][cpu / perPackage];
+	default:
+		return &sim.vals[r][cpu];
+	}
+}
+
+static int simRead(int cpu, off_t msr, uint64_t * val) {
+	uint64_t * p, pstate, step;
+	double watts;
+	int r, esu;
+
+	if(cpu != simLocalCpu)
+		simDelay();
+	if((p = simSlot(cpu, msr, &r)) == NULL) {
+		errno = EIO;
+		return (1);
+	}
+		/* Clock counters advance at the frequency of the current P-state. */
+	if(msr == MSR_MPERF || msr == MSR_APERF) {
+		step = 100000;
+		if(msr == MSR_APERF && cpuVendor == VENDOR_INTEL) {
+			simSlot(cpu, MSR_PERF_STATUS, &r);
+			step = step * PERF_STATUS_RATIO(sim.vals[r][cpu]) / 30;
+		}
+		else if(msr == MSR_APERF) {
+			simSlot(cpu, MSR_PSTATE_STATUS, &r);
+			pstate = PSTATE_STATUS_CUR_PSTATE(sim.vals[r][cpu / sim.smt]);
+			simSlot(cpu, MSR_PSTATE_DEF + pstate, &r);
+			step = (uint64_t)(step / msrtodiv(sim.vals[r][cpu / sim.smt]));
+		}
+		*val = __atomic_add_fetch(p, step, __ATOMIC_RELAXED);
+		return (0);
+	}
+		/* Energy counters: 32 bits, in units of 1/2^ESU J. */
+	if(msr == MSR_AMD_PKG_ENERGY || msr == MSR_AMD_CORE_ENERGY || msr == MSR_PKG_ENERGY_STATUS || msr == MSR_PP0_ENERGY_STATUS) {
+		watts = msr == MSR_AMD_CORE_ENERGY ? SIM_CORE_WATTS
+			: msr == MSR_PP0_ENERGY_STATUS ? SIM_PKG_WATTS * 0.6 : SIM_PKG_WATTS;
+		esu = msr == MSR_AMD_PKG_ENERGY || msr == MSR_AMD_CORE_ENERGY ? 16 : 14;
+		*val = (uint64_t)((nowNs() - sim.startNs) / 1e9 * watts * (1 << esu)) & 0xFFFFFFFF;
+		return (0);
+	}
+	*val = __atomic_load_n(p, __ATOMIC_RELAXED);
+	return (0);
+}
+
+static int simWrite(int cpu, off_t msr, uint64_t val) {
+	uint64_t * p, * q, def;
+	int r;
+
+	if(cpu != simLocalCpu)
+		simDelay();
+	if((p = simSlot(cpu, msr, &r)) == NULL) {
+		errno = EIO;
+		return (1);
+	}
+	__atomic_store_n(p, val, __ATOMIC_RELAXED);
+		/* The mailbox answers at once, with success. */
+	if(msr == MSR_OC_MAILBOX)
+		__atomic_store_n(p, val & ~(REG_ENCODE(OC_MAILBOX, BUSY, ~0) | REG_ENCODE(OC_MAILBOX, CMD, ~0)),
+			__ATOMIC_RELAXED);
+	if(msr == MSR_UNCORE_RATIO_LIMIT) {
+		q = simSlot(cpu, MSR_UNCORE_PERF_STATUS, &r);
+		__atomic_store_n(q, REG_ENCODE(UNCORE_PERF_STATUS, CURRENT_RATIO, UNCORE_RATIO_LIMIT_MAX_RATIO(val)), __ATOMIC_RELAXED);
+	}
+	if(msr == MSR_PERF_CTL) {
+		q = simSlot(cpu, MSR_PERF_STATUS, &r);
+		__atomic_store_n(q, REG_ENCODE(PERF_STATUS, RATIO, PERF_CTL_RATIO(val))
+			| REG_ENCODE(PERF_STATUS, VOLTAGE, SIM_RATIO_VOLTAGE(PERF_CTL_RATIO(val))), __ATOMIC_RELAXED);
+	}
+	if(msr == MSR_PSTATE_CTL) {
+		q = simSlot(cpu, MSR_PSTATE_STATUS, &r);
+		__atomic_store_n(q, PSTATE_STATUS_CUR_PSTATE_set(0, PSTATE_CTL_CMD(val)), __ATOMIC_RELAXED);
+		q = simSlot(cpu, MSR_PSTATE_DEF + PSTATE_CTL_CMD(val), &r);
+		def = __atomic_load_n(q, __ATOMIC_RELAXED);
+		q = simSlot(cpu, MSR_COFVID_STATUS, &r);
+		__atomic_store_n(q, (*q & (REG_ENCODE(COFVID_STATUS, MAX_VID, ~0) | REG_ENCODE(COFVID_STATUS, MIN_VID, ~0)))
+			| REG_ENCODE(COFVID_STATUS, CUR_PSTATE, PSTATE_CTL_CMD(val))
+			| REG_ENCODE(COFVID_STATUS, CUR_VID, PSTATE_DEF_VID(def))
+			| REG_ENCODE(COFVID_STATUS, CUR_DID_MSD, PSTATE_DEF_DID_MSD(def))
+			| REG_ENCODE(COFVID_STATUS, CUR_DID_LSD, PSTATE_DEF_DID_LSD(def)), __ATOMIC_RELAXED);
+	}
+	return (0);
+}
+
+/** simSetup
+ *
+ * (Re)instantiate the simulated backend and make it the msr backend. */
+static void simSetup(int cpus, int packages, int smt, long latencyNs) {
+	int r, k, slots;
+
+	sim.cpus = cpus;
+	sim.packages = packages < 1 ? 1 : (packages > cpus ? cpus : packages);
+	sim.smt = smt < 1 ? 1 : smt;
+	sim.latencyNs = latencyNs;
+	sim.startNs = nowNs();
+	for(r = 0; r < SIM_NREGS; r++) {
+		slots = simRegs[r].scope == SIM_PACKAGE ? sim.packages : cpus;
+		free(sim.vals[r]);
+		if((sim.vals[r] = malloc(slots * sizeof(uint64_t))) == NULL) {
+			perror("Allocating simulated registers");
+			exit(1);
+		}
+		for(k = 0; k < slots; k++)
+			sim.vals[r][k] = simRegs[r].init;
+	}
+	ncpu = cpus;
+		/* Sub-millisecond sleeps should not be rounded up by the default
+		 * 50 us timer slack. */
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+/** simInit
+ *
+ * Parse a simulated topology, cpus=<n>,packages=<n>,smt=<n>,latency=<us>,
+ * vendor=<amd|intel>,family=<n>, and switch to the simulated backend. */
+static int simInit(const char * spec) {
+	int cpus = 2, packages = 1, smt = 1, vendor = VENDOR_AMD, family = 0, v, r, k;
+	double latency = 0;
+	const char * p = spec;
+	char key[16];
+	int used;
+
+	while(*p != '\0') {
+		if(sscanf(p, "%15[a-z]=%n", key, &used) != 1)
+			return (1);
+		p += used;
+		if(strcmp(key, "latency") == 0) {
+			if(sscanf(p, "%lf%n", &latency, &used) != 1 || latency < 0)
+				return (1);
+		}
+		else if(strcmp(key, "vendor") == 0) {
+			if(strncmp(p, "amd", 3) == 0)
+				vendor = VENDOR_AMD;
+			else if(strncmp(p, "intel", 5) == 0)
+				vendor = VENDOR_INTEL;
+			else
+				return (1);
+			used = vendor == VENDOR_AMD ? 3 : 5;
+		}
+		else if(strcmp(key, "family") == 0) {
+			if(sscanf(p, "%i%n", &family, &used) != 1 || family < 1)
+				return (1);
+		}
+		else {
+			if(sscanf(p, "%d%n", &v, &used) != 1 || v < 1)
+				return (1);
+			if(strcmp(key, "cpus") == 0)
+				cpus = v;
+			else if(strcmp(key, "packages") == 0)
+				packages = v;
+			else if(strcmp(key, "smt") == 0)
+				smt = v;
+			else
+				return (1);
+		}
+		p += used;
+		if(*p == ',')
+			p++;
+	}
+	if(cpus > SIM_MAX_CPUS || cpus % smt != 0)
+		return (1);
+	simSetup(cpus, packages, smt, (long)(latency * 1000));
+	cpuVendor = vendor;
+	cpuFamily = family ? family : (vendor == VENDOR_AMD ? 0x14 : 6);
+	cpuModel = vendor == VENDOR_INTEL ? 0x55 : (cpuFamily == 0x14 ? 2 : 1);
+	cpuHwp = vendor == VENDOR_INTEL;
+	if(isFamily17h()) {
+		simSlot(0, MSR_PSTATE_DEF, &r);
+		for(k = 0; k < cpus; k++) {
+			sim.vals[r][k] = REG_ENCODE(F17H_PSTATE_DEF, EN, 1) | REG_ENCODE(F17H_PSTATE_DEF, FID, 0x90)
+				| REG_ENCODE(F17H_PSTATE_DEF, DFS_ID, 8) | REG_ENCODE(F17H_PSTATE_DEF, VID, 0x48);
+			sim.vals[r + 1][k] = REG_ENCODE(F17H_PSTATE_DEF, EN, 1) | REG_ENCODE(F17H_PSTATE_DEF, FID, 0x78)
+				| REG_ENCODE(F17H_PSTATE_DEF, DFS_ID, 8) | REG_ENCODE(F17H_PSTATE_DEF, VID, 0x58);
+			sim.vals[r + 2][k] = REG_ENCODE(F17H_PSTATE_DEF, EN, 1) | REG_ENCODE(F17H_PSTATE_DEF, FID, 0x60)
+				| REG_ENCODE(F17H_PSTATE_DEF, DFS_ID, 8) | REG_ENCODE(F17H_PSTATE_DEF, VID, 0x68);
+		}
+	}
+	return (0);
+}
+
+/** simTemperature
+ *
+ * Advance the RC model of the simulated package, heated by SIM_CORE_WATTS
+ * per core scaled by V^2 * f of its current P-state and cooled the more the
+ * duty of --fan. */
+static double simTemperature(void) {
+	double now = nowNs(), watts = 0, v, tInf, g = 1 + SIM_FAN_GAIN * (fan.open ? fan.duty : 0);
+	uint64_t val;
+	int r, k;
+
+	simSlot(0, MSR_COFVID_STATUS, &r);
+	for(k = 0; k < sim.cpus / sim.smt; k++) {
+		val = __atomic_load_n(&sim.vals[r][k], __ATOMIC_RELAXED);
+		v = voltage(COFVID_STATUS_CUR_VID(val));
+		watts += SIM_CORE_WATTS * v * v / msrtodiv(val);
+	}
+	tInf = SIM_AMBIENT + SIM_THERMAL_R / g * watts;
+	if(sim.tempNs == 0)
+		sim.tempC = SIM_AMBIENT;
+	else
+		sim.tempC = tInf + (sim.tempC - tInf) * exp(-(now - sim.tempNs) / 1e9 * g / SIM_THERMAL_TAU);
+	sim.tempNs = now;
+	return sim.tempC;
+}
+
+static int simActive(void) {
+	return sim.cpus > 0;
+}
+
+static void simTopology(int * cpus, int * packages, int * smt, long * latencyNs) {
+	*cpus = sim.cpus;
+	*packages = sim.packages;
+	*smt = sim.smt;
+	*latencyNs = sim.latencyNs;
+}
+
+/** wrmsr
+ *
+ * This function writes an msr register according to its parameters. Uses
+ * /dev/cpu/cpu_no/msr. Requires root privileges. */
+int wrmsr(int cpu, off_t msr, uint64_t val) {
+	int fd, reg;
+
+	if(verbose)
+		printf("cpu %d msr %" PRIX64 " value %" PRIX64 "\n", cpu, msr, val);
+	if(sim.cpus > 0) {
+		if(simWrite(cpu, msr, val)) {
+			perror("Write msr register");
+			return (1);
+		}
+	}
+	else {
+		if ((fd = msrFd(cpu)) < 0)
+			return (1);
+		if (pwrite(fd, &val, sizeof(val), msr) < (ssize_t)sizeof(val)) {
+			perror("Write msr register");
+			return (1);
+		}
+	}
+	if(verbose) {
+		printf("msr %" PRIX64 " = %" PRIX64 "\n", msr, val);
+		if((reg = regFind(SPACE_MSR, msr)) >= 0)
+			regPrint(stdout, reg, val);
+	}
+	return (0);
+}
+
+/** rdmsr
+ *
+ * This function reads an msr register according to its parameters. Uses
+ * /dev/cpu/cpu_no/msr. Requires root privileges. */
+int rdmsr(int cpu, off_t msr, uint64_t * pVal) {
+	int fd, reg;
+
+	if(verbose)
+		printf("cpu %d msr %" PRIX64 "\n", cpu, msr);
+	if(sim.cpus > 0) {
+		if(simRead(cpu, msr, pVal)) {
+			perror("Read msr register");
+			return (1);
+		}
+	}
+	else {
+		if ((fd = msrFd(cpu)) < 0)
+			return (1);
+		if (pread(fd, pVal, sizeof(* pVal), msr) < (ssize_t)sizeof(* pVal)) {
+			perror("Read msr register");
+			return (1);
+		}
+	}
+	if(verbose) {
+		printf("msr %" PRIX64 " = %" PRIX64 "\n", msr, *pVal);
+		if((reg = regFind(SPACE_MSR, msr)) >= 0)
+			regPrint(stdout, reg, *pVal);
+	}
+	return (0);
+}
+
+/*****************************************************************************
+ * Batched accesses.
+ *
+ * Commands touching many cpus build a list of accesses and hand it to
+ * msrBatch(), which runs it with the selected backend:
+ * serial	one access after the other from the calling thread.
+ * threaded	cpus are spread over worker threads, so that the cross-cpu
+ *		latency of each access overlaps with the others.
+ * batched	accesses are grouped per cpu and the calling thread migrates
+ *		to each cpu in turn, so the msr driver runs them locally instead
+ *		of sending an interrupt per access.
+ */
+
+static int msrOpRun(struct msrOp * op) {
+	op->err = op->write ? wrmsr(op->cpu, op->msr, op->val) : rdmsr(op->cpu, op->msr, &op->val);
+	return op->err;
+}
+
+static int batchSerial(struct msrOp * ops, int n) {
+	int i, failed = 0;
+
+	for(i = 0; i < n; i++)
+		failed += msrOpRun(&ops[i]) != 0;
+	return failed;
+}
+
+struct batchWorker {
+	pthread_t tid;
+	struct msrOp * ops;
+	int n, w, nw, failed;
+};
+
+static void * batchWorkerRun(void * arg) {
+	struct batchWorker * b = arg;
+	int i;
+
+	for(i = 0; i < b->n; i++)
+		if(b->ops[i].cpu % b->nw == b->w)
+			b->failed += msrOpRun(&b->ops[i]) != 0;
+	return NULL;
+}
+
+static int batchThreaded(struct msrOp * ops, int n) {
+	struct batchWorker * b;
+	int i, nw, maxCpu = 0, failed = 0;
+
+	for(i = 0; i < n; i++)
+		if(ops[i].cpu > maxCpu)
+			maxCpu = ops[i].cpu;
+	nw = msrThreads > 0 ? msrThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(nw > maxCpu + 1)
+		nw = maxCpu + 1;
+	if(nw <= 1 || (sim.cpus == 0 && msrFdReserve(maxCpu)))
+		return batchSerial(ops, n);
+	if((b = calloc(nw, sizeof(*b))) == NULL)
+		return batchSerial(ops, n);
+		/* Each cpu belongs to a single worker, which keeps the accesses
+		 * to a cpu in order. */
+	for(i = 0; i < nw; i++) {
+		b[i].ops = ops;
+		b[i].n = n;
+		b[i].w = i;
+		b[i].nw = nw;
+		if(i > 0 && pthread_create(&b[i].tid, NULL, batchWorkerRun, &b[i]) != 0)
+			b[i].nw = 0;
+	}
+	batchWorkerRun(&b[0]);
+	for(i = 1; i < nw; i++) {
+		if(b[i].nw == 0) {
+				/* Could not start that worker, do its share here. */
+			b[i].nw = nw;
+			batchWorkerRun(&b[i]);
+		}
+		else
+			pthread_join(b[i].tid, NULL);
+		failed += b[i].failed;
+	}
+	failed += b[0].failed;
+	free(b);
+	return failed;
+}
+
+static int opCpuCompare(const void * a, const void * b) {
+	const struct msrOp * const * x = a, * const * y = b;
+
+	if((*x)->cpu != (*y)->cpu)
+		return (*x)->cpu - (*y)->cpu;
+	return (*x < *y) ? -1 : (*x > *y);
+}
+
+static int batchGrouped(struct msrOp * ops, int n) {
+	struct msrOp ** order;
+	cpu_set_t saved, one;
+	int i, failed = 0, restore = 0, cpu = -1;
+
+	if((order = malloc(n * sizeof(*order))) == NULL)
+		return batchSerial(ops, n);
+	for(i = 0; i < n; i++)
+		order[i] = &ops[i];
+	qsort(order, n, sizeof(*order), opCpuCompare);
+	if(sim.cpus == 0)
+		restore = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+	for(i = 0; i < n; i++) {
+		if(order[i]->cpu != cpu) {
+			cpu = order[i]->cpu;
+			if(sim.cpus > 0) {
+					/* Migrating costs about one cross-cpu access. */
+				simDelay();
+				simLocalCpu = cpu;
+			}
+			else if(restore && cpu < CPU_SETSIZE) {
+				CPU_ZERO(&one);
+				CPU_SET(cpu, &one);
+				sched_setaffinity(0, sizeof(one), &one);
+			}
+		}
+		failed += msrOpRun(order[i]) != 0;
+	}
+	simLocalCpu = -1;
+	if(restore)
+		sched_setaffinity(0, sizeof(saved), &saved);
+	free(order);
+	return failed;
+}
+
+/** msrBatch
+ *
+ * Run a list of msr accesses with the selected backend. Accesses to the
+ * same cpu are done in list order. Returns the number of failed accesses,
+ * each of which has its err field set. */
+static int msrBatch(struct msrOp * ops, int n) {
+	switch(msrBackend) {
+	case BACKEND_THREADED:
+		return batchThreaded(ops, n);
+	case BACKEND_BATCHED:
+		return batchGrouped(ops, n);
+	default:
+		return batchSerial(ops, n);
+	}
+}